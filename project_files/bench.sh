@@ -0,0 +1,93 @@
+#!/bin/bash
+
+# Scalability sweep: for every N in the range generates a testfile (gen_testfile), runs main_bench on it with
+# '--phase-report' and prints the per phase times against N. Everything is kept in the output directory.
+#
+# Script usage: ./bench.sh <N_from> <N_to> [out_dir]
+# Environment:
+#   SEED=1               seed of gen_testfile, the same seed gives the same testfiles
+#   EVENTS_PER_CLIENT=4  TAKE_BOOK/DONATE_BOOK events per client (gen_testfile -e)
+#   GEN_ARGS=""          more gen_testfile options, e.g. "-z 1.2 -t path"
+#   MPIRUN_ARGS="--hostfile host_file"
+#   BIN=main_bench       the binary to run ('make bench' builds it)
+#   TIMEOUT=600          seconds per run
+
+if [ $# -lt 2 ]; then
+    echo "Script usage: $0 <N_from> <N_to> [out_dir]"
+    exit 1
+fi
+
+N_FROM=$1
+N_TO=$2
+OUT=${3:-bench_$(date +%Y%m%d_%H%M%S)}
+SEED=${SEED:-1}
+EVENTS_PER_CLIENT=${EVENTS_PER_CLIENT:-4}
+MPIRUN_ARGS=${MPIRUN_ARGS:---hostfile host_file}
+BIN=${BIN:-main_bench}
+TIMEOUT=${TIMEOUT:-600}
+
+make $BIN gen_testfile > /dev/null || exit 1
+sed -i 's/\r//' host_file
+mkdir -p $OUT
+
+# All the phase reports in one file: N,num_libs,processes,phase,count,total_s,mean_s,max_s,span_s
+echo "N,num_libs,processes,phase,count,total_s,mean_s,max_s,span_s" > $OUT/phases.csv
+
+for N in $(seq $N_FROM $N_TO); do
+    NP=$((N*N + (N*N*N)/2 + 1))
+    NUM_LIBS=$((N*N))
+    EVENTS=$((EVENTS_PER_CLIENT * (N*N*N)/2))
+
+    ./gen_testfile -n $N -s $SEED -e $EVENTS $GEN_ARGS > $OUT/testfile_$N.txt 2> /dev/null
+    echo "SHUTDOWN" >> $OUT/testfile_$N.txt
+
+    echo "N=$N NP=$NP events=$EVENTS ..."
+    timeout $TIMEOUT mpirun -np $NP $MPIRUN_ARGS ./$BIN $NUM_LIBS $OUT/testfile_$N.txt \
+        --phase-report $OUT/phases_$N.csv > $OUT/run_$N.log 2>&1
+    STATUS=$?
+
+    if [ $STATUS -ne 0 ] || [ ! -f $OUT/phases_$N.csv ]; then
+        echo "N=$N failed (exit $STATUS), see $OUT/run_$N.log"
+        continue
+    fi
+    if grep -aq "FAIL" $OUT/run_$N.log; then
+        echo "N=$N: a check failed, see $OUT/run_$N.log"
+    fi
+
+    tail -n +2 $OUT/phases_$N.csv | sed "s/^/$N,/" >> $OUT/phases.csv
+done
+
+
+# Scaling table: mean time of a line of every phase (ms, the whole run for 'total') and, in brackets, its growth
+# since the previous N. A phase stops scaling where its growth gets well above the growth of the processes.
+awk -F, '
+NR == 1 { next }
+{
+    if(!($1 in seen)) { seen[$1] = 1; ns[n++] = $1; np[$1] = $3 }
+    if(!($4 in pseen)) { pseen[$4] = 1; phases[p++] = $4 }
+    mean[$1, $4] = ($5 > 0) ? $7 * 1000 : -1
+}
+END {
+    printf "%4s %6s", "N", "NP"
+    for(j = 0; j < p; j++) printf " %18s", phases[j]
+    printf "\n"
+    for(i = 0; i < n; i++)
+    {
+        N = ns[i]
+        printf "%4d %6d", N, np[N]
+        for(j = 0; j < p; j++)
+        {
+            m = mean[N, phases[j]]
+            if(m < 0 || m == "") { printf " %18s", "-"; continue }
+            prev = (i > 0) ? mean[ns[i-1], phases[j]] : -1
+            if(prev > 0)
+                printf " %10.3f (x%4.1f)", m, m / prev
+            else
+                printf " %10.3f       ", m
+        }
+        if(i > 0) printf "   NP x%.1f", np[N] / np[ns[i-1]]
+        printf "\n"
+    }
+}' $OUT/phases.csv | tee $OUT/scaling.txt
+
+echo "Results in $OUT (phases.csv, scaling.txt, run_<N>.log)"
@@ -10,4 +10,8 @@ typedef struct {
 } book_t;
 
 
+// The l_id of the library that owns the catalog entry of b_id. Ids outside of the N*N*N catalog wrap around the grid.
+#define BOOK_OWNER_LID(b_id, N)     (((b_id) / (N)) % ((N)*(N)))
+
+
 #endif
\ No newline at end of file
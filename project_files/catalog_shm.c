@@ -0,0 +1,212 @@
+#include "catalog_shm.h"
+
+#include "my_funcs.h"
+
+
+static int enabled = 0;
+static MPI_Comm node_comm = MPI_COMM_NULL;
+static MPI_Win win = MPI_WIN_NULL;
+static int my_l_id = -1;
+static shared_book_t *mine = NULL;             // Our window.
+static shared_book_t **catalogs = NULL;        // Per l_id, the window of a library of this node, NULL for the rest.
+static int *node_l_ids = NULL;                 // The libraries of this node.
+static int node_size = 0;
+static int libs_num = 0;
+
+
+/*
+* Every rank calls it (MPI_Comm_split_type() is collective over MPI_COMM_WORLD), the libraries with is_library 1.
+*/
+void catalog_shm_init(int is_library)
+{
+    int rank;
+
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_split_type(MPI_COMM_WORLD, is_library ? MPI_COMM_TYPE_SHARED : MPI_UNDEFINED, rank, MPI_INFO_NULL, &node_comm);
+    enabled = is_library && node_comm != MPI_COMM_NULL;
+}
+
+
+int catalog_shm_enabled()
+{
+    return enabled;
+}
+
+
+/*
+* Allocates the window of a library and maps the windows of the other libraries of the node, every library of the node
+* calls it. The library adds its books (catalog_shm_insert()) and calls catalog_shm_ready() before it lends anything.
+* @return 0, or -1 if shared catalogs are off.
+*/
+int catalog_shm_attach(int l_id, int num_libs)
+{
+    shared_book_t *base;
+    MPI_Aint size;
+    int disp_unit, r, i;
+
+
+    if(!enabled)
+        return -1;
+
+    my_l_id = l_id;
+    libs_num = num_libs;
+    MPI_Win_allocate_shared(CATALOG_SHM_SLOTS * sizeof(shared_book_t), sizeof(shared_book_t), MPI_INFO_NULL, node_comm,
+                            &mine, &win);
+    for(i = 0; i < CATALOG_SHM_SLOTS; i++)
+    {
+        atomic_init(&mine[i].b_id, -1);
+        atomic_init(&mine[i].available, 0);
+    }
+
+    MPI_Comm_size(node_comm, &node_size);
+    node_l_ids = (int *) MyCalloc(node_size, sizeof(int));
+    MPI_Allgather(&l_id, 1, MPI_INT, node_l_ids, 1, MPI_INT, node_comm);
+
+    catalogs = (shared_book_t **) MyCalloc(libs_num, sizeof(shared_book_t *));
+    for(r = 0; r < node_size; r++)
+    {
+        MPI_Win_shared_query(win, r, &size, &disp_unit, &base);
+        if(node_l_ids[r] >= 0 && node_l_ids[r] < libs_num)
+            catalogs[node_l_ids[r]] = base;
+    }
+
+    return 0;
+}
+
+
+/*
+* Waits until every library of the node has filled its window.
+*/
+void catalog_shm_ready()
+{
+    if(enabled)
+        MPI_Barrier(node_comm);
+}
+
+
+void catalog_shm_detach()
+{
+    if(!enabled)
+        return;
+
+    MPI_Win_free(&win);     // Collective, nobody unmaps a window while another library of the node may still use it.
+    MPI_Comm_free(&node_comm);
+    free(catalogs);
+    free(node_l_ids);
+    catalogs = NULL;
+    node_l_ids = NULL;
+    enabled = 0;
+}
+
+
+static unsigned slot_of(int b_id)
+{
+    return ((unsigned)b_id * 2654435761u) & (CATALOG_SHM_SLOTS - 1);
+}
+
+
+/*
+* @return The entry of b_id in a window, NULL if it isn't there.
+*/
+static shared_book_t *find(shared_book_t *table, int b_id)
+{
+    unsigned slot = slot_of(b_id);
+    int i, id;
+
+
+    for(i = 0; i < CATALOG_SHM_SLOTS; i++)
+    {
+        id = atomic_load_explicit(&table[slot].b_id, memory_order_acquire);
+        if(id == b_id)
+            return &table[slot];
+        if(id == -1)
+            return NULL;
+        slot = (slot + 1) & (CATALOG_SHM_SLOTS - 1);
+    }
+
+    return NULL;
+}
+
+
+/*
+* Adds a book to our window, only our library adds to it (a threaded library with its catalog write lock).
+* @return The entry, or NULL if the window is full (the book stays in the private list).
+*/
+shared_book_t *catalog_shm_insert(int b_id, int cost, int available)
+{
+    unsigned slot = slot_of(b_id);
+    int i;
+
+
+    if(mine == NULL)
+        return NULL;
+
+    for(i = 0; i < CATALOG_SHM_SLOTS; i++)
+    {
+        if(atomic_load_explicit(&mine[slot].b_id, memory_order_relaxed) == -1)
+        {
+            mine[slot].cost = cost;
+            atomic_store_explicit(&mine[slot].available, available, memory_order_relaxed);
+            atomic_store_explicit(&mine[slot].b_id, b_id, memory_order_release);
+            return &mine[slot];
+        }
+        slot = (slot + 1) & (CATALOG_SHM_SLOTS - 1);
+    }
+
+    return NULL;
+}
+
+
+/*
+* Takes up to n_copies copies.
+* @return How many it took, 0 if there were none.
+*/
+int catalog_shm_take(shared_book_t *book, int n_copies)
+{
+    int available, taken;
+
+
+    available = atomic_load(&book->available);
+    do
+    {
+        if(available <= 0)
+            return 0;
+        taken = n_copies < available ? n_copies : available;
+    } while(!atomic_compare_exchange_weak(&book->available, &available, available - taken));
+
+    return taken;
+}
+
+
+/*
+* Takes a copy of b_id from another library of the node, the owner first.
+* @param owner_l_id The library that owns the catalog entry of the book (BOOK_OWNER_LID()).
+* @return 1 with the library that lent it and the cost of the book, 0 if no other library of the node has a copy.
+*/
+int catalog_shm_claim(int b_id, int owner_l_id, int *lender_l_id, int *cost)
+{
+    shared_book_t *book;
+    int r, l_id;
+
+
+    if(catalogs == NULL)
+        return 0;
+
+    for(r = -1; r < node_size; r++)
+    {
+        l_id = r < 0 ? owner_l_id : node_l_ids[r];
+        if(l_id == my_l_id || l_id < 0 || l_id >= libs_num || catalogs[l_id] == NULL || (r >= 0 && l_id == owner_l_id))
+            continue;
+
+        book = find(catalogs[l_id], b_id);
+        if(book != NULL && catalog_shm_take(book, 1) == 1)
+        {
+            *lender_l_id = l_id;
+            *cost = book->cost;
+            return 1;
+        }
+    }
+
+    return 0;
+}
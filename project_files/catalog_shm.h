@@ -0,0 +1,41 @@
+#ifndef CATALOG_SHM_H
+#define CATALOG_SHM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <mpi.h>
+
+
+/*
+* Shared memory catalogs ('--shared-catalog'). The libraries of a node (MPI_Comm_split_type(MPI_COMM_TYPE_SHARED)) keep
+* the copies of their books in a MPI_Win_allocate_shared() window, an open addressing table by b_id that only its
+* library adds to. A library that misses a book takes a copy from the window of another library of the node with an
+* atomic operation (the owner of the book first, like 'FIND_BOOK' would, then the libraries that got it donated), instead
+* of the 'FIND_BOOK' -> 'FOUND_BOOK' -> 'BOOK_REQUEST' -> 'ACK_TB' messages. Only when no library of the node has a copy
+* the lookup goes through the messages (to the other nodes, or to the waitlist of the owner).
+*/
+#define CATALOG_SHM_SLOTS 1024          // Entries of a window (a power of 2), the books after that stay private.
+
+
+typedef struct {
+
+    atomic_int b_id;                    // -1: empty. Written last, the entry is complete once it's there.
+    atomic_int available;               // Copies the library has, every library of the node takes them atomically.
+    int cost;
+
+} shared_book_t;
+
+
+void catalog_shm_init(int is_library);
+int catalog_shm_enabled();
+int catalog_shm_attach(int l_id, int num_libs);
+void catalog_shm_ready();
+void catalog_shm_detach();
+
+shared_book_t *catalog_shm_insert(int b_id, int cost, int available);
+int catalog_shm_take(shared_book_t *book, int n_copies);
+int catalog_shm_claim(int b_id, int owner_l_id, int *lender_l_id, int *cost);
+
+#endif
@@ -32,6 +32,46 @@ void clear_client(borrower_t *client)
     if(client->voters != NULL)
         free(client->voters);
 
+    if(client->voter_heights != NULL)
+        free(client->voter_heights);
+
+    if(client->voter_loads != NULL)
+        free(client->voter_loads);
+
+    if(client->echo.children != NULL)
+        free(client->echo.children);
+    if(client->echo.recv[0] != NULL)
+        free(client->echo.recv[0]);
+    if(client->echo.recv[1] != NULL)
+        free(client->echo.recv[1]);
+
+    while(client->deferred != NULL)
+    {
+        deferred_msg_t *next = client->deferred->next;
+
+        free(client->deferred->msg);
+        free(client->deferred);
+        client->deferred = next;
+    }
+
+    while(client->book_list != NULL)
+    {
+        borrower_book_t *next = client->book_list->next;
+
+        while(client->book_list->lenders != NULL)
+        {
+            book_lender_t *next_lender = client->book_list->lenders->next;
+
+            free(client->book_list->lenders);
+            client->book_list->lenders = next_lender;
+        }
+        free(client->book_list);
+        client->book_list = next;
+    }
+
+    epoch_counter_free(&client->loans);
+    epoch_counter_free(&client->returns);
+
     memset(client, 0, sizeof(borrower_t));
 }
 
@@ -92,7 +132,7 @@ void event_client_connect(int neighbor_rank, borrower_t *client)
             // Send "ACK" to the coordinator
             memset(buffer_send, 0, sizeof(buffer_send));
             strcpy(buffer_send, "ACK");
-            MPI_Send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_ACK, MPI_COMM_WORLD);
+            comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_ACK, MPI_COMM_WORLD);
             
             return;
         }
@@ -105,18 +145,18 @@ void event_client_connect(int neighbor_rank, borrower_t *client)
     memset(buffer_send, 0, sizeof(buffer_send));
     strcpy(buffer_send, "NEIGHBOR ");
     strcat(buffer_send, client->str_rank);
-    MPI_Send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, neighbor_rank, TAG_NEIGHBOR, MPI_COMM_WORLD);     // +1 so that the '\0' is included in the sent message
+    comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, neighbor_rank, TAG_NEIGHBOR, MPI_COMM_WORLD);     // +1 so that the '\0' is included in the sent message
 
 
     // Wait for "ACK" from the neighbor.
-    MPI_Recv(buffer_recv, sizeof(buffer_recv), MPI_CHAR, neighbor_rank, TAG_ACK, MPI_COMM_WORLD, &status);
+    comm_recv(buffer_recv, sizeof(buffer_recv), MPI_CHAR, neighbor_rank, TAG_ACK, MPI_COMM_WORLD, &status);
     print_debug("Client rank %d got '%s' from rank %d for the 'NEIGHBOR' event", client->rank, buffer_recv, neighbor_rank);
 
 
     // Send "ACK" to the coordinator
     memset(buffer_send, 0, sizeof(buffer_send));
     strcpy(buffer_send, "ACK");
-    MPI_Send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_ACK, MPI_COMM_WORLD);     // +1 so that the '\0' is included in the sent message
+    comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_ACK, MPI_COMM_WORLD);     // +1 so that the '\0' is included in the sent message
 }
 
 
@@ -136,39 +176,265 @@ void event_client_neighbor(int neighbor_rank, borrower_t *client)
     // Send "ACK" to the neighbor
     memset(buffer_send, 0, sizeof(buffer_send));
     strcpy(buffer_send, "ACK");
-    MPI_Send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, neighbor_rank, TAG_ACK, MPI_COMM_WORLD);     // +1 so that the '\0' is included in the sent message
+    comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, neighbor_rank, TAG_ACK, MPI_COMM_WORLD);     // +1 so that the '\0' is included in the sent message
 }
 
 
+#define CLIENT_ELECTION_MAXRANK 0
+#define CLIENT_ELECTION_CENTER 1
+#define CLIENT_ELECTION_ECHO 2
+
+static int client_election = CLIENT_ELECTION_MAXRANK;
+
+
 /*
-* Handle the "START_LE_LOANERS" event.
-* Send an "ELECT" message to my neighbor
+* '--client-election maxrank|center': who the borrowers elect once the "ELECT" messages met.
+*   maxrank - the node that got "ELECT" from all its neighbors, or the bigger rank of the two that sent it to each other.
+*   center  - the center of the tree, the borrower whose farthest borrower is the closest. Every "ELECT" carries how far
+*             the farthest borrower behind it is, so the node(s) where the messages met know it for every neighbor and
+*             'CENTER' walks towards the farthest subtree while that brings the farthest borrower closer. If the tree has
+*             two centers the one that holds fewer books wins, then the bigger rank.
+*   echo    - for graphs with cycles, where "ELECT" never gets to the last neighbor: an echo wave with extinction elects
+*             the biggest rank and 'BFS' rounds build a BFS tree from it (event_client_start_wave()). The coordinator asks
+*             for it with 'START_LE_LOANERS echo' when the CONNECT lines close a cycle.
+* @return 0, or -1 if the name isn't known.
 */
-void event_client_start_le_loaners(borrower_t *client)
+int client_set_election(const char *name)
+{
+    if(strcmp(name, "maxrank") == 0)
+        client_election = CLIENT_ELECTION_MAXRANK;
+    else if(strcmp(name, "center") == 0)
+        client_election = CLIENT_ELECTION_CENTER;
+    else if(strcmp(name, "echo") == 0)
+        client_election = CLIENT_ELECTION_ECHO;
+    else
+        return -1;
+    return 0;
+}
+
+
+/*
+* Books the client holds.
+*/
+static int client_load(borrower_t *client)
+{
+    borrower_book_t *book;
+    int load = 0;
+
+
+    for(book = client->book_list; book != NULL; book = book->next)
+        load += book->loan_num - book->returned_num;
+    return load;
+}
+
+
+/*
+* @return How far the farthest borrower behind the voters is from me, 0 if no neighbor voted.
+*/
+static int voters_height(borrower_t *client)
+{
+    int i, height = 0;
+
+
+    for(i = 0; i < client->votes; i++)
+    {
+        if(client->voter_heights[i] + 1 > height)
+            height = client->voter_heights[i] + 1;
+    }
+    return height;
+}
+
+
+/*
+* Sends "ELECT <height> <load>" to the neighbor.
+*/
+static void send_elect(borrower_t *client, int neighbor_rank)
 {
     char buffer_send[BUF_SIZE];
 
 
-    // You are a leaf node
-    if(client->neightbors_size == 1)
+    memset(buffer_send, 0, sizeof(buffer_send));
+    strcpy(buffer_send, "ELECT ");
+    strcat_int(buffer_send, voters_height(client));
+    strcat(buffer_send, " ");
+    strcat_int(buffer_send, client_load(client));
+    comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, neighbor_rank, TAG_CLIENT_ELECT, MPI_COMM_WORLD);     // +1 so that the '\0' is included in the sent message
+    client->sent_elect_to = neighbor_rank;
+}
+
+
+/*
+* When the neighbors i sent "LE_LOANERS" to acked, my subtree has the leader: "LE_LOANERS_ACK <nodes> <depth>" goes to
+* the neighbor that sent it to me, or the leader prints how far it got.
+*/
+static void announce_check_done(borrower_t *client)
+{
+    char buffer_send[BUF_SIZE];
+
+
+    if(client->announce_acks > 0)
+        return;
+
+    if(client->announce_parent == 0)
+    {
+        print_info(GRN"Client leader %d: 'LE_LOANERS' reached %d borrowers, %d hops deep."reset, client->rank, client->announce_nodes, client->announce_depth);
+        return;
+    }
+
+    memset(buffer_send, 0, sizeof(buffer_send));
+    strcpy(buffer_send, "LE_LOANERS_ACK ");
+    strcat_int(buffer_send, client->announce_nodes);
+    strcat(buffer_send, " ");
+    strcat_int(buffer_send, client->announce_depth);
+    comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, client->announce_parent, TAG_CLIENT_LEADER_SELECTED, MPI_COMM_WORLD);
+}
+
+
+/*
+* The leader notifies the neighbors about the end of the LE and then the coordinator.
+* @param eccentricity How far the farthest borrower is.
+*/
+static void client_announce_leader(borrower_t *client, int eccentricity)
+{
+    char buffer_send[BUF_SIZE];
+    int i;
+
+
+    print_info(HGRN"---------------Client rank %d (c_id %d) elected rank %d as leader.---------------"reset, client->rank, client->c_id, client->leader_rank);
+    print_info(GRN"Leader client is going to send 'LE_LOANERS <leader_rank>' to it's neighbors (boardcasting to the SP)."reset);
+    print_info("Client leader %d: the farthest borrower is %d hops away", client->rank, eccentricity);
+    print_debug(UMAG"Debug is enabled. Clients will also print their neighbors."reset);
+
+    memset(buffer_send, 0, sizeof(buffer_send));
+    strcpy(buffer_send, "LE_LOANERS ");
+    strcat_int(buffer_send, client->leader_rank);
+
+    // Send the leader rank to the neighbors and they'll propagate it through the SP.
+    client->announce_parent = 0;
+    client->announce_nodes = 1;
+    client->announce_depth = 0;
+    for(i = 0; i < client->neightbors_size; i++)
     {
+        comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, client->neighbors[i], TAG_CLIENT_LEADER_SELECTED, MPI_COMM_WORLD);
+        client->announce_acks++;
+        print_info("Client leader %d sent 'LE_LOANERS' to %d", client->leader_rank, client->neighbors[i]);
+    }
+
+    // Let the coordinator go on, it doesn't wait for the acks (see client_defers()).
+    memset(buffer_send, 0, sizeof(buffer_send));
+    strcpy(buffer_send, "LE_LOANERS_DONE");
+    comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_LE_LOANERS_DONE, MPI_COMM_WORLD);
+    announce_check_done(client);
+}
+
+
+/*
+* '--client-election center': I know how far the farthest borrower is through every neighbor, the one through
+* from_rank (the neighbor i sent "ELECT" to) is from_height + 1. Moves towards the farthest one if that makes it closer.
+*/
+static void client_find_center(borrower_t *client, int from_rank, int from_height, int from_load)
+{
+    char buffer_send[BUF_SIZE];
+    int i, j, dist, load;
+    int far_rank = 0, far_load = 0, far = 0, second = 0;
+
+
+    for(i = 0; i < client->neightbors_size; i++)
+    {
+        dist = from_height + 1;
+        load = from_load;
+        for(j = 0; j < client->votes; j++)
+        {
+            if(client->voters[j] == client->neighbors[i])
+            {
+                dist = client->voter_heights[j] + 1;
+                load = client->voter_loads[j];
+                break;
+            }
+        }
+        if(j == client->votes && client->neighbors[i] != from_rank)
+        {
+            print_error("Client rank %d doesn't know how far the borrowers behind rank %d are", client->rank, client->neighbors[i]);
+            exit(-1);
+        }
+
+        if(dist > far)
+        {
+            second = far;
+            far = dist;
+            far_rank = client->neighbors[i];
+            far_load = load;
+        }
+        else if(dist > second)
+        {
+            second = dist;
+        }
+    }
+
+    // The neighbor is the center, or one of the two and it holds fewer books (or has the bigger rank).
+    if(far - second >= 2 || (far - second == 1 && (far_load < client_load(client) || (far_load == client_load(client) && far_rank > client->rank))))
+    {
+        print_debug("Client rank %d: the farthest borrower is %d hops away through rank %d (%d otherwise), sending 'CENTER'", client->rank, far, far_rank, second);
         memset(buffer_send, 0, sizeof(buffer_send));
-        strcpy(buffer_send, "ELECT");
-        MPI_Send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, client->neighbors[0], TAG_CLIENT_ELECT, MPI_COMM_WORLD);     // +1 so that the '\0' is included in the sent message
-        client->sent_elect_to = client->neighbors[0];
+        strcpy(buffer_send, "CENTER ");
+        strcat_int(buffer_send, second);
+        strcat(buffer_send, " ");
+        strcat_int(buffer_send, client_load(client));
+        strcat(buffer_send, far - second >= 2 ? " 0" : " 1");
+        comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, far_rank, TAG_CLIENT_ELECT, MPI_COMM_WORLD);
+        return;
+    }
+
+    client->leader_rank = client->rank;
+    client_announce_leader(client, far);
+}
+
+
+/*
+* Handle the "CENTER <height> <load> <final>" message: the sender is a neighbor i sent "ELECT" to, the farthest borrower
+* behind it is height hops from it. With final set the sender already decided that i'm the center.
+*/
+void event_client_center(borrower_t *client, int sender_rank, int height, int load, int final)
+{
+    int far;
 
+
+    if(final)
+    {
+        far = voters_height(client);
+        if(height + 1 > far)
+            far = height + 1;
+        client->leader_rank = client->rank;
+        client_announce_leader(client, far);
+        return;
+    }
+    client_find_center(client, sender_rank, height, load);
+}
+
+
+/*
+* Handle the "START_LE_LOANERS" event.
+* Send an "ELECT" message to my neighbor
+*/
+void event_client_start_le_loaners(borrower_t *client)
+{
+    // You are a leaf node
+    if(client->neightbors_size == 1)
+    {
+        send_elect(client, client->neighbors[0]);
         print_info("Leaf node rank %d sent 'ELECT' to rank %d", client->rank, client->neighbors[0]);
     }
 }
 
 
 /*
-* Handle the "ELECT" message. Gather all the "ELECT" messages and then decide what to do.
+* Handle the "ELECT <height> <load>" message. Gather all the "ELECT" messages and then decide what to do.
 * Either send to the last neighbor (that didn't send an "ELECT" message) an "ELECT" message, or
 * choose youself to be the leader since you received "ELECT" from all your neighbors. In case
 * of 2 "ELECT" messages going through the same edge, the process with the highest rank wins.
+* With '--client-election center' the node where they met looks for the center of the tree instead.
 */
-void event_client_elect(borrower_t *client, int voter_rank)
+void event_client_elect(borrower_t *client, int voter_rank, int height, int load)
 {
     int i, j;
     char buffer_send[BUF_SIZE];
@@ -181,6 +447,10 @@ void event_client_elect(borrower_t *client, int voter_rank)
         exit(-1);
     }
 
+    client->voter_heights = (int *) MyRealloc(client->voter_heights, (client->votes + 1) * sizeof(int));
+    client->voter_loads = (int *) MyRealloc(client->voter_loads, (client->votes + 1) * sizeof(int));
+    client->voter_heights[client->votes] = height;
+    client->voter_loads[client->votes] = load;
 
     // First "ELECT" message
     if(client->voters == NULL)
@@ -211,19 +481,30 @@ void event_client_elect(borrower_t *client, int voter_rank)
 
 
         // Use the buffer_send to create a print with all my voters.
-        sprintf(buffer_send, "---Client rank %d voters: ", client->rank);
-        for(i = 0; i < client->votes; i++)
+        if(log_on(LOG_LEVEL_DEBUG))
         {
-            strcat_int(buffer_send, client->voters[i]);
-            strcat(buffer_send, "-");
+            sprintf(buffer_send, "---Client rank %d voters: ", client->rank);
+            for(i = 0; i < client->votes; i++)
+            {
+                strcat_int(buffer_send, client->voters[i]);
+                strcat(buffer_send, "-");
+            }
+            print_debug("%s--\n", buffer_send);
         }
-        print_debug("%s--\n", buffer_send);
     }
     
     print_debug("Client rank %d: votes=%d, neighbors=%d", client->rank, client->votes, client->neightbors_size);
     // If all neighbors sent "ELECT" i'm probably the leader.
     if(client->votes == client->neightbors_size)
     {
+        if(client_election == CLIENT_ELECTION_CENTER)
+        {
+            // Of the two nodes that sent "ELECT" to each other the bigger rank looks for the center, it knows as much.
+            if(client->sent_elect_to == 0 || client->rank > voter_rank)
+                client_find_center(client, 0, 0, 0);
+            return;
+        }
+
         // if i've sent "ELECT" compare our ranks (with the last neighbor that sent me an "ELECT").
         if(client->sent_elect_to != 0)
         {
@@ -240,45 +521,13 @@ void event_client_elect(borrower_t *client, int voter_rank)
         {
             client->leader_rank = client->rank;
         }
-        print_info(HGRN"---------------Client rank %d (c_id %d) elected rank %d as leader.---------------"reset, client->rank, client->c_id, client->leader_rank);
 
 
         // Leader must notify the neighbors about the end of the LE and then the coordinator.
         if(client->rank == client->leader_rank)
-        {
-            MPI_Status status;
-
-            print_info(GRN"Leader client is going to send 'LE_LOANERS <leader_rank>' to it's neighbors (boardcasting to the SP)."reset);
-            print_debug(UMAG"Debug is enabled. Clients will also print their neighbors."reset);
-
-            memset(buffer_send, 0, sizeof(buffer_send));
-            strcpy(buffer_send, "LE_LOANERS ");
-            strcat_int(buffer_send, client->leader_rank);
-
-            // Send the leader rank to the neighbors and they'll propagate it through the SP.
-            for(i = 0; i < client->neightbors_size; i++)
-            {
-                MPI_Send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, client->neighbors[i], TAG_CLIENT_LEADER_SELECTED, MPI_COMM_WORLD);
-                print_info("Client leader %d sent 'LE_LOANERS' to %d", client->leader_rank, client->neighbors[i]);
-            }
-
-            // Wait for 'ACK'
-            for(i = 0; i < client->neightbors_size; i++)
-            {
-                memset(buffer_send, 0, sizeof(buffer_send));
-                MPI_Recv(buffer_send, sizeof(buffer_send), MPI_CHAR, client->neighbors[i], TAG_ACK, MPI_COMM_WORLD, &status);
-                if(strcmp(buffer_send, "ACK") != 0)
-                {
-                    print_error("Client %d didn't get 'ACK' from neighbor rank %d but instead got %s", client->rank, client->neighbors[i], buffer_send);
-                }
-                print_info("Client leader %d got 'ACK' from rank %d", client->leader_rank, client->neighbors[i]);
-            }
-
-            // Send "LE_LOANERS_DONE" to the coordinator with the leader rank.
-            memset(buffer_send, 0, sizeof(buffer_send));
-            strcpy(buffer_send, "LE_LOANERS_DONE");
-            MPI_Send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_LE_LOANERS_DONE, MPI_COMM_WORLD);
-        }
+            client_announce_leader(client, voters_height(client));
+        else
+            print_info(HGRN"---------------Client rank %d (c_id %d) elected rank %d as leader.---------------"reset, client->rank, client->c_id, client->leader_rank);
     }
     else if(client->votes == (client->neightbors_size - 1))     // Send "ELECT" to the neighbor that's left.
     {
@@ -299,43 +548,359 @@ void event_client_elect(borrower_t *client, int voter_rank)
 
             if(flag == 0)
             {
-                memset(buffer_send, 0, sizeof(buffer_send));
-                strcpy(buffer_send, "ELECT");
-                MPI_Send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, client->neighbors[i], TAG_CLIENT_ELECT, MPI_COMM_WORLD);     // +1 so that the '\0' is included in the sent message
-                client->sent_elect_to = client->neighbors[i];
+                send_elect(client, client->neighbors[i]);
                 print_debug("-----Rank %d sent 'ELECT' to it's last neighbor rank %d", client->rank, client->neighbors[i]);
                 break;
             }
         }
     }
-// End of function
+// End of function
+}
+
+
+#define BFS_NONE -2             // No distance from the neighbor for the round yet.
+
+
+static int neighbor_index(borrower_t *client, int rank)
+{
+    int i;
+
+
+    for(i = 0; i < client->neightbors_size; i++)
+    {
+        if(client->neighbors[i] == rank)
+            return i;
+    }
+    print_error("Client rank %d got an election message from rank %d, which isn't its neighbor", client->rank, rank);
+    exit(-1);
+}
+
+
+/*
+* Sends the message to every neighbor except one (0: all of them), on TAG_CLIENT_ELECT.
+*/
+static void send_to_neighbors(borrower_t *client, const char *msg, int except_rank)
+{
+    int i;
+
+
+    for(i = 0; i < client->neightbors_size; i++)
+    {
+        if(client->neighbors[i] != except_rank)
+            comm_send(msg, strlen(msg) + 1, MPI_CHAR, client->neighbors[i], TAG_CLIENT_ELECT, MPI_COMM_WORLD);
+    }
+}
+
+
+static void bfs_start(borrower_t *client, int rounds);
+
+
+/*
+* Every neighbor answered the wave: "WAVE_ECHO <wave> <size> <depth>" to the parent, or the initiator won.
+*/
+static void wave_check_done(borrower_t *client)
+{
+    echo_state_t *e = &client->echo;
+    char buffer_send[BUF_SIZE];
+
+
+    if(e->pending > 0)
+        return;
+
+    if(e->parent == client->rank)
+    {
+        print_info(GRN"Client rank %d won the echo election, its wave reached %d borrowers and is %d hops deep."reset, client->rank, e->size, e->depth);
+        bfs_start(client, e->depth);
+        return;
+    }
+
+    memset(buffer_send, 0, sizeof(buffer_send));
+    strcpy(buffer_send, "WAVE_ECHO ");
+    strcat_int(buffer_send, e->wave);
+    strcat(buffer_send, " ");
+    strcat_int(buffer_send, e->size);
+    strcat(buffer_send, " ");
+    strcat_int(buffer_send, e->depth);
+    comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, e->parent, TAG_CLIENT_ELECT, MPI_COMM_WORLD);
+}
+
+
+/*
+* Joins the wave of initiator (myself if parent_rank is my rank) and sends it on to the other neighbors.
+*/
+static void wave_join(borrower_t *client, int initiator, int parent_rank)
+{
+    echo_state_t *e = &client->echo;
+    char buffer_send[BUF_SIZE];
+
+
+    e->wave = initiator;
+    e->parent = parent_rank;
+    e->pending = client->neightbors_size - (parent_rank != client->rank);
+    e->size = 1;
+    e->depth = 0;
+
+    memset(buffer_send, 0, sizeof(buffer_send));
+    strcpy(buffer_send, "WAVE ");
+    strcat_int(buffer_send, initiator);
+    send_to_neighbors(client, buffer_send, parent_rank);
+    wave_check_done(client);
+}
+
+
+/*
+* Handle "START_LE_LOANERS echo": every borrower starts a wave with its rank, unless it's in a bigger one already.
+*/
+void event_client_start_wave(borrower_t *client)
+{
+    if(client->neightbors_size > 0 && client->echo.wave < client->rank)
+        wave_join(client, client->rank, client->rank);
+}
+
+
+/*
+* Handle "WAVE <initiator>". A bigger wave takes over (the smaller ones die out, their initiators never hear back from
+* everyone), the same wave from a neighbor that isn't my parent answers mine on that link.
+*/
+void event_client_wave(borrower_t *client, int sender_rank, int initiator)
+{
+    if(initiator > client->echo.wave)
+    {
+        wave_join(client, initiator, sender_rank);
+    }
+    else if(initiator == client->echo.wave)
+    {
+        client->echo.pending--;
+        wave_check_done(client);
+    }
+}
+
+
+/*
+* Handle "WAVE_ECHO <initiator> <size> <depth>" from a child in the wave.
+*/
+void event_client_wave_echo(borrower_t *client, int initiator, int size, int depth)
+{
+    echo_state_t *e = &client->echo;
+
+
+    if(initiator != e->wave)
+        return;
+
+    e->size += size;
+    if(depth + 1 > e->depth)
+        e->depth = depth + 1;
+    e->pending--;
+    wave_check_done(client);
+}
+
+
+/*
+* Sends "BFS <round> <dist> <rounds>" to every neighbor, or "BFS_END <1 if you're my parent>" after the last round.
+*/
+static void bfs_send(borrower_t *client)
+{
+    echo_state_t *e = &client->echo;
+    char buffer_send[BUF_SIZE];
+    int i;
+
+
+    for(i = 0; i < client->neightbors_size; i++)
+    {
+        memset(buffer_send, 0, sizeof(buffer_send));
+        if(e->round <= e->rounds)
+        {
+            strcpy(buffer_send, "BFS ");
+            strcat_int(buffer_send, e->round);
+            strcat(buffer_send, " ");
+            strcat_int(buffer_send, e->dist);
+            strcat(buffer_send, " ");
+            strcat_int(buffer_send, e->rounds);
+        }
+        else
+        {
+            strcpy(buffer_send, "BFS_END ");
+            strcat(buffer_send, client->neighbors[i] == e->parent ? "1" : "0");
+        }
+        comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, client->neighbors[i], TAG_CLIENT_ELECT, MPI_COMM_WORLD);
+    }
+}
+
+
+/*
+* The BFS tree is done below me: only its links are my neighbors from now on, so the announcement and the broadcasts
+* after it run over the tree. "BFS_ECHO <depth>" goes to the parent, or the leader announces itself.
+*/
+static void bfs_check_done(borrower_t *client)
+{
+    echo_state_t *e = &client->echo;
+    char buffer_send[BUF_SIZE];
+    int i;
+
+
+    if(e->round != e->rounds + 1 || e->ends < client->neightbors_size || e->echoes < e->children_num)
+        return;
+    e->round++;                 // Done, for good.
+
+    client->neightbors_size = 0;
+    if(e->parent != client->rank)
+        client->neighbors[client->neightbors_size++] = e->parent;
+    for(i = 0; i < e->children_num; i++)
+        client->neighbors[client->neightbors_size++] = e->children[i];
+    free(e->recv[0]);
+    free(e->recv[1]);
+    e->recv[0] = e->recv[1] = NULL;
+
+    if(e->parent == client->rank)
+    {
+        client->leader_rank = client->rank;
+        client_announce_leader(client, e->depth);
+        return;
+    }
+
+    memset(buffer_send, 0, sizeof(buffer_send));
+    strcpy(buffer_send, "BFS_ECHO ");
+    strcat_int(buffer_send, e->depth);
+    comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, e->parent, TAG_CLIENT_ELECT, MPI_COMM_WORLD);
+}
+
+
+/*
+* Ends the rounds that have the distances of all the neighbors. A distance is exact after that many rounds, the parent
+* is the neighbor that brought it first.
+*/
+static void bfs_advance(borrower_t *client)
+{
+    echo_state_t *e = &client->echo;
+    int i, parity;
+
+
+    while(e->round >= 1 && e->round <= e->rounds)
+    {
+        parity = e->round % 2;
+        for(i = 0; i < client->neightbors_size; i++)
+        {
+            if(e->recv[parity][i] == BFS_NONE)
+                return;
+        }
+
+        for(i = 0; i < client->neightbors_size; i++)
+        {
+            if(e->recv[parity][i] >= 0 && (e->dist < 0 || e->recv[parity][i] + 1 < e->dist))
+            {
+                e->dist = e->recv[parity][i] + 1;
+                e->parent = client->neighbors[i];
+            }
+            e->recv[parity][i] = BFS_NONE;
+        }
+
+        e->round++;
+        bfs_send(client);
+    }
+
+    bfs_check_done(client);
+}
+
+
+/*
+* The leader starts the BFS rounds when its wave is back, the rest with the first "BFS" they get. No borrower is farther
+* from the leader than the depth of its wave tree, so that many rounds are enough.
+*/
+static void bfs_start(borrower_t *client, int rounds)
+{
+    echo_state_t *e = &client->echo;
+    int i;
+
+
+    if(e->round != 0)
+        return;
+
+    e->rounds = rounds;
+    e->round = 1;
+    e->depth = 0;
+    e->dist = e->parent == client->rank ? 0 : -1;
+    for(i = 0; i < 2; i++)
+    {
+        e->recv[i] = (int *) MyMalloc(client->neightbors_size * sizeof(int));
+        memset(e->recv[i], 0, client->neightbors_size * sizeof(int));
+    }
+    for(i = 0; i < client->neightbors_size; i++)
+        e->recv[0][i] = e->recv[1][i] = BFS_NONE;
+
+    bfs_send(client);
+    bfs_advance(client);
+}
+
+
+/*
+* Handle "BFS <round> <dist> <rounds>", a neighbor is at most one round ahead of me.
+*/
+void event_client_bfs(borrower_t *client, int sender_rank, int round, int dist, int rounds)
+{
+    bfs_start(client, rounds);
+    client->echo.recv[round % 2][neighbor_index(client, sender_rank)] = dist;
+    bfs_advance(client);
+}
+
+
+/*
+* Handle "BFS_END <is_parent>". It can come before my last round, the neighbor is done with its own.
+*/
+void event_client_bfs_end(borrower_t *client, int sender_rank, int is_parent)
+{
+    echo_state_t *e = &client->echo;
+
+
+    e->ends++;
+    if(is_parent)
+    {
+        e->children = (int *) MyRealloc(e->children, (e->children_num + 1) * sizeof(int));
+        e->children[e->children_num++] = sender_rank;
+    }
+    bfs_check_done(client);
+}
+
+
+void event_client_bfs_echo(borrower_t *client, int depth)
+{
+    echo_state_t *e = &client->echo;
+
+
+    if(depth + 1 > e->depth)
+        e->depth = depth + 1;
+    e->echoes++;
+    bfs_check_done(client);
 }
 
 
 /*
-* This function sets the leader rank in the borrower struct and propagates it to your neighbors.
+* This function sets the leader rank in the borrower struct and propagates it to your neighbors. It doesn't wait for
+* them, their "LE_LOANERS_ACK" come to event_client_announce_ack().
 */
 void event_client_leader_selected(borrower_t *client, char *str_leader_rank, int sender_rank)
 {
     int i;
     char buffer[BUF_SIZE];
-    MPI_Status status;
 
 
     print_info("Client rank %d got 'LE_LOANERS %s' from rank %d", client->rank, str_leader_rank, sender_rank);
-#ifdef DEBUG_ENABLED
     // Print my neighbors for debug
-    sprintf(buffer, "---Client rank %d neighbors: ", client->rank);
-    for(i = 0; i < client->neightbors_size; i++)
+    if(log_on(LOG_LEVEL_DEBUG))
     {
-        strcat_int(buffer, client->neighbors[i]);
-        strcat(buffer, "-");
+        sprintf(buffer, "---Client rank %d neighbors: ", client->rank);
+        for(i = 0; i < client->neightbors_size; i++)
+        {
+            strcat_int(buffer, client->neighbors[i]);
+            strcat(buffer, "-");
+        }
+        print_debug("%s--", buffer);
     }
-    print_debug("%s--", buffer);
-#endif
 
 
     client->leader_rank = atoi(str_leader_rank);
+    client->announce_parent = sender_rank;
+    client->announce_nodes = 1;
+    client->announce_depth = 0;
     memset(buffer, 0, sizeof(buffer));
     strcpy(buffer, "LE_LOANERS ");
     strcat(buffer, str_leader_rank);
@@ -346,48 +911,165 @@ void event_client_leader_selected(borrower_t *client, char *str_leader_rank, int
         if(client->neighbors[i] != sender_rank)
         {
             print_info("Client rank %d sending 'LE_LOANERS %s' to rank %d", client->rank, str_leader_rank, client->neighbors[i]);
-            MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, client->neighbors[i], TAG_CLIENT_LEADER_SELECTED, MPI_COMM_WORLD);
+            comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, client->neighbors[i], TAG_CLIENT_LEADER_SELECTED, MPI_COMM_WORLD);
+            client->announce_acks++;
         }
     }
-    
 
-    // Wait for 'ACK' from neighbors. Also helps with a cleaner output in the console
-    for(i = 0; i < client->neightbors_size; i++)
+    // A leaf acks right away.
+    announce_check_done(client);
+}
+
+
+/*
+* Handle the "LE_LOANERS_ACK <nodes> <depth>" message, a subtree of mine got the leader.
+*/
+void event_client_announce_ack(borrower_t *client, int nodes, int depth)
+{
+    client->announce_nodes += nodes;
+    if(depth + 1 > client->announce_depth)
+        client->announce_depth = depth + 1;
+    client->announce_acks--;
+    announce_check_done(client);
+}
+
+
+/*
+* The coordinator goes on as soon as the leader is elected, so a "DONATE_BOOKS" can come before "LE_LOANERS" and a
+* "SHUTDOWN" before my subtree acked. They wait in client->deferred until then. The messages that use the leader and
+* come through the tree (the popular book and loan counter broadcasts) are always behind "LE_LOANERS" on their link.
+* A client that isn't connected to anyone isn't part of the election and doesn't wait.
+* @return 1 if the message has to wait.
+*/
+static int client_defers(borrower_t *client, const char *msg)
+{
+    if(client->votes == 0 && client->sent_elect_to == 0 && client->echo.wave == 0)
+        return 0;
+    if(strcmp(msg, "DONATE_BOOKS") == 0)
+        return client->leader_rank == 0;
+    if(strcmp(msg, "SHUTDOWN") == 0)
+        return client->leader_rank == 0 || client->announce_acks > 0;
+    return 0;
+}
+
+
+static void client_defer(borrower_t *client, const char *msg, MPI_Status *status)
+{
+    deferred_msg_t *d = (deferred_msg_t *) MyCalloc(1, sizeof(deferred_msg_t)), **pp;
+
+
+    d->msg = (char *) MyMalloc(strlen(msg) + 1);
+    strcpy(d->msg, msg);
+    d->source = status->MPI_SOURCE;
+    d->tag = status->MPI_TAG;
+
+    for(pp = &client->deferred; *pp != NULL; pp = &(*pp)->next)
+        ;
+    *pp = d;
+}
+
+
+/*
+* Takes the oldest deferred message if it doesn't have to wait anymore.
+* @return 1 if it's in buffer/status.
+*/
+static int client_undefer(borrower_t *client, char *buffer, int size, MPI_Status *status)
+{
+    deferred_msg_t *d = client->deferred;
+    char name[BUF_SIZE];
+
+
+    if(d == NULL)
+        return 0;
+
+    sscanf(d->msg, "%s", name);
+    if(client_defers(client, name))
+        return 0;
+
+    memset(buffer, 0, size);
+    strncpy(buffer, d->msg, size - 1);
+    status->MPI_SOURCE = d->source;
+    status->MPI_TAG = d->tag;
+    client->deferred = d->next;
+    free(d->msg);
+    free(d);
+    return 1;
+}
+
+
+/*
+* Remembers that one more copy of the book was lent by lib_rank.
+*/
+static void lender_push(borrower_book_t *book, int lib_rank)
+{
+    book_lender_t *tmp, *prev;
+
+
+    prev = NULL;
+    for(tmp = book->lenders; tmp != NULL; tmp = tmp->next)
     {
-        if(client->neighbors[i] != sender_rank)
+        if(tmp->lib_rank == lib_rank)
         {
-            memset(buffer, 0, sizeof(buffer));
-            MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, client->neighbors[i], TAG_ACK, MPI_COMM_WORLD, &status);
-            if(strcmp(buffer, "ACK") != 0)
-            {
-                print_error("Client %d didn't get 'ACK' from neighbor rank %d but instead got %s", client->rank, client->neighbors[i], buffer);
-            }
-            print_debug("Client rank %d got 'ACK' from neighbor rank %d", client->rank, client->neighbors[i]);
+            tmp->count++;
+            return;
         }
+        prev = tmp;
     }
 
-    // Send 'ACK' to sender. (Side note: if you are a leaf you simply won't execute anything in the "if" in the for loops)
-    memset(buffer, 0, sizeof(buffer));
-    strcpy(buffer, "ACK");
-    MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, sender_rank, TAG_ACK, MPI_COMM_WORLD);
+    tmp = (book_lender_t *) MyCalloc(1, sizeof(book_lender_t));
+    tmp->lib_rank = lib_rank;
+    tmp->count = 1;
+    tmp->next = NULL;
+
+    if(prev == NULL)
+        book->lenders = tmp;
+    else
+        prev->next = tmp;
+}
+
+
+/*
+* Takes one copy off the oldest lender of the book.
+* @return The rank of the library the copy should be returned to.
+*/
+static int lender_pop(borrower_book_t *book)
+{
+    book_lender_t *tmp;
+    int lib_rank;
+
+
+    tmp = book->lenders;
+    lib_rank = tmp->lib_rank;
+    tmp->count--;
+    if(tmp->count == 0)
+    {
+        book->lenders = tmp->next;
+        free(tmp);
+    }
+
+    return lib_rank;
 }
 
 
 /*
 * Adds a new book entry to the (end of the) client's book list. If the client already has an entry
-* of this book, it increments a "loaned" counter.
+* of this book, it increments a "loaned" counter. The lib_rank of every copy is remembered so it can be returned.
+* The epoch is the one the library stamped the loan with.
 */
-void client_add_book(borrower_t *client, int b_id, int b_cost)
+void client_add_book(borrower_t *client, int b_id, int b_cost, int lib_rank, int epoch)
 {
     borrower_book_t *tmp, *prev;
 
 
+    epoch_counter_add(&client->loans, epoch, 1);
+
     if(client->book_list == NULL)
     {
         tmp = (borrower_book_t *) MyCalloc(1, sizeof(borrower_book_t));
         tmp->book.id = b_id;
         tmp->book.cost = b_cost;
         tmp->loan_num = 1;
+        lender_push(tmp, lib_rank);
         tmp->next = NULL;
 
         client->book_list = tmp;
@@ -402,6 +1084,7 @@ void client_add_book(borrower_t *client, int b_id, int b_cost)
             if(tmp->book.id == b_id)
             {
                 tmp->loan_num++;
+                lender_push(tmp, lib_rank);
                 print_debug("Client rank %d updated loan counter to %d for book %d", client->rank, tmp->loan_num, b_id);
                 return;
             }
@@ -414,6 +1097,7 @@ void client_add_book(borrower_t *client, int b_id, int b_cost)
         tmp->book.id = b_id;
         tmp->book.cost = b_cost;
         tmp->loan_num = 1;
+        lender_push(tmp, lib_rank);
         tmp->next = NULL;
 
         prev->next = tmp;
@@ -426,8 +1110,9 @@ void client_add_book(borrower_t *client, int b_id, int b_cost)
 * b_id and sends a 'LEND_BOOK' message to that library.
 *
 * Library responses:
-* - 'GET_BOOK <cost>' : if it has that book
-* - 'ACK_TB <b_id> <cost>' but <b_id> will either be -1 indicating the book was not found, or b_id >= 0 meaning success.
+* - 'GET_BOOK <cost> <epoch>' : if it has that book
+* - 'WAITLISTED <b_id>' : all copies are loaned, the book will be pushed with 'GET_BOOK <cost> <b_id> <epoch>' when one comes back
+* - 'ACK_TB <b_id> <cost> <lender_rank> <epoch>' but <b_id> will either be -1 indicating the book was not found, or b_id >= 0 meaning success.
 */
 void event_client_takeBook(borrower_t *client, int b_id, int num_libs)
 {
@@ -439,27 +1124,30 @@ void event_client_takeBook(borrower_t *client, int b_id, int num_libs)
 
     
     N = sqrt(num_libs);
-    l_id = (b_id/N);
+    l_id = BOOK_OWNER_LID(b_id, N);
     library_rank = l_id + 1;
 
     print_info("Client rank %d send 'LEND_BOOK' to library rank %d", client->rank, library_rank);
     memset(buffer, 0, sizeof(buffer));
     strcpy(buffer, "LEND_BOOK ");
     strcat_int(buffer, b_id);
-    MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, library_rank, TAG_TAKE_BOOK, MPI_COMM_WORLD);
+    hop_trace_attach(buffer, hop_trace_current());
+    comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, library_rank, TAG_TAKE_BOOK, MPI_COMM_WORLD);
 
 
     // Get answer from the library
     memset(buffer, 0, sizeof(buffer));
-    MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, library_rank, TAG_TAKE_BOOK, MPI_COMM_WORLD, &status);
+    comm_recv(buffer, sizeof(buffer), MPI_CHAR, library_rank, TAG_TAKE_BOOK, MPI_COMM_WORLD, &status);
 
 
     char **string_array = split_string(buffer, strlen(buffer), ' ');
+    hop_trace_recv(string_array, 'G');
     if(strcmp(string_array[0], "GET_BOOK") == 0)
     {
         int b_cost = atoi(string_array[1]);
+        int epoch = atoi(string_array[2]);
         print_info("Client rank %d: Got '%s' from library rank %d ('GET_BOOK')", client->rank, buffer, library_rank);
-        client_add_book(client, b_id, b_cost);
+        client_add_book(client, b_id, b_cost, library_rank, epoch);
     }
     else if(strcmp(string_array[0], "ACK_TB") == 0)
     {
@@ -472,10 +1160,17 @@ void event_client_takeBook(borrower_t *client, int b_id, int num_libs)
         }
         else
         {
-            print_info("Client rank %d: Got book %d (with cost %d) from library rank %d ('ACK_TB')", client->rank, b_id, b_cost, library_rank);
-            client_add_book(client, b_id, b_cost);
+            int lender_rank = atoi(string_array[3]);
+            int epoch = atoi(string_array[4]);
+
+            print_info("Client rank %d: Got book %d (with cost %d) from library rank %d ('ACK_TB', lent by rank %d)", client->rank, b_id, b_cost, library_rank, lender_rank);
+            client_add_book(client, b_id, b_cost, lender_rank, epoch);
         }
     }
+    else if(strcmp(string_array[0], "WAITLISTED") == 0)
+    {
+        print_info(HYEL"Client rank %d: book %d has no available copies, library rank %d put me on its waitlist."reset, client->rank, b_id, library_rank);
+    }
     else
     {
         print_error("Unknown message from library %d, got %s", library_rank, buffer);
@@ -486,7 +1181,307 @@ void event_client_takeBook(borrower_t *client, int b_id, int num_libs)
     print_debug("Client rank %d send 'DONE_FIND_BOOK' to coordinator", client->rank);
     memset(buffer, 0, sizeof(buffer));
     strcpy(buffer, "DONE_FIND_BOOK");
-    MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_DONE_FIND_BOOK, MPI_COMM_WORLD);
+    hop_trace_attach(buffer, hop_trace_current());
+    comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_DONE_FIND_BOOK, MPI_COMM_WORLD);
+}
+
+
+/*
+* Handles the 'GET_BOOK <cost> <b_id> <epoch>' message that a library pushes when a copy of a book i was waitlisted for
+* becomes available.
+*/
+void event_client_get_book(borrower_t *client, int b_id, int b_cost, int lib_rank, int epoch)
+{
+    print_info("Client rank %d: Got waitlisted book %d (with cost %d) from library rank %d", client->rank, b_id, b_cost, lib_rank);
+    client_add_book(client, b_id, b_cost, lib_rank, epoch);
+}
+
+
+/*
+* Handles the 'TAKE_BOOKS <b_id> [<b_id> ...]' message from coordinator. The ids are grouped by the library that owns
+* them and each library gets one 'LEND_BOOKS <b_id> ...' message (or a few if there are more than MAX_BOOKS_PER_MSG ids).
+* All the messages are sent before waiting for the answers:
+* - 'ACK_LB <n_pending> <epoch> [<b_id> <cost> ...]' : the books the library had, and how many 'ACK_TB' will follow for the rest.
+* - 'ACK_TB <b_id> <cost> <lender_rank> <epoch>' : one for every book the library had to look for (b_id is -1 if not found),
+*   or 'WAITLISTED <b_id>' if the book will be pushed later.
+* When every answer is in the client sends a single 'DONE_TAKE_BOOKS <n_taken>' to the coordinator.
+*/
+void event_client_takeBooks(borrower_t *client, char **str_array, int num_libs)
+{
+    int i, j, N, b_id, b_cost, lib_rank, n_ids, n_msgs, n_taken, n_pending;
+    int *msg_ranks, *msg_sizes;
+    char **msg_buffers;
+    char buffer[BUF_SIZE];
+    char **reply;
+    MPI_Status status;
+
+
+    N = sqrt(num_libs);
+    n_ids = get_string_array_size(str_array) - 1;
+    msg_ranks = (int *) MyCalloc(n_ids > 0 ? n_ids : 1, sizeof(int));
+    msg_sizes = (int *) MyCalloc(n_ids > 0 ? n_ids : 1, sizeof(int));
+    msg_buffers = (char **) MyCalloc(n_ids > 0 ? n_ids : 1, sizeof(char *));
+    n_msgs = 0;
+
+    // Group the ids by library.
+    for(i = 0; i < n_ids; i++)
+    {
+        b_id = atoi(str_array[i+1]);
+        lib_rank = BOOK_OWNER_LID(b_id, N) + 1;
+
+        for(j = 0; j < n_msgs; j++)
+        {
+            if(msg_ranks[j] == lib_rank && msg_sizes[j] < MAX_BOOKS_PER_MSG)
+                break;
+        }
+        if(j == n_msgs)
+        {
+            msg_ranks[n_msgs] = lib_rank;
+            msg_buffers[n_msgs] = (char *) MyCalloc(BUF_SIZE, sizeof(char));
+            strcpy(msg_buffers[n_msgs], "LEND_BOOKS");
+            n_msgs++;
+        }
+
+        strcat(msg_buffers[j], " ");
+        strcat_int(msg_buffers[j], b_id);
+        msg_sizes[j]++;
+    }
+
+
+    // Send every message first, the libraries work on them in parallel.
+    for(j = 0; j < n_msgs; j++)
+    {
+        print_info("Client rank %d send '%s' to library rank %d", client->rank, msg_buffers[j], msg_ranks[j]);
+        comm_send(msg_buffers[j], strlen(msg_buffers[j]) + 1, MPI_CHAR, msg_ranks[j], TAG_TAKE_BOOK, MPI_COMM_WORLD);
+    }
+
+
+    // Collect the answers. 'ACK_TB's of a library can arrive after the 'ACK_LB' of another message to the same library
+    // so don't care about which message they belong to, just count them.
+    n_taken = 0;
+    for(j = 0; j < n_msgs; j++)
+    {
+        if(msg_buffers[j] == NULL)      // Already handled together with an earlier message to the same library.
+            continue;
+
+        int acks_expected = 0, acks = 0;
+        n_pending = 0;
+        for(i = j; i < n_msgs; i++)
+        {
+            if(msg_ranks[i] == msg_ranks[j])
+                acks_expected++;
+        }
+
+        while(acks < acks_expected || n_pending > 0)
+        {
+            memset(buffer, 0, sizeof(buffer));
+            comm_recv(buffer, sizeof(buffer), MPI_CHAR, msg_ranks[j], TAG_TAKE_BOOK, MPI_COMM_WORLD, &status);
+            print_debug("Client rank %d got from library rank %d: %s", client->rank, msg_ranks[j], buffer);
+
+            reply = split_string(buffer, strlen(buffer), ' ');
+            if(strcmp(reply[0], "ACK_LB") == 0)
+            {
+                acks++;
+                n_pending += atoi(reply[1]);
+                for(i = 3; reply[i] != NULL && reply[i+1] != NULL; i += 2)
+                {
+                    b_id = atoi(reply[i]);
+                    b_cost = atoi(reply[i+1]);
+                    client_add_book(client, b_id, b_cost, msg_ranks[j], atoi(reply[2]));
+                    n_taken++;
+                }
+            }
+            else if(strcmp(reply[0], "WAITLISTED") == 0)
+            {
+                n_pending--;
+                print_info(HYEL"Client rank %d: book %s has no available copies, waiting on the waitlist of library rank %d."reset, client->rank, reply[1], msg_ranks[j]);
+            }
+            else if(strcmp(reply[0], "ACK_TB") == 0)
+            {
+                n_pending--;
+                b_id = atoi(reply[1]);
+                if(b_id == -1)
+                {
+                    print_info(HYEL"Client rank %d: a book was not found in the libraries."reset, client->rank);
+                }
+                else
+                {
+                    b_cost = atoi(reply[2]);
+                    client_add_book(client, b_id, b_cost, atoi(reply[3]), atoi(reply[4]));
+                    n_taken++;
+                }
+            }
+            else
+            {
+                print_error("Unknown message from library %d, got %s", msg_ranks[j], buffer);
+            }
+
+            free_string_array(reply);
+            reply = NULL;
+        }
+
+        for(i = j; i < n_msgs; i++)
+        {
+            if(msg_ranks[i] == msg_ranks[j] && i != j)
+            {
+                free(msg_buffers[i]);
+                msg_buffers[i] = NULL;
+            }
+        }
+        free(msg_buffers[j]);
+        msg_buffers[j] = NULL;
+    }
+
+
+    // Send 'DONE_TAKE_BOOKS <n_taken>' to coordinator
+    memset(buffer, 0, sizeof(buffer));
+    strcpy(buffer, "DONE_TAKE_BOOKS ");
+    strcat_int(buffer, n_taken);
+    print_info("Client rank %d got %d of %d books, sending '%s' to coordinator", client->rank, n_taken, n_ids, buffer);
+    comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_DONE_FIND_BOOK, MPI_COMM_WORLD);
+
+    free(msg_ranks);
+    free(msg_sizes);
+    free(msg_buffers);
+}
+
+
+/*
+* @return The entry of b_id in the client's book list or NULL if i've never borrowed that book.
+*/
+borrower_book_t *client_search_book(borrower_t *client, int b_id)
+{
+    borrower_book_t *tmp;
+
+
+    tmp = client->book_list;
+    while(tmp != NULL)
+    {
+        if(tmp->book.id == b_id)
+            return tmp;
+        tmp = tmp->next;    // step
+    }
+
+    return NULL;
+}
+
+
+/*
+* Handles the 'RETURN_BOOK <b_id> [<b_id> ...]' message from coordinator. Every copy goes back to the library that
+* lent it (the oldest lender first), the copies are grouped by library and every library gets a 'RETURN_BOOK <epoch> <b_id> <cost> [<b_id> <cost> ...]' message (or a few if there
+* are more than MAX_BOOKS_PER_MSG copies). All the messages are sent before waiting for an 'ACK_RB <n_copies>' for each
+* of them, then the client updates its records and sends 'DONE_RETURN_BOOK' to the coordinator.
+*/
+void event_client_returnBook(borrower_t *client, char **str_array)
+{
+    char buffer[BUF_SIZE];
+    int i, j, b_id, n_ids, n_libs, n_copies, lib_rank;
+    int *lib_ranks, *lib_sizes, *to_return;
+    char **lib_buffers;
+    borrower_book_t *book, **books;
+    MPI_Status status;
+
+
+    n_ids = get_string_array_size(str_array) - 1;
+    books = (borrower_book_t **) MyCalloc(n_ids > 0 ? n_ids : 1, sizeof(borrower_book_t *));
+    lib_ranks = (int *) MyCalloc(n_ids > 0 ? n_ids : 1, sizeof(int));
+    lib_sizes = (int *) MyCalloc(n_ids > 0 ? n_ids : 1, sizeof(int));
+    lib_buffers = (char **) MyCalloc(n_ids > 0 ? n_ids : 1, sizeof(char *));
+    to_return = (int *) MyCalloc(n_ids > 0 ? n_ids : 1, sizeof(int));   // Copies of books[i] already put in a message.
+    n_libs = 0;
+
+    for(i = 0; i < n_ids; i++)
+    {
+        b_id = atoi(str_array[i+1]);
+        book = client_search_book(client, b_id);
+        books[i] = book;
+
+        if(book == NULL)
+        {
+            print_warn("Client rank %d can't return book %d, it never borrowed it.", client->rank, b_id);
+            continue;
+        }
+
+        // Count the copies of this book that earlier ids in the batch already return.
+        n_copies = 0;
+        for(j = 0; j < i; j++)
+        {
+            if(books[j] == book)
+                n_copies += to_return[j];
+        }
+        if(book->loan_num - book->returned_num - n_copies <= 0)
+        {
+            print_warn("Client rank %d can't return book %d, it doesn't hold a copy.", client->rank, b_id);
+            continue;
+        }
+        to_return[i] = 1;
+        lib_rank = lender_pop(book);
+
+        // Find (or start) a message for the lender that has room.
+        for(j = 0; j < n_libs; j++)
+        {
+            if(lib_ranks[j] == lib_rank && lib_sizes[j] < MAX_BOOKS_PER_MSG)
+                break;
+        }
+        if(j == n_libs)
+        {
+            lib_ranks[n_libs] = lib_rank;
+            lib_buffers[n_libs] = (char *) MyCalloc(BUF_SIZE, sizeof(char));
+            strcpy(lib_buffers[n_libs], "RETURN_BOOK ");
+            strcat_int(lib_buffers[n_libs], client->epoch);
+            n_libs++;
+        }
+
+        strcat(lib_buffers[j], " ");
+        strcat_int(lib_buffers[j], book->book.id);
+        strcat(lib_buffers[j], " ");
+        strcat_int(lib_buffers[j], book->book.cost);
+        lib_sizes[j]++;
+    }
+
+
+    // Send every batch first, the libraries work on them in parallel.
+    for(j = 0; j < n_libs; j++)
+    {
+        print_info("Client rank %d send '%s' to library rank %d", client->rank, lib_buffers[j], lib_ranks[j]);
+        comm_send(lib_buffers[j], strlen(lib_buffers[j]) + 1, MPI_CHAR, lib_ranks[j], TAG_RETURN_BOOK, MPI_COMM_WORLD);
+    }
+
+    // Wait for 'ACK_RB <n_copies>' for every message.
+    for(j = 0; j < n_libs; j++)
+    {
+        memset(buffer, 0, sizeof(buffer));
+        comm_recv(buffer, sizeof(buffer), MPI_CHAR, lib_ranks[j], TAG_RETURN_BOOK, MPI_COMM_WORLD, &status);
+        if(strncmp(buffer, "ACK_RB", 6) != 0)
+        {
+            print_error("Client rank %d expected 'ACK_RB' from library rank %d but instead got: %s", client->rank, lib_ranks[j], buffer);
+        }
+        print_debug("Client rank %d got '%s' from library rank %d", client->rank, buffer, lib_ranks[j]);
+        free(lib_buffers[j]);
+    }
+
+    // The libraries have the copies, update my records.
+    for(i = 0; i < n_ids; i++)
+    {
+        if(to_return[i] == 1)
+        {
+            books[i]->returned_num++;
+            epoch_counter_add(&client->returns, client->epoch, 1);
+        }
+    }
+
+
+    // Send 'DONE_RETURN_BOOK' to coordinator
+    memset(buffer, 0, sizeof(buffer));
+    strcpy(buffer, "DONE_RETURN_BOOK");
+    print_debug("Client rank %d send '%s' to coordinator", client->rank, buffer);
+    comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_DONE_RETURN_BOOK, MPI_COMM_WORLD);
+
+    free(books);
+    free(lib_ranks);
+    free(lib_sizes);
+    free(lib_buffers);
+    free(to_return);
 }
 
 
@@ -513,12 +1508,12 @@ void event_client_donateBook(borrower_t *client, int b_id, int n_copies)
     strcat(buffer, " ");
     strcat_int(buffer, n_copies);
     print_info("Client rank %d send '%s' to client leader rank %d", client->rank, buffer, client->leader_rank);
-    MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, client->leader_rank, TAG_DONATE_BOOKS, MPI_COMM_WORLD);
+    comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, client->leader_rank, TAG_DONATE_BOOKS, MPI_COMM_WORLD);
 
 
     // Wait for 'DONATE_BOOKS_DONE' from leader.
     memset(buffer, 0, sizeof(buffer));
-    MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, client->leader_rank, TAG_DONATE_BOOKS_DONE, MPI_COMM_WORLD, &status);
+    comm_recv(buffer, sizeof(buffer), MPI_CHAR, client->leader_rank, TAG_DONATE_BOOKS_DONE, MPI_COMM_WORLD, &status);
     if(strcmp(buffer, "DONATE_BOOKS_DONE") != 0)
     {
         print_error("Client rank %d didn't get 'DONATE_BOOKS_DONE' from leader but instead got: %s", client->rank, buffer);
@@ -532,7 +1527,7 @@ void event_client_donateBook(borrower_t *client, int b_id, int n_copies)
         print_debug("Client rank %d got %s from leader, forwarding it to coordinator.", client->rank, buffer);
     }
 
-    MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_DONATE_BOOKS_DONE, MPI_COMM_WORLD);
+    comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_DONATE_BOOKS_DONE, MPI_COMM_WORLD);
 }
 
 
@@ -566,21 +1561,27 @@ void event_client_leader_donateBook(borrower_t *client, int b_id, int n_copies,
     strcat(buffer_send, " ");
     strcat_int(buffer_send, book_cost);
 
+    // Send every copy first and then wait for the 'ACK_DB's, so the copies are in flight together (and the ones for the
+    // same library go in one batch with '--aggregate'). A library answers its copies in order.
     donate_next = 1;
     for(i = 0; i < n_copies; i++)
     {
         print_info(HGRN"Leader"reset" client (rank %d) send '%s' to library rank %d", client->rank, buffer_send, donate_next);
-        MPI_Send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, donate_next, TAG_DONATE_BOOKS, MPI_COMM_WORLD);
+        comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, donate_next, TAG_DONATE_BOOKS, MPI_COMM_WORLD);
+        donate_next = (donate_next % num_libs) + 1;
+    }
 
+    donate_next = 1;
+    for(i = 0; i < n_copies; i++)
+    {
         // Wait for 'ACK_DB'
         memset(buffer_recv, 0, sizeof(buffer_recv));
-        MPI_Recv(buffer_recv, sizeof(buffer_recv), MPI_CHAR, donate_next, TAG_DONATE_BOOKS_DONE, MPI_COMM_WORLD, &status);
+        comm_recv(buffer_recv, sizeof(buffer_recv), MPI_CHAR, donate_next, TAG_DONATE_BOOKS_DONE, MPI_COMM_WORLD, &status);
         if(strcmp(buffer_recv, "ACK_DB") != 0)
         {
             print_error("Client leader didn't get 'ACK_DB' from library rank %d but instead got: %s", donate_next, buffer_recv);
             exit(-1);
         }
-
         donate_next = (donate_next % num_libs) + 1;
     }
 
@@ -590,14 +1591,14 @@ void event_client_leader_donateBook(borrower_t *client, int b_id, int n_copies,
     {
         memset(buffer_send, 0, sizeof(buffer_send));
         strcpy(buffer_send, "DONATE_BOOKS_DONE");
-        MPI_Send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, client_rank, TAG_DONATE_BOOKS_DONE, MPI_COMM_WORLD);
+        comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, client_rank, TAG_DONATE_BOOKS_DONE, MPI_COMM_WORLD);
     }
     else
     {
         // Send 'DONATE_BOOKS_DONE' to coordinator because there are no other clients involved.
         memset(buffer_send, 0, sizeof(buffer_send));
         strcpy(buffer_send, "DONATE_BOOKS_DONE");
-        MPI_Send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_DONATE_BOOKS_DONE, MPI_COMM_WORLD);
+        comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_DONATE_BOOKS_DONE, MPI_COMM_WORLD);
     }
 }
 
@@ -662,7 +1663,7 @@ void event_client_get_mostPopBook(borrower_t *client, int N, int sender_rank)
         if(client->neighbors[i] != sender_rank)
         {
             print_debug("Client rank %d send %s to client rank %d", client->rank, buffer, client->neighbors[i]);
-            MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, client->neighbors[i], TAG_GET_MOST_POPULAR_BOOK, MPI_COMM_WORLD);
+            comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, client->neighbors[i], TAG_GET_MOST_POPULAR_BOOK, MPI_COMM_WORLD);
         }
     }
 
@@ -678,7 +1679,7 @@ void event_client_get_mostPopBook(borrower_t *client, int N, int sender_rank)
     }
     else
     {
-        my_l_id = best_book->book.id / N;   // Calculate the l_id.
+        my_l_id = BOOK_OWNER_LID(best_book->book.id, N);   // Calculate the l_id.
         my_bookid = best_book->book.id;
         my_loan_num = best_book->loan_num;
         my_cost = best_book->book.cost;
@@ -699,11 +1700,11 @@ void event_client_get_mostPopBook(borrower_t *client, int N, int sender_rank)
         strcat(buffer, " ");
         strcat_int(buffer, my_l_id);
         
-        MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, client->leader_rank, TAG_GET_POPULAR_BK_INFO, MPI_COMM_WORLD);
+        comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, client->leader_rank, TAG_GET_POPULAR_BK_INFO, MPI_COMM_WORLD);
         
         // Wait for 'ACK_BK_INFO' from leader.
         memset(buffer, 0, sizeof(buffer));
-        MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, client->leader_rank, TAG_ACK, MPI_COMM_WORLD, &status);
+        comm_recv(buffer, sizeof(buffer), MPI_CHAR, client->leader_rank, TAG_ACK, MPI_COMM_WORLD, &status);
         if(strcmp(buffer, "ACK_BK_INFO") != 0)
         {
             print_error("Client rank %d expected 'ACK_BK_INFO' from client leader rank %d but instead got: %s", client->rank, client->leader_rank, buffer);
@@ -740,7 +1741,7 @@ void event_client_get_mostPopBook(borrower_t *client, int N, int sender_rank)
         {
             //print_debug(UGRN"LEADER"reset" currently expects message from rank %d", i);
             memset(buffer, 0, sizeof(buffer));
-            MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, MPI_ANY_SOURCE, TAG_GET_POPULAR_BK_INFO, MPI_COMM_WORLD, &status);
+            comm_recv(buffer, sizeof(buffer), MPI_CHAR, MPI_ANY_SOURCE, TAG_GET_POPULAR_BK_INFO, MPI_COMM_WORLD, &status);
             print_debug(HGRN"Leader"reset" got from rank %d: %s", status.MPI_SOURCE, buffer);
 
             str_array = split_string(buffer, strlen(buffer), ' ');
@@ -771,7 +1772,7 @@ void event_client_get_mostPopBook(borrower_t *client, int N, int sender_rank)
             memset(buffer, 0, sizeof(buffer));
             strcpy(buffer, "ACK_BK_INFO");
             print_debug("Client "HGRN"leader"reset" is sending 'ACK_BK_INFO' to client rank %d", status.MPI_SOURCE);
-            MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, status.MPI_SOURCE, TAG_ACK, MPI_COMM_WORLD);
+            comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, status.MPI_SOURCE, TAG_ACK, MPI_COMM_WORLD);
 
             free_string_array(str_array);
             str_array = NULL;
@@ -782,7 +1783,7 @@ void event_client_get_mostPopBook(borrower_t *client, int N, int sender_rank)
         print_info(HMAG"Client leader will now print the most popular books for each library:"reset);
         for(i = 0; i < num_libs; i++)
         {
-            print_info("Popular book b_id=%d times_loaned=%d for library l_id=%d", best_books[i].book.id, best_books[i].loan_num, i);
+            print_result("Popular book b_id=%d times_loaned=%d for library l_id=%d", best_books[i].book.id, best_books[i].loan_num, i);
         }
 
 
@@ -790,48 +1791,27 @@ void event_client_get_mostPopBook(borrower_t *client, int N, int sender_rank)
         print_debug("Client "HGRN"leader"reset" is sending 'GET_MOST_POPULAR_BOOK_DONE' to coordinator");
         memset(buffer, 0, sizeof(buffer));
         strcpy(buffer, "GET_MOST_POPULAR_BOOK_DONE");
-        MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_GET_MOST_POPULAR_BOOK, MPI_COMM_WORLD);
+        comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_GET_MOST_POPULAR_BOOK, MPI_COMM_WORLD);
     }
 
 } // End of func
 
 
 /*
-* Goes through the book list and adds all the loan counters and returns the final value.
-*/
-int get_loaned_books(borrower_t *client)
-{
-    int total_loaned;
-    borrower_book_t *tmp_book;
-
-
-    // Integrity check
-    if(client == NULL)
-        return 0;
-
-    total_loaned = 0;
-    tmp_book = client->book_list;
-    while(tmp_book != NULL)
-    {
-        total_loaned += tmp_book->loan_num;
-        tmp_book = tmp_book->next;
-    }
-
-    return total_loaned;
-}
-
-
-/*
-* Handles the 'CHECK_NUM_BOOKS_LOAN' event.
+* Handles the 'CHECK_NUM_BOOKS_LOAN <epoch>' event. Broadcast over the tree and convergecast the copies that were
+* loaned to and returned by the clients with a stamp before the given epoch (see event_check_num_books_loan() of the libraries).
 */
-void event_client_check_numBooksLoan(borrower_t *client, int sender_rank)
+void event_client_check_numBooksLoan(borrower_t *client, int sender_rank, int epoch)
 {
     char buffer[BUF_SIZE];
-    int i, total_loans;
+    int i, total_loans, total_returns;
     char **str_array;
     MPI_Status status;
 
 
+    if(epoch > client->epoch)
+        client->epoch = epoch;
+
     // Leaf node, might also be the leader but that won't matter because sender_rank would be 0 (coordinator)
     if(client->neightbors_size == 1)
     {
@@ -845,9 +1825,10 @@ void event_client_check_numBooksLoan(borrower_t *client, int sender_rank)
 
 
 
-    // Broadcast: Send 'CHECK_NUM_BOOKS_LOAN' to my neighbors.
+    // Broadcast: Send 'CHECK_NUM_BOOKS_LOAN <epoch>' to my neighbors.
     memset(buffer, 0, sizeof(buffer));
-    strcpy(buffer, "CHECK_NUM_BOOKS_LOAN");
+    strcpy(buffer, "CHECK_NUM_BOOKS_LOAN ");
+    strcat_int(buffer, epoch);
     for(i = 0; i < client->neightbors_size; i++)
     {
         // Skip the sender.
@@ -855,12 +1836,13 @@ void event_client_check_numBooksLoan(borrower_t *client, int sender_rank)
             continue;
 
         print_debug("Client rank %d is sending to rank %d: %s", client->rank, client->neighbors[i], buffer);
-        MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, client->neighbors[i], TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
+        comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, client->neighbors[i], TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
     }
 
     // Set my total loans
-    total_loans = get_loaned_books(client);
-    print_debug("Client rank %d has %d times loans", client->rank, total_loans);
+    total_loans = epoch_counter_sum_before(&client->loans, epoch);
+    total_returns = epoch_counter_sum_before(&client->returns, epoch);
+    print_debug("Client rank %d has %d loans and %d returns before epoch %d", client->rank, total_loans, total_returns, epoch);
 
     // Wait to get their counts
     for(i = 0; i < client->neightbors_size; i++)
@@ -870,16 +1852,17 @@ void event_client_check_numBooksLoan(borrower_t *client, int sender_rank)
             continue;
 
         memset(buffer, 0, sizeof(buffer));
-        MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, client->neighbors[i], TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD, &status);
+        comm_recv(buffer, sizeof(buffer), MPI_CHAR, client->neighbors[i], TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD, &status);
         print_debug("Client rank %d got from %d: %s", client->rank, client->neighbors[i], buffer);
         str_array = split_string(buffer, strlen(buffer), ' ');
         if(strcmp(str_array[0], "NUM_BOOKS_LOANED") != 0)
         {
-            print_error("Client %d expected 'NUM_BOOKS_LOANED <times_loaned>' from client rank %d but instead got: %s", client->rank, client->neighbors[i], buffer);
+            print_error("Client %d expected 'NUM_BOOKS_LOANED <times_loaned> <times_returned>' from client rank %d but instead got: %s", client->rank, client->neighbors[i], buffer);
             exit(-1);
         }
 
         total_loans += atoi(str_array[1]);
+        total_returns += atoi(str_array[2]);
 
         free_string_array(str_array);
         str_array = NULL;
@@ -888,7 +1871,7 @@ void event_client_check_numBooksLoan(borrower_t *client, int sender_rank)
         // Send 'ACK_NBL'
         memset(buffer, 0, sizeof(buffer));
         strcpy(buffer, "ACK_NBL");
-        MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, client->neighbors[i], TAG_ACK, MPI_COMM_WORLD);
+        comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, client->neighbors[i], TAG_ACK, MPI_COMM_WORLD);
     }
 
 
@@ -900,20 +1883,24 @@ void event_client_check_numBooksLoan(borrower_t *client, int sender_rank)
         memset(buffer, 0, sizeof(buffer));
         strcpy(buffer, "CHECK_NUM_BOOKS_LOAN_DONE ");
         strcat_int(buffer, total_loans);
+        strcat(buffer, " ");
+        strcat_int(buffer, total_returns);
         print_info("Client leader rank %d is sending to %d (coordinator): %s", client->rank, sender_rank, buffer);
-        MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
+        comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
     }
     else    // Send loan num to sender and it'll eventually reach leader
     {
         memset(buffer, 0, sizeof(buffer));
         strcpy(buffer, "NUM_BOOKS_LOANED ");
         strcat_int(buffer, total_loans);
+        strcat(buffer, " ");
+        strcat_int(buffer, total_returns);
         print_info("Client rank %d is sending to %d: %s", client->rank, sender_rank, buffer);
-        MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, sender_rank, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
+        comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, sender_rank, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
 
         // Wait for 'ACK_NBL'
         memset(buffer, 0, sizeof(buffer));
-        MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, sender_rank, TAG_ACK, MPI_COMM_WORLD, &status);
+        comm_recv(buffer, sizeof(buffer), MPI_CHAR, sender_rank, TAG_ACK, MPI_COMM_WORLD, &status);
         if(strcmp(buffer, "ACK_NBL") != 0)
         {
             print_error("Client %d expected 'ACK_NBL' from client rank %d but instead got: %s", client->rank, sender_rank, buffer);
@@ -949,10 +1936,22 @@ void start_client(int rank, int num_libs)
     while(1)
     {
         //Block on receive and examine the message when it arrives (or use MPi_Probe for that)
-        MPI_Recv(buffer_recv, sizeof(buffer_recv), MPI_CHAR, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+        if(!client_undefer(&client, buffer_recv, sizeof(buffer_recv), &status))
+            comm_recv(buffer_recv, sizeof(buffer_recv), MPI_CHAR, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
         
 
         strings_array = split_string(buffer_recv, strlen(buffer_recv), ' ');
+        if(client_defers(&client, strings_array[0]))
+        {
+            print_debug("Client rank %d doesn't know the leader yet, '%s' waits", client.rank, strings_array[0]);
+            client_defer(&client, buffer_recv, &status);
+            memset(buffer_recv, 0, sizeof(buffer_recv));
+            free_string_array(strings_array);
+            strings_array = NULL;
+            continue;
+        }
+        stats_event_begin(strings_array[0]);
+        hop_trace_recv(strings_array, strcmp(strings_array[0], "TAKE_BOOK") == 0 ? 'C' : 0);
 
         if(strcmp(strings_array[0], "CONNECT") == 0)
         {
@@ -970,16 +1969,47 @@ void start_client(int rank, int num_libs)
 
         else if(strcmp(strings_array[0], "START_LE_LOANERS") == 0)
         {
-            event_client_start_le_loaners(&client);
+            if(client_election == CLIENT_ELECTION_ECHO || (strings_array[1] != NULL && strcmp(strings_array[1], "echo") == 0))
+                event_client_start_wave(&client);
+            else
+                event_client_start_le_loaners(&client);
+        }
+        else if(strcmp(strings_array[0], "WAVE") == 0)
+        {
+            event_client_wave(&client, status.MPI_SOURCE, atoi(strings_array[1]));
+        }
+        else if(strcmp(strings_array[0], "WAVE_ECHO") == 0)
+        {
+            event_client_wave_echo(&client, atoi(strings_array[1]), atoi(strings_array[2]), atoi(strings_array[3]));
+        }
+        else if(strcmp(strings_array[0], "BFS") == 0)
+        {
+            event_client_bfs(&client, status.MPI_SOURCE, atoi(strings_array[1]), atoi(strings_array[2]), atoi(strings_array[3]));
+        }
+        else if(strcmp(strings_array[0], "BFS_END") == 0)
+        {
+            event_client_bfs_end(&client, status.MPI_SOURCE, atoi(strings_array[1]));
+        }
+        else if(strcmp(strings_array[0], "BFS_ECHO") == 0)
+        {
+            event_client_bfs_echo(&client, atoi(strings_array[1]));
         }
         else if(strcmp(strings_array[0], "ELECT") == 0)
         {
-            event_client_elect(&client, status.MPI_SOURCE);            
+            event_client_elect(&client, status.MPI_SOURCE, atoi(strings_array[1]), atoi(strings_array[2]));
+        }
+        else if(strcmp(strings_array[0], "CENTER") == 0)
+        {
+            event_client_center(&client, status.MPI_SOURCE, atoi(strings_array[1]), atoi(strings_array[2]), atoi(strings_array[3]));
         }
         else if(strcmp(strings_array[0], "LE_LOANERS") == 0)        // Leader elected.
         {
             event_client_leader_selected(&client, strings_array[1], status.MPI_SOURCE);
         }
+        else if(strcmp(strings_array[0], "LE_LOANERS_ACK") == 0)
+        {
+            event_client_announce_ack(&client, atoi(strings_array[1]), atoi(strings_array[2]));
+        }
 
 
         else if(strcmp(strings_array[0], "TAKE_BOOK") == 0)
@@ -987,6 +2017,21 @@ void start_client(int rank, int num_libs)
             int b_id = atoi(strings_array[1]);
             event_client_takeBook(&client, b_id, num_libs);
         }
+        else if(strcmp(strings_array[0], "GET_BOOK") == 0)      // Pushed by a library from a waitlist.
+        {
+            int b_cost = atoi(strings_array[1]);
+            int b_id = atoi(strings_array[2]);
+            int epoch = atoi(strings_array[3]);
+            event_client_get_book(&client, b_id, b_cost, status.MPI_SOURCE, epoch);
+        }
+        else if(strcmp(strings_array[0], "TAKE_BOOKS") == 0)
+        {
+            event_client_takeBooks(&client, strings_array, num_libs);
+        }
+        else if(strcmp(strings_array[0], "RETURN_BOOK") == 0)
+        {
+            event_client_returnBook(&client, strings_array);
+        }
         else if(strcmp(strings_array[0], "DONATE_BOOKS") == 0)  // Coordinator sends the msg
         {
             int b_id = atoi(strings_array[1]);
@@ -1008,7 +2053,8 @@ void start_client(int rank, int num_libs)
         }
         else if(strcmp(strings_array[0], "CHECK_NUM_BOOKS_LOAN") == 0)
         {
-            event_client_check_numBooksLoan(&client, status.MPI_SOURCE);
+            int epoch = atoi(strings_array[1]);
+            event_client_check_numBooksLoan(&client, status.MPI_SOURCE, epoch);
         }
         else if(strcmp(strings_array[0], "SHUTDOWN") == 0)
         {
@@ -1020,6 +2066,8 @@ void start_client(int rank, int num_libs)
         }
 
 
+        stats_event_end();
+
         // Release memory
         memset(buffer_recv, 0, sizeof(buffer_recv));    // Clear the memory just in case.
         free_string_array(strings_array);
@@ -8,22 +8,75 @@
 #include <mpi.h>
 
 #include "my_funcs.h"
+#include "comm.h"
 #include "book.h"
+#include "hop_trace.h"
 
 
+/*
+* The libraries that lent the copies of a book, oldest first, with how many copies each one lent.
+*/
+typedef struct book_lender_t {
+
+    int lib_rank;
+    int count;
+
+    struct book_lender_t *next;
+
+} book_lender_t;
+
 typedef struct borrower_book_t {
 
     book_t book;
     int loan_num;               // How many times have i loaned this book from a library.
+    int returned_num;           // How many of those copies i've returned.
+    book_lender_t *lenders;     // Who lent the copies i still hold, every returned copy goes back to its lender.
 
     struct borrower_book_t *next;
 
 } borrower_book_t;
 
+/*
+* A message that waits until the client knows the leader of the borrowers (see client_defers()).
+*/
+typedef struct deferred_msg_t {
+
+    char *msg;
+    int source;
+    int tag;
+    struct deferred_msg_t *next;
+
+} deferred_msg_t;
+
+
+/*
+* The election of a borrower graph with cycles (client.c, event_client_wave()): an echo wave with extinction elects the
+* biggest rank, then 'BFS' rounds build a BFS tree from it.
+*/
+typedef struct {
+
+    int wave;                   // The biggest initiator whose wave i'm in, 0 before the election.
+    int parent;                 // The neighbor that brought it, myself if it's my wave.
+    int pending;                // Neighbors that haven't answered the wave yet.
+    int size;                   // Borrowers in my subtree of the wave and its depth, from the echoes so far.
+    int depth;
+
+    int round;                  // 'BFS' round, 0 before they start.
+    int rounds;                 // The depth of the leader's wave tree, no borrower is farther than that.
+    int dist;                   // Hops to the leader, -1 while unknown.
+    int *recv[2];               // The distances the neighbors sent in this round and in the next one (by parity), BFS_NONE until they come.
+    int ends;                   // 'BFS_END'/'BFS_ECHO' i got.
+    int echoes;
+    int *children;              // The BFS tree.
+    int children_num;
+
+} echo_state_t;
+
+
 typedef struct {
 
     int c_id;                   // Logical id based on the assignment pdf.
-    int rank;                   // Rank of the process (real id).
+    int rank;                   // Id of the process for comm_send()/comm_recv() (the MPI rank, unless clients are virtual).
     char *str_rank;             // String representation of the rank.
 
     int *neighbors;             // Dynamic array that holds the ranks of my neighbors/connections.
@@ -31,15 +84,30 @@ typedef struct {
 
     int *voters;                // Dynamic array that holds the ranks of the neighbors that "voted" for me (send "ELECT" for the LE).
     int votes;                  // The number of voters (how many neighbors have sent "ELECT" to me).
+    int *voter_heights;         // For every voter, how far its farthest borrower is from it (the "ELECT" argument).
+    int *voter_loads;           // For every voter, the books it holds.
 
     int leader_rank;            // The real id of the elected leader.
     int sent_elect_to;          // Is 0 if i haven't sent an "ELECT" message, otherwise containts the c_id that i sent a message to.
+
+    int announce_parent;        // The neighbor that sent me "LE_LOANERS", 0 if i'm the leader.
+    int announce_acks;          // "LE_LOANERS_ACK" i still wait for, from the neighbors i sent "LE_LOANERS" to.
+    int announce_nodes;         // Borrowers in my subtree that got "LE_LOANERS" and how deep it is, from the acks so far.
+    int announce_depth;
+    deferred_msg_t *deferred;   // FIFO of the messages that wait for "LE_LOANERS".
+
+    echo_state_t echo;          // Election of a graph with cycles.
     
     borrower_book_t *book_list;  // List that holds information about what books i've borrowed
 
+    int epoch;                  // The last 'CHECK_NUM_BOOKS_LOAN' epoch i've seen, my returns are stamped with it.
+    epoch_counter_t loans;      // Copies i got, by the epoch of the library that lent them.
+    epoch_counter_t returns;    // Copies i returned, by my epoch when i sent them.
+
 } borrower_t;
 
 
+int client_set_election(const char *name);
 void start_client(int c_id, int num_libs);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1073 @@
+#include "comm.h"
+
+#include <stddef.h>
+#include <math.h>
+#include <ucontext.h>
+#include <pthread.h>
+
+#include "hop_trace.h"
+#include "transport.h"
+
+
+static RANK_LOCAL rank_stats_t rank_stats;
+static RANK_LOCAL rank_stats_t *stats;      // &rank_stats (comm_init()), the workers of a library point it to its table.
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;     // The event table, for the worker threads.
+static __thread int current_event = -1;     // Index in stats->events, -1 when we're not handling anything.
+static __thread double current_event_start;
+static RANK_LOCAL int lib_ranks = 0;        // Ranks 1 ... lib_ranks host the libraries (comm_init()).
+
+
+/*
+* Names of the TAG_* constants of my_funcs.h, for the tables.
+*/
+static const char *tag_names[] = {
+    "ACK", "CONNECT", "TAKE_BOOK", "DONATE_BOOKS", "GET_MOST_POPULAR_BOOK", "CHECK_NUM_BOOKS_LOANED",
+    "START_LE_LIBR", "START_LE_LOANERS", "NEIGHBOR", "CLIENT_ELECT", "CLIENT_LEADER_SELECTED", "LE_LOANERS_DONE",
+    "LE_LIBRARIES_DONE", "LIB_LEADER", "LIB_PARENT", "LIB_ALREADY", "FIND_BOOK", "BOOK_REQUEST", "ACK_TB",
+    "DONE_FIND_BOOK", "DONATE_BOOKS_DONE", "GET_POPULAR_BK_INFO", "NUM_BOOKS_LOANED", "SHUTDOWN",
+    "RETURN_BOOK", "DONE_RETURN_BOOK", "BOOK_AVAILABLE", "BATCH"
+};
+
+
+static const char *tag_name(int tag)
+{
+    if(tag >= 0 && tag < (int)(sizeof(tag_names) / sizeof(tag_names[0])))
+        return tag_names[tag];
+
+    return "OTHER";
+}
+
+
+static int tag_index(int tag)
+{
+    if(tag < 0 || tag >= STATS_MAX_TAGS)
+        return STATS_MAX_TAGS - 1;
+
+    return tag;
+}
+
+
+static const char *role_name(int rank, int num_libs)
+{
+    if(lib_ranks > 0)
+        num_libs = lib_ranks;       // Not the same with virtual libraries.
+
+    if(rank == COORDINATOR_RANK)
+        return "coordinator";
+    if(rank <= num_libs)
+        return "library";
+    return "client";
+}
+
+
+/*
+* The message layer has two modes:
+*   - plain (the default): comm_send()/comm_recv() are the send/recv of the transport (transport.h, MPI_Send()/MPI_Recv()
+*     unless it's '--transport threads') and a process is a rank.
+*   - packed ('--aggregate', '--lib-tile', '--clients'): the ids the code uses are logical ids (0 the coordinator,
+*     1 ... NUM_LIBS the libraries, then the clients, the same numbers as the ranks of the plain mode) and comm_rank_of()
+*     says which rank hosts an id. Every message between ranks travels in a TAG_BATCH message as
+*     '<source id> <destination id> <tag> <length> <bytes, padded to 4>', and the receiving rank puts it in the mailbox
+*     of its destination, where comm_recv()/comm_iprobe() look for it by source and tag.
+*
+* Aggregation: the messages to a rank are appended to its buffer, which is sent when the next message doesn't fit, when
+* its oldest message is AGG_DEADLINE old, or as soon as the rank would block. Without it every message is sent right away.
+*
+* Virtual processes: with '--lib-tile <T>' a rank hosts a T x T tile of the library grid, with '--clients <C>' the client
+* ranks host C clients between them, C / ranks (rounded up) each. Every one runs start_server()/start_client() in its own
+* ucontext coroutine and a comm_recv() that has nothing to receive switches to the next coroutine that does; when none
+* can run the rank blocks in MPI. Messages inside a rank (neighbors in a tile, clients of the same rank) don't touch MPI.
+*/
+typedef struct {
+
+    char *data;
+    int len;
+    int cap;
+    int msgs;
+    double first_time;              // When the oldest message in it was added.
+
+} agg_buffer_t;
+
+
+typedef struct received_msg {
+
+    int source;
+    int tag;
+    int len;
+    struct received_msg *next;
+    char data[];
+
+} received_msg_t;
+
+
+#define VPROC_READY 0
+#define VPROC_WAITING 1
+#define VPROC_DONE 2
+
+/*
+* A logical process hosted by this rank.
+*/
+typedef struct {
+
+    int id;
+    received_msg_t *head, *tail;    // Mailbox.
+    int state;
+    int wait_source;                // What its comm_recv() waits for, when it's VPROC_WAITING.
+    int wait_tag;
+    int queued;                     // In the run queue.
+
+    ucontext_t ctx;                 // Coroutines only.
+    char *stack;
+    int saved_event;                // The per process state of comm.c/hop_trace.c while it's switched out.
+    double saved_event_start;
+    hop_trace_t saved_trace;
+
+} vproc_t;
+
+
+static RANK_LOCAL int packed = 0;
+static RANK_LOCAL int my_rank = 0;
+static RANK_LOCAL int layout_libs = 0;
+static RANK_LOCAL int logical_size = 0;
+static RANK_LOCAL int *host_rank = NULL;    // Per logical id, the rank that hosts it (NULL: the id is the rank).
+static RANK_LOCAL int *host_slot = NULL;    // Per logical id, its index in vprocs if it's here, -1 if not.
+
+static RANK_LOCAL int agg_enabled = 0;
+static RANK_LOCAL int agg_batch_size;
+static RANK_LOCAL agg_buffer_t *agg_buffers;    // Per destination rank.
+static RANK_LOCAL int *agg_pending;         // Ranks with a non empty buffer.
+static RANK_LOCAL int agg_pending_num = 0;
+
+static RANK_LOCAL vproc_t self_proc;        // The logical process of a rank that hosts one.
+static RANK_LOCAL vproc_t *vprocs = NULL;   // The processes of a rank with virtual libraries/clients.
+static RANK_LOCAL int vprocs_num = 0;
+static RANK_LOCAL vproc_t *running = NULL;  // The coroutine that runs, NULL in the main context of the rank.
+static RANK_LOCAL ucontext_t scheduler_ctx;
+static RANK_LOCAL vproc_t **run_queue;
+static RANK_LOCAL int run_queue_head = 0, run_queue_num = 0;
+static RANK_LOCAL void (*lib_main)(int id, int num_libs);
+static RANK_LOCAL void (*client_main)(int id, int num_libs);
+
+
+/*
+* Sets up the message layer, every rank calls it first thing (after MPI_Init()) with the same arguments.
+*
+* @param lib_tile Side of the square tile of the N x N library grid a rank hosts (the tiles at the right and bottom
+*                 edges may be smaller), ranks 1 ... tiles host them in row major order. 0 or 1 is a library per rank.
+* @param num_clients Clients of the testfile, spread over the R ranks after the libraries, (num_clients + R - 1) / R in
+*                    each (the last ones may get fewer or none, an empty rank leaves its scheduler at once). 0 is one
+*                    client in each rank.
+* @param aggregate Batch size in bytes, 0 for no aggregation.
+* @return 0, or -1 if the ranks don't fit the layout (none left for the clients, or more of them than clients).
+*/
+int comm_init(int num_libs, int lib_tile, int num_clients, int aggregate)
+{
+    int size, client_ranks, clients_per_rank = 1, N, tiles_per_row, id, i;
+
+
+    stats = &rank_stats;
+    my_rank = transport_rank();
+    size = transport_size();
+
+    N = sqrt(num_libs);
+    if(lib_tile < 1 || lib_tile > N)
+        lib_tile = 1;
+    tiles_per_row = (N + lib_tile - 1) / lib_tile;
+
+    layout_libs = num_libs;
+    lib_ranks = lib_tile > 1 ? tiles_per_row * tiles_per_row : num_libs;
+    client_ranks = size - 1 - lib_ranks;
+    if(client_ranks <= 0)
+        return -1;
+    if(num_clients <= 0)
+        num_clients = client_ranks;
+    if(client_ranks > num_clients)
+        return -1;
+    clients_per_rank = (num_clients + client_ranks - 1) / client_ranks;
+    logical_size = 1 + num_libs + num_clients;
+
+    packed = aggregate > 0 || lib_tile > 1 || clients_per_rank > 1;
+    agg_enabled = aggregate > 0;
+    agg_batch_size = aggregate > AGG_MAX_MSG + 16 ? aggregate : AGG_MAX_MSG + 16;
+    if(!packed)
+        return 0;
+
+    agg_buffers = (agg_buffer_t *) MyCalloc(size, sizeof(agg_buffer_t));
+    agg_pending = (int *) MyCalloc(size, sizeof(int));
+    memset(&self_proc, 0, sizeof(self_proc));
+    self_proc.id = my_rank;
+    if(lib_tile == 1 && clients_per_rank == 1)
+        return 0;                   // Only aggregation, every rank is its process.
+
+    // Where every id lives. The coordinator is rank 0 and every other rank hosts its processes as coroutines.
+    host_rank = (int *) MyCalloc(logical_size, sizeof(int));
+    host_slot = (int *) MyCalloc(logical_size, sizeof(int));
+    for(id = 1; id < logical_size; id++)
+    {
+        if(id <= num_libs)
+        {
+            int x = (id - 1) % N, y = (id - 1) / N;
+
+            host_rank[id] = lib_tile > 1 ? 1 + (y / lib_tile) * tiles_per_row + x / lib_tile : id;
+        }
+        else
+        {
+            host_rank[id] = lib_ranks + 1 + (id - num_libs - 1) / clients_per_rank;
+        }
+
+        host_slot[id] = -1;
+        if(host_rank[id] == my_rank)
+            host_slot[id] = vprocs_num++;
+    }
+    host_slot[0] = -1;
+
+    if(my_rank != COORDINATOR_RANK)
+    {
+        vprocs = (vproc_t *) MyCalloc(vprocs_num > 0 ? vprocs_num : 1, sizeof(vproc_t));    // Not NULL on an empty rank.
+        run_queue = (vproc_t **) MyCalloc(vprocs_num > 0 ? vprocs_num : 1, sizeof(vproc_t *));
+        for(id = 1, i = 0; id < logical_size; id++)
+        {
+            if(host_slot[id] >= 0)
+                vprocs[i++].id = id;
+        }
+        self_proc.id = -1;          // The rank itself isn't a process.
+    }
+
+    return 0;
+}
+
+
+/*
+* @return The number of logical processes (the number of ranks in the plain mode).
+*/
+int comm_size()
+{
+    return logical_size;
+}
+
+
+/*
+* @return The rank that hosts a logical id.
+*/
+int comm_rank_of(int id)
+{
+    if(host_rank == NULL || id < 0 || id >= logical_size)
+        return id;
+    return host_rank[id];
+}
+
+
+/*
+* @return The logical process of this rank with the given id, NULL if it isn't here.
+*/
+static vproc_t *local_vproc(int id)
+{
+    if(id == self_proc.id)
+        return &self_proc;
+    if(vprocs != NULL && id > 0 && id < logical_size && host_slot[id] >= 0)
+        return &vprocs[host_slot[id]];
+    return NULL;
+}
+
+
+static int matches(received_msg_t *m, int source, int tag)
+{
+    return (source == MPI_ANY_SOURCE || m->source == source) && (tag == MPI_ANY_TAG || m->tag == tag);
+}
+
+
+static void run_queue_push(vproc_t *vp)
+{
+    if(vp->queued)
+        return;
+    vp->queued = 1;
+    run_queue[(run_queue_head + run_queue_num++) % vprocs_num] = vp;
+}
+
+
+/*
+* Puts a message in the mailbox of its destination and wakes the destination up if that's what it waits for.
+*/
+static void deliver(int source, int dest, int tag, const char *data, int len)
+{
+    vproc_t *vp = local_vproc(dest);
+    received_msg_t *m;
+
+
+    if(vp == NULL)
+    {
+        print_error("Rank %d got a message (tag %d from %d) for id %d that it doesn't host", my_rank, tag, source, dest);
+        return;
+    }
+
+    m = (received_msg_t *) MyCalloc(1, sizeof(received_msg_t) + len);
+    m->source = source;
+    m->tag = tag;
+    m->len = len;
+    memcpy(m->data, data, len);
+
+    if(vp->tail == NULL)
+        vp->head = m;
+    else
+        vp->tail->next = m;
+    vp->tail = m;
+
+    if(vp->state == VPROC_WAITING && matches(m, vp->wait_source, vp->wait_tag))
+    {
+        vp->state = VPROC_READY;
+        run_queue_push(vp);
+    }
+}
+
+
+static void agg_flush_dest(int dest)
+{
+    agg_buffer_t *b = &agg_buffers[dest];
+    tag_stats_t *t = &stats->tags[tag_index(TAG_BATCH)];
+    int i;
+
+
+    if(b->len == 0)
+        return;
+
+    t->msgs_sent++;
+    t->bytes_sent += b->len;
+    stats->batched_msgs += b->msgs;
+    transport_send(b->data, b->len, MPI_BYTE, dest, TAG_BATCH);
+    b->len = 0;
+    b->msgs = 0;
+
+    for(i = 0; i < agg_pending_num; i++)
+    {
+        if(agg_pending[i] == dest)
+        {
+            agg_pending[i] = agg_pending[--agg_pending_num];
+            break;
+        }
+    }
+}
+
+
+/*
+* Sends every buffered message. Call it before anything that waits on other ranks outside of comm_recv() (collectives).
+*/
+void comm_flush()
+{
+    while(agg_pending_num > 0)
+        agg_flush_dest(agg_pending[agg_pending_num - 1]);
+}
+
+
+static void agg_flush_old(double now)
+{
+    int i;
+
+
+    for(i = agg_pending_num - 1; i >= 0; i--)
+    {
+        if(now - agg_buffers[agg_pending[i]].first_time >= AGG_DEADLINE)
+            agg_flush_dest(agg_pending[i]);
+    }
+}
+
+
+static void agg_append(const void *buf, int len, int source, int dest, int tag)
+{
+    int rank = comm_rank_of(dest);
+    agg_buffer_t *b = &agg_buffers[rank];
+    int32_t header[4];
+    int size = 16 + ((len + 3) & ~3);
+
+
+    if(b->len > 0 && b->len + size > agg_batch_size)
+        agg_flush_dest(rank);
+
+    if(b->cap < size || b->cap < agg_batch_size)
+    {
+        b->cap = size > agg_batch_size ? size : agg_batch_size;
+        b->data = (char *) MyRealloc(b->data, b->cap);
+    }
+    if(b->len == 0)
+    {
+        b->first_time = transport_wtime();
+        agg_pending[agg_pending_num++] = rank;
+    }
+
+    header[0] = source;
+    header[1] = dest;
+    header[2] = tag;
+    header[3] = len;
+    memcpy(b->data + b->len, header, 16);
+    memcpy(b->data + b->len + 16, buf, len);
+    memset(b->data + b->len + 16 + len, 0, size - 16 - len);
+    b->len += size;
+    b->msgs++;
+
+    if(!agg_enabled || len > AGG_MAX_MSG)
+        agg_flush_dest(rank);
+}
+
+
+/*
+* Outbox of the worker threads of a library ('--server-threads'). Nothing in this file is thread safe, so a comm_send()
+* of a worker only queues the message and the thread that receives sends it with comm_outbox_flush(), in order.
+*/
+typedef struct outbox_msg {
+
+    int dest;
+    int tag;
+    int count;
+    MPI_Datatype datatype;
+    MPI_Comm comm;
+    struct outbox_msg *next;
+    char data[];
+
+} outbox_msg_t;
+
+
+static __thread int outbox_thread = 0;
+static pthread_mutex_t outbox_lock = PTHREAD_MUTEX_INITIALIZER;
+static outbox_msg_t *outbox_head = NULL, *outbox_tail = NULL;
+
+
+/*
+* The state of the rank that a worker thread needs (comm_outbox_attach()), taken by the thread of the rank.
+*/
+void *comm_thread_context()
+{
+    return stats;
+}
+
+
+/*
+* Every comm_send() of the calling thread goes to the outbox from now on, and its events are counted in the table of
+* the rank that gave it the context.
+*/
+void comm_outbox_attach(void *context)
+{
+    stats = (rank_stats_t *) context;
+    outbox_thread = 1;
+}
+
+
+static int outbox_push(const void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm)
+{
+    outbox_msg_t *m;
+    int type_size;
+
+
+    MPI_Type_size(datatype, &type_size);
+    m = (outbox_msg_t *) MyCalloc(1, sizeof(outbox_msg_t) + (size_t)count * type_size);
+    m->dest = dest;
+    m->tag = tag;
+    m->count = count;
+    m->datatype = datatype;
+    m->comm = comm;
+    memcpy(m->data, buf, (size_t)count * type_size);
+
+    pthread_mutex_lock(&outbox_lock);
+    if(outbox_tail == NULL)
+        outbox_head = m;
+    else
+        outbox_tail->next = m;
+    outbox_tail = m;
+    pthread_mutex_unlock(&outbox_lock);
+
+    return MPI_SUCCESS;
+}
+
+
+/*
+* Sends what the worker threads queued.
+* @return How many messages were sent.
+*/
+int comm_outbox_flush()
+{
+    outbox_msg_t *m, *next;
+    int sent = 0;
+
+
+    pthread_mutex_lock(&outbox_lock);
+    m = outbox_head;
+    outbox_head = outbox_tail = NULL;
+    pthread_mutex_unlock(&outbox_lock);
+
+    for(; m != NULL; m = next)
+    {
+        next = m->next;
+        comm_send(m->data, m->count, m->datatype, m->dest, m->tag, m->comm);
+        free(m);
+        sent++;
+    }
+
+    return sent;
+}
+
+
+/*
+* Wraps MPI_Send(), dest is a logical id in the packed mode.
+*/
+int comm_send(const void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm)
+{
+    int type_size, source;
+    tag_stats_t *t = &stats->tags[tag_index(tag)];
+
+
+    if(outbox_thread)
+        return outbox_push(buf, count, datatype, dest, tag, comm);
+
+    MPI_Type_size(datatype, &type_size);
+    t->msgs_sent++;
+    t->bytes_sent += (long long)count * type_size;
+
+    if(!packed || comm != MPI_COMM_WORLD)
+        return transport_send(buf, count, datatype, dest, tag);
+
+    if(dest < 0 || dest >= logical_size)
+    {
+        print_error("Rank %d can't send tag %d to id %d, the ids are 0 to %d", my_rank, tag, dest, logical_size - 1);
+        return MPI_ERR_RANK;
+    }
+
+    source = running != NULL ? running->id : self_proc.id;
+    if(comm_rank_of(dest) == my_rank)
+    {
+        deliver(source, dest, tag, buf, count * type_size);
+        return MPI_SUCCESS;
+    }
+
+    if(agg_enabled)
+        agg_flush_old(transport_wtime());
+    agg_append(buf, count * type_size, source, dest, tag);
+    return MPI_SUCCESS;
+}
+
+
+/*
+* Receives a TAG_BATCH message and delivers its messages.
+* @return 0 if it didn't block and nothing had arrived.
+*/
+static int receive_batch(int blocking)
+{
+    MPI_Status status;
+    tag_stats_t *t = &stats->tags[tag_index(TAG_BATCH)];
+    char *data;
+    int flag, len, offset;
+
+
+    if(blocking)
+        transport_probe(MPI_ANY_SOURCE, TAG_BATCH, &status);
+    else
+    {
+        transport_iprobe(MPI_ANY_SOURCE, TAG_BATCH, &flag, &status);
+        if(!flag)
+            return 0;
+    }
+
+    MPI_Get_count(&status, MPI_BYTE, &len);
+    data = (char *) MyMalloc(len > 0 ? len : 1);
+    transport_recv(data, len, MPI_BYTE, status.MPI_SOURCE, TAG_BATCH, MPI_STATUS_IGNORE);
+    t->msgs_recv++;
+    t->bytes_recv += len;
+
+    for(offset = 0; offset + 16 <= len; )
+    {
+        int32_t header[4];
+
+        memcpy(header, data + offset, 16);
+        deliver(header[0], header[1], header[2], data + offset + 16, header[3]);
+        offset += 16 + ((header[3] + 3) & ~3);
+    }
+
+    free(data);
+    return 1;
+}
+
+
+/*
+* @return The first message in the mailbox from the source with the tag (MPI_ANY_* match everything), NULL if none.
+*/
+static received_msg_t **mailbox_find(vproc_t *vp, int source, int tag)
+{
+    received_msg_t **mp;
+
+
+    for(mp = &vp->head; *mp != NULL; mp = &(*mp)->next)
+    {
+        if(matches(*mp, source, tag))
+            return mp;
+    }
+    return NULL;
+}
+
+
+/*
+* Unlinks a message found with mailbox_find().
+*/
+static received_msg_t *mailbox_unlink(vproc_t *vp, received_msg_t **mp)
+{
+    received_msg_t *m = *mp;
+
+
+    *mp = m->next;
+    if(vp->tail == m)       // mp is the 'next' of the message before it, or the head.
+        vp->tail = mp == &vp->head ? NULL : (received_msg_t *)((char *)mp - offsetof(received_msg_t, next));
+
+    return m;
+}
+
+
+static void set_status(MPI_Status *status, MPI_Datatype datatype, int source, int tag, int len)
+{
+    int type_size;
+
+
+    MPI_Type_size(datatype, &type_size);
+    status->MPI_SOURCE = source;
+    status->MPI_TAG = tag;
+    status->MPI_ERROR = MPI_SUCCESS;
+    MPI_Status_set_elements(status, datatype, len / type_size);
+}
+
+
+/*
+* Wraps MPI_Recv(), the time we were blocked goes to the event we're handling. In the packed mode the message comes
+* from the mailbox: a coroutine switches out until it's there, the main context of a rank receives batches.
+*/
+int comm_recv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm, MPI_Status *status)
+{
+    MPI_Status local_status;
+    received_msg_t **mp, *m;
+    vproc_t *vp;
+    double start, waited;
+    int ret = MPI_SUCCESS, type_size, recv_count;
+    tag_stats_t *t;
+
+
+    if(status == MPI_STATUS_IGNORE)
+        status = &local_status;
+
+    MPI_Type_size(datatype, &type_size);
+
+    start = transport_wtime();
+    if(!packed || comm != MPI_COMM_WORLD)
+    {
+        ret = transport_recv(buf, count, datatype, source, tag, status);
+    }
+    else
+    {
+        vp = running != NULL ? running : &self_proc;
+        while((mp = mailbox_find(vp, source, tag)) == NULL)
+        {
+            if(running != NULL)
+            {
+                vp->state = VPROC_WAITING;
+                vp->wait_source = source;
+                vp->wait_tag = tag;
+                swapcontext(&vp->ctx, &scheduler_ctx);
+            }
+            else
+            {
+                comm_flush();       // We're going to block.
+                receive_batch(1);
+            }
+        }
+
+        m = mailbox_unlink(vp, mp);
+        if(m->len > count * type_size)
+        {
+            print_error("comm_recv: a message of %d bytes (tag %d from %d) doesn't fit in %d bytes", m->len, m->tag,
+                        m->source, count * type_size);
+            m->len = count * type_size;
+        }
+        memcpy(buf, m->data, m->len);
+        set_status(status, datatype, m->source, m->tag, m->len);
+        free(m);
+    }
+    waited = transport_wtime() - start;
+
+    if(current_event >= 0)
+        stats->events[current_event].recv_wait += waited;
+    else
+        stats->idle_wait += waited;
+
+    MPI_Get_count(status, datatype, &recv_count);
+    t = &stats->tags[tag_index(status->MPI_TAG)];
+    t->msgs_recv++;
+    t->bytes_recv += (long long)recv_count * type_size;
+
+    return ret;
+}
+
+
+/*
+* Wraps MPI_Iprobe(), nothing is counted until the message is received with comm_recv(). In the packed mode it sends
+* what's buffered, takes in every batch that has arrived and looks in the mailbox.
+*/
+int comm_iprobe(int source, int tag, MPI_Comm comm, int *flag, MPI_Status *status)
+{
+    received_msg_t **mp;
+    vproc_t *vp = running != NULL ? running : &self_proc;
+
+
+    if(!packed || comm != MPI_COMM_WORLD)
+        return transport_iprobe(source, tag, flag, status);
+
+    comm_flush();
+    while(receive_batch(0))
+        ;
+
+    mp = mailbox_find(vp, source, tag);
+    *flag = mp != NULL;
+    if(mp != NULL && status != MPI_STATUS_IGNORE)
+        set_status(status, MPI_BYTE, (*mp)->source, (*mp)->tag, (*mp)->len);
+
+    return MPI_SUCCESS;
+}
+
+
+static void vproc_entry()
+{
+    vproc_t *vp = running;
+
+
+    if(vp->id <= layout_libs)
+        lib_main(vp->id, layout_libs);
+    else
+        client_main(vp->id, layout_libs);
+    vp->state = VPROC_DONE;
+}       // Returns to scheduler_ctx (uc_link).
+
+
+/*
+* Runs a coroutine until it waits or finishes, with its own event and trace context.
+*/
+static void vproc_resume(vproc_t *vp)
+{
+    current_event = vp->saved_event;
+    current_event_start = vp->saved_event_start;
+    *hop_trace_current() = vp->saved_trace;
+
+    running = vp;
+    swapcontext(&scheduler_ctx, &vp->ctx);
+    running = NULL;
+
+    if(vp->state == VPROC_DONE)
+        stats_event_end();
+    vp->saved_event = current_event;
+    vp->saved_event_start = current_event_start;
+    vp->saved_trace = *hop_trace_current();
+    current_event = -1;
+}
+
+
+/*
+* Gives the virtual process its stack and context and queues it. getcontext() returns twice, it's kept out of the loops
+* of comm_run_virtual() so their variables aren't clobbered.
+*/
+static void vproc_start(vproc_t *vp)
+{
+    vp->saved_event = -1;
+    vp->stack = (char *) MyMalloc(VPROC_STACK_SIZE);
+    getcontext(&vp->ctx);
+    vp->ctx.uc_stack.ss_sp = vp->stack;
+    vp->ctx.uc_stack.ss_size = VPROC_STACK_SIZE;
+    vp->ctx.uc_link = &scheduler_ctx;
+    makecontext(&vp->ctx, vproc_entry, 0);
+    run_queue_push(vp);
+}
+
+
+/*
+* A rank with virtual libraries/clients: runs server(id, num_libs) for every library and client(id, num_libs) for every
+* client it hosts until they all return.
+* @return 0 if this rank doesn't host virtual processes (the caller runs its process itself), 1 when they're done.
+*/
+int comm_run_virtual(void (*server)(int id, int num_libs), void (*client)(int id, int num_libs))
+{
+    int i, done = 0;
+
+
+    if(vprocs == NULL)
+        return 0;
+
+    lib_main = server;
+    client_main = client;
+    for(i = 0; i < vprocs_num; i++)
+        vproc_start(&vprocs[i]);
+
+    while(done < vprocs_num)
+    {
+        while(run_queue_num > 0)
+        {
+            vproc_t *vp = run_queue[run_queue_head];
+
+            run_queue_head = (run_queue_head + 1) % vprocs_num;
+            run_queue_num--;
+            vp->queued = 0;
+
+            vproc_resume(vp);
+            if(vp->state == VPROC_DONE)
+            {
+                free(vp->stack);
+                vp->stack = NULL;
+                done++;
+            }
+        }
+
+        if(done < vprocs_num)
+        {
+            comm_flush();
+            receive_batch(1);
+        }
+    }
+
+    return 1;
+}
+
+
+/*
+* Starts timing the handling of a message (or a testfile line). Events don't nest, a begin without an end
+* simply closes the previous one. Empty names (e.g. empty lines of the testfile) aren't events.
+*/
+void stats_event_begin(const char *name)
+{
+    int i;
+
+
+    if(current_event >= 0)
+        stats_event_end();
+
+    if(name == NULL || name[0] == '\0')
+        return;
+
+    pthread_mutex_lock(&stats_lock);
+    for(i = 0; i < stats->events_num; i++)
+    {
+        if(strcmp(stats->events[i].name, name) == 0)
+            break;
+    }
+
+    if(i == stats->events_num)
+    {
+        if(stats->events_num < STATS_MAX_EVENTS)
+        {
+            strncpy(stats->events[i].name, name, STATS_NAME_SIZE - 1);
+            stats->events_num++;
+        }
+        else
+        {
+            // The table is full, use the last entry for everything else.
+            i = STATS_MAX_EVENTS - 1;
+            strcpy(stats->events[i].name, "OTHER");
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    current_event = i;
+    current_event_start = transport_wtime();
+}
+
+
+void stats_event_end()
+{
+    event_stats_t *e;
+    double elapsed;
+
+
+    if(current_event < 0)
+        return;
+
+    elapsed = transport_wtime() - current_event_start;
+    pthread_mutex_lock(&stats_lock);
+    e = &stats->events[current_event];
+    e->count++;
+    e->service_time += elapsed;
+    if(elapsed > e->max_service_time)
+        e->max_service_time = elapsed;
+    pthread_mutex_unlock(&stats_lock);
+
+    current_event = -1;
+}
+
+
+static long long all_batches(rank_stats_t *all, int num_of_processes)
+{
+    long long batches = 0;
+    int r;
+
+
+    for(r = 0; r < num_of_processes; r++)
+        batches += all[r].tags[tag_index(TAG_BATCH)].msgs_sent;
+    return batches;
+}
+
+
+/*
+* Prints the per tag totals of all ranks and the events per role (the same message name is a different event for
+* a library and a client). Times are summed over the ranks of the role.
+*/
+static void print_tables(rank_stats_t *all, int num_of_processes, int num_libs)
+{
+    const char *roles[] = { "coordinator", "library", "client" };
+    event_stats_t merged[STATS_MAX_EVENTS];
+    long long msgs_sent, bytes_sent, msgs_recv, bytes_recv;
+    double idle;
+    int r, t, e, k, merged_num, ranks_num;
+
+
+    print_result("%-24s %12s %14s %12s %14s", "tag", "msgs sent", "bytes sent", "msgs recv", "bytes recv");
+    for(t = 0; t < STATS_MAX_TAGS; t++)
+    {
+        msgs_sent = bytes_sent = msgs_recv = bytes_recv = 0;
+        for(r = 0; r < num_of_processes; r++)
+        {
+            msgs_sent += all[r].tags[t].msgs_sent;
+            bytes_sent += all[r].tags[t].bytes_sent;
+            msgs_recv += all[r].tags[t].msgs_recv;
+            bytes_recv += all[r].tags[t].bytes_recv;
+        }
+
+        if(msgs_sent == 0 && msgs_recv == 0)
+            continue;
+
+        print_result("%-24s %12lld %14lld %12lld %14lld", tag_name(t), msgs_sent, bytes_sent, msgs_recv, bytes_recv);
+    }
+
+    msgs_sent = 0;
+    for(r = 0; r < num_of_processes; r++)
+        msgs_sent += all[r].batched_msgs;
+    if(msgs_sent > 0)
+    {
+        print_result("%lld messages went in %lld batches (%.2f per batch)", msgs_sent, all_batches(all, num_of_processes),
+                     (double)msgs_sent / all_batches(all, num_of_processes));
+    }
+
+
+    for(k = 0; k < 3; k++)
+    {
+        merged_num = 0;
+        ranks_num = 0;
+        idle = 0;
+        memset(merged, 0, sizeof(merged));
+
+        for(r = 0; r < num_of_processes; r++)
+        {
+            if(strcmp(role_name(r, num_libs), roles[k]) != 0)
+                continue;
+
+            ranks_num++;
+            idle += all[r].idle_wait;
+            for(e = 0; e < all[r].events_num; e++)
+            {
+                event_stats_t *src = &all[r].events[e];
+                int i;
+
+                for(i = 0; i < merged_num; i++)
+                {
+                    if(strcmp(merged[i].name, src->name) == 0)
+                        break;
+                }
+                if(i == merged_num)
+                {
+                    if(merged_num == STATS_MAX_EVENTS)
+                        continue;
+                    strcpy(merged[i].name, src->name);
+                    merged_num++;
+                }
+
+                merged[i].count += src->count;
+                merged[i].service_time += src->service_time;
+                merged[i].recv_wait += src->recv_wait;
+                if(src->max_service_time > merged[i].max_service_time)
+                    merged[i].max_service_time = src->max_service_time;
+            }
+        }
+
+        if(ranks_num == 0)
+            continue;
+
+        print_result("%s events (%d ranks, %.6f s idle in receive per rank)", roles[k], ranks_num, idle / ranks_num);
+        print_result("    %-24s %10s %14s %14s %14s %14s", "event", "count", "total (s)", "avg (us)", "max (us)", "recv wait (s)");
+        for(e = 0; e < merged_num; e++)
+        {
+            if(merged[e].count == 0)
+                continue;
+
+            print_result("    %-24s %10lld %14.6f %14.1f %14.1f %14.6f", merged[e].name, merged[e].count, merged[e].service_time,
+                         merged[e].service_time / merged[e].count * 1e6, merged[e].max_service_time * 1e6, merged[e].recv_wait);
+        }
+    }
+}
+
+
+/*
+* One line per rank and tag, and one per rank and event.
+*/
+static void write_csv(rank_stats_t *all, int num_of_processes, int num_libs, const char *csv_path)
+{
+    FILE *fp;
+    int r, t, e;
+
+
+    fp = fopen(csv_path, "w");
+    if(fp == NULL)
+    {
+        print_error("Couldn't open file %s", csv_path);
+        return;
+    }
+
+    fprintf(fp, "kind,rank,role,name,msgs_sent,bytes_sent,msgs_recv,bytes_recv,count,service_s,max_service_s,recv_wait_s\n");
+    for(r = 0; r < num_of_processes; r++)
+    {
+        for(t = 0; t < STATS_MAX_TAGS; t++)
+        {
+            tag_stats_t *ts = &all[r].tags[t];
+
+            if(ts->msgs_sent == 0 && ts->msgs_recv == 0)
+                continue;
+            fprintf(fp, "tag,%d,%s,%s,%lld,%lld,%lld,%lld,,,,\n", r, role_name(r, num_libs), tag_name(t),
+                    ts->msgs_sent, ts->bytes_sent, ts->msgs_recv, ts->bytes_recv);
+        }
+
+        for(e = 0; e < all[r].events_num; e++)
+        {
+            event_stats_t *es = &all[r].events[e];
+
+            fprintf(fp, "event,%d,%s,%s,,,,,%lld,%.9f,%.9f,%.9f\n", r, role_name(r, num_libs), es->name,
+                    es->count, es->service_time, es->max_service_time, es->recv_wait);
+        }
+        fprintf(fp, "event,%d,%s,IDLE,,,,,,,,%.9f\n", r, role_name(r, num_libs), all[r].idle_wait);
+    }
+
+    fclose(fp);
+    print_result("Coordinator: wrote the counters of every rank to %s", csv_path);
+}
+
+
+/*
+* Gathers the counters of every rank to the coordinator.
+*/
+void stats_report(int rank, int num_libs, const char *csv_path)
+{
+    rank_stats_t *all = NULL;
+    int num_of_processes;
+
+
+    stats_event_end();
+    comm_flush();
+    num_of_processes = transport_size();
+
+    if(rank == COORDINATOR_RANK)
+        all = (rank_stats_t *) MyCalloc(num_of_processes, sizeof(rank_stats_t));
+
+    transport_gather(stats, sizeof(rank_stats_t), all, COORDINATOR_RANK);
+
+    if(rank == COORDINATOR_RANK)
+    {
+        print_tables(all, num_of_processes, num_libs);
+        if(csv_path != NULL)
+            write_csv(all, num_of_processes, num_libs, csv_path);
+        free(all);
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef COMM_H
+#define COMM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+
+#include "my_funcs.h"
+#include "transport.h"
+
+
+#define STATS_MAX_TAGS 32           // Tags are the TAG_* constants of my_funcs.h, anything above goes to the last one.
+#define STATS_MAX_EVENTS 48         // Different message names a rank handles, the rest are counted as "OTHER".
+#define STATS_NAME_SIZE 32
+
+#define AGG_BATCH_SIZE 4096         // Default size of a batch with '--aggregate'.
+#define AGG_MAX_MSG 256             // Bigger messages aren't aggregated.
+#define AGG_DEADLINE 0.001          // Seconds a message may wait in a batch while the rank keeps sending.
+#define VPROC_STACK_SIZE (256 * 1024)   // Stack of a virtual library/client.
+
+
+/*
+* Messages and bytes that went through a tag.
+*/
+typedef struct {
+
+    long long msgs_sent;
+    long long bytes_sent;
+    long long msgs_recv;
+    long long bytes_recv;
+
+} tag_stats_t;
+
+
+/*
+* An event is the handling of a message (by its name, e.g. 'LEND_BOOK') or a line of the testfile for the coordinator.
+*/
+typedef struct {
+
+    char name[STATS_NAME_SIZE];
+    long long count;
+    double service_time;            // Total time from stats_event_begin() to stats_event_end().
+    double max_service_time;
+    double recv_wait;               // Time blocked in comm_recv() while handling the event.
+
+} event_stats_t;
+
+
+typedef struct {
+
+    tag_stats_t tags[STATS_MAX_TAGS];
+    event_stats_t events[STATS_MAX_EVENTS];
+    int events_num;
+    double idle_wait;               // Time blocked in comm_recv() outside of an event (waiting for the next message).
+    long long batched_msgs;         // Messages sent in the TAG_BATCH messages.
+
+} rank_stats_t;
+
+
+/*
+* MPI_Send()/MPI_Recv() with the same arguments, they also update the counters of the rank. The ranks they take are
+* logical ids (see comm.c), the same as the ranks unless clients are virtual. Under them is the transport (transport.h),
+* the communicator can only be MPI_COMM_WORLD.
+*/
+int comm_send(const void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm);
+int comm_recv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm, MPI_Status *status);
+int comm_iprobe(int source, int tag, MPI_Comm comm, int *flag, MPI_Status *status);
+
+int comm_init(int num_libs, int lib_tile, int num_clients, int aggregate);
+int comm_size();
+int comm_rank_of(int id);
+int comm_run_virtual(void (*server)(int id, int num_libs), void (*client)(int id, int num_libs));
+void comm_flush();
+void *comm_thread_context();
+void comm_outbox_attach(void *context);
+int comm_outbox_flush();
+
+void stats_event_begin(const char *name);
+void stats_event_end();
+
+/*
+* Collective, every rank must call it after 'SHUTDOWN'. The coordinator prints the tables and, if csv_path isn't NULL,
+* writes the counters of every rank to that file.
+*/
+void stats_report(int rank, int num_libs, const char *csv_path);
+
+#endif
@@ -0,0 +1,121 @@
+/*
+* Compiles a text testfile into the binary event stream of events.h, the coordinator mmap()s it instead of parsing
+* every line. Empty lines are dropped, unknown or malformed lines stop the compiler.
+* Usage: ./compile_testfile <testfile.txt> <testfile.bin>
+*        ./compile_testfile -d <testfile.bin>       prints a compiled testfile back as text
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "events.h"
+
+
+static int decompile(const char *path)
+{
+    event_source_t src;
+    event_t ev;
+    int i, ret;
+
+
+    if(event_open(&src, path) != 0 || src.map == NULL)
+    {
+        fprintf(stderr, "%s isn't a compiled testfile.\n", path);
+        return 1;
+    }
+
+    while((ret = event_next(&src, &ev)) == 1)
+    {
+        if(ev.op == EV_RATE)
+        {
+            printf("RATE %g\n", ev.value);
+            continue;
+        }
+        if(ev.value >= 0)
+            printf("%.9g ", ev.value);
+        printf("%s", event_name(ev.op));
+        for(i = 0; i < ev.nargs; i++)
+            printf(" %d", ev.args[i]);
+        printf("\n");
+    }
+
+    event_close(&src);
+    if(ret < 0)
+    {
+        fprintf(stderr, "%s is corrupted after %lld events.\n", path, src.line_no);
+        return 1;
+    }
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    static const char padding[8] = { 0 };
+    event_file_header_t header;
+    event_record_t rec;
+    event_source_t src;
+    event_t ev;
+    FILE *out;
+    int ret;
+
+
+    if(argc == 3 && strcmp(argv[1], "-d") == 0)
+        return decompile(argv[2]);
+
+    if(argc != 3)
+    {
+        fprintf(stderr, "Program usage: %s <testfile.txt> <testfile.bin>\n       %s -d <testfile.bin>\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    if(event_open(&src, argv[1]) != 0 || src.fp == NULL)
+    {
+        fprintf(stderr, "Couldn't open text testfile %s\n", argv[1]);
+        return 1;
+    }
+    out = fopen(argv[2], "wb");
+    if(out == NULL)
+    {
+        fprintf(stderr, "Couldn't open file %s\n", argv[2]);
+        return 1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EVENT_MAGIC, 8);
+    fwrite(&header, sizeof(header), 1, out);        // events_num is filled in at the end.
+
+    while((ret = event_next(&src, &ev)) != 0)
+    {
+        if(ret < 0 || ev.op == EV_UNKNOWN)
+        {
+            fprintf(stderr, "%s:%lld: %s line\n", argv[1], src.line_no, ret < 0 ? "malformed" : "unknown");
+            fclose(out);
+            remove(argv[2]);
+            return 1;
+        }
+        if(ev.op == EV_NONE)
+            continue;
+
+        memset(&rec, 0, sizeof(rec));
+        rec.op = ev.op;
+        rec.nargs = ev.nargs;
+        rec.value = ev.value;
+        fwrite(&rec, sizeof(rec), 1, out);
+        fwrite(ev.args, sizeof(int32_t), ev.nargs, out);
+        fwrite(padding, 1, ((ev.nargs * sizeof(int32_t) + 7) & ~(size_t)7) - ev.nargs * sizeof(int32_t), out);
+        header.events_num++;
+    }
+
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, out);
+    if(fclose(out) != 0)
+    {
+        fprintf(stderr, "Couldn't write file %s\n", argv[2]);
+        return 1;
+    }
+
+    fprintf(stderr, "%llu events\n", (unsigned long long)header.events_num);
+    event_close(&src);
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include "events.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/*
+* Names and argument counts of the events, in the order of the EV_* constants. min_args -1: any number is fine.
+*/
+static const struct {
+
+    const char *name;
+    int min_args;
+    int max_args;
+
+} event_ops[EV_OPS_NUM] = {
+    { "", 0, 0 },
+    { "", -1, -1 },
+    { "CONNECT", 2, 2 },
+    { "TAKE_BOOK", 2, 2 },
+    { "TAKE_BOOKS", 2, EVENT_MAX_ARGS },
+    { "RETURN_BOOK", 2, EVENT_MAX_ARGS },
+    { "DONATE_BOOK", 3, 3 },
+    { "GET_MOST_POPULAR_BOOK", 0, 0 },
+    { "CHECK_NUM_BOOKS_LOANED", 0, 0 },
+    { "START_LE_LIBR", 0, 0 },
+    { "START_LE_LOANERS", 0, 0 },
+    { "SHUTDOWN", 0, 0 },
+    { "RATE", 0, 0 },
+};
+
+
+const char *event_name(int op)
+{
+    if(op < 0 || op >= EV_OPS_NUM)
+        return "";
+    return event_ops[op].name;
+}
+
+
+/*
+* Parses a line of a text testfile, '[<timestamp>] <EVENT> <int> ...' (the line is changed).
+* @param args Where the integer arguments go, EVENT_MAX_ARGS of them.
+* @return 0, or -1 if the line is malformed (wrong number of arguments, an argument that isn't a number).
+*/
+int event_parse_line(char *line, event_t *ev, int32_t *args)
+{
+    char *token, *save, *end;
+    int op;
+
+
+    memset(ev, 0, sizeof(event_t));
+    ev->op = EV_NONE;
+    ev->args = args;
+    ev->value = -1;
+
+    token = strtok_r(line, " \t\r\n", &save);
+    if(token == NULL)
+        return 0;
+
+    // Optional timestamp column.
+    ev->value = strtod(token, &end);
+    if(end != token && *end == '\0')
+    {
+        if(ev->value < 0)
+            return -1;
+        token = strtok_r(NULL, " \t\r\n", &save);
+        if(token == NULL)
+            return -1;
+    }
+    else
+    {
+        ev->value = -1;
+    }
+
+    for(op = EV_CONNECT; op < EV_OPS_NUM; op++)
+    {
+        if(strcmp(token, event_ops[op].name) == 0)
+            break;
+    }
+    if(op == EV_OPS_NUM)
+    {
+        ev->op = EV_UNKNOWN;
+        return 0;
+    }
+    ev->op = op;
+
+    if(op == EV_RATE)
+    {
+        token = strtok_r(NULL, " \t\r\n", &save);
+        if(token == NULL)
+            return -1;
+        ev->value = strtod(token, &end);
+        return (end == token || *end != '\0' || ev->value < 0) ? -1 : 0;
+    }
+
+    while((token = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+    {
+        if(ev->nargs == event_ops[op].max_args)
+            return -1;
+        args[ev->nargs++] = (int32_t)strtol(token, &end, 10);
+        if(end == token || *end != '\0')
+            return -1;
+    }
+
+    return ev->nargs < event_ops[op].min_args ? -1 : 0;
+}
+
+
+/*
+* Opens a testfile, a compiled one (it starts with EVENT_MAGIC) is mmap()ed.
+* @return 0, or -1 if it can't be opened or it's a compiled file that's cut short.
+*/
+int event_open(event_source_t *src, const char *path)
+{
+    event_file_header_t header;
+    struct stat st;
+    int fd;
+
+
+    memset(src, 0, sizeof(event_source_t));
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return -1;
+
+    if(read(fd, &header, sizeof(header)) == sizeof(header) && memcmp(header.magic, EVENT_MAGIC, 8) == 0)
+    {
+        if(fstat(fd, &st) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+
+        src->map_size = st.st_size;
+        src->map = mmap(NULL, src->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(src->map == MAP_FAILED)
+        {
+            src->map = NULL;
+            return -1;
+        }
+        madvise((void *)src->map, src->map_size, MADV_SEQUENTIAL);
+        src->offset = sizeof(event_file_header_t);
+        return 0;
+    }
+
+    close(fd);
+    src->fp = fopen(path, "r");
+    return src->fp == NULL ? -1 : 0;
+}
+
+
+/*
+* @return 1 with the next event in ev, 0 at the end of the testfile, -1 if the line (or the record) is malformed.
+*/
+int event_next(event_source_t *src, event_t *ev)
+{
+    const event_record_t *rec;
+    size_t size;
+
+
+    if(src->map != NULL)
+    {
+        if(src->offset + sizeof(event_record_t) > src->map_size)
+            return 0;
+
+        rec = (const event_record_t *)(src->map + src->offset);
+        size = sizeof(event_record_t) + ((rec->nargs * sizeof(int32_t) + 7) & ~(size_t)7);
+        if(src->offset + size > src->map_size || rec->op >= EV_OPS_NUM)
+            return -1;
+
+        ev->op = rec->op;
+        ev->nargs = rec->nargs;
+        ev->args = (const int32_t *)(rec + 1);
+        ev->value = rec->value;
+        src->offset += size;
+        src->line_no++;
+        return 1;
+    }
+
+    if(fgets(src->line, sizeof(src->line), src->fp) == NULL)
+        return 0;
+    src->line_no++;
+
+    return event_parse_line(src->line, ev, src->args) == 0 ? 1 : -1;
+}
+
+
+void event_close(event_source_t *src)
+{
+    if(src->map != NULL)
+        munmap((void *)src->map, src->map_size);
+    if(src->fp != NULL)
+        fclose(src->fp);
+    memset(src, 0, sizeof(event_source_t));
+}
@@ -0,0 +1,93 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+
+/*
+* The events of a testfile. The coordinator reads them from the text testfile or from its compiled form
+* ('./compile_testfile testfile.txt testfile.bin'), event_open() tells them apart by the magic of the binary file.
+*
+* Binary format: an event_file_header_t, then for every line an event_record_t followed by its nargs int32 arguments,
+* padded to a multiple of 8 bytes. The file is mmap()ed and every event_t points into it, so the coordinator doesn't
+* parse anything. The integers are in the byte order of the machine that compiled the file.
+*/
+#define EVENT_MAGIC "LIBEVT01"
+#define EVENT_MAX_ARGS 256          // Arguments of a line (TAKE_BOOKS/RETURN_BOOK have a list of b_ids).
+#define EVENT_LINE_SIZE 4096
+
+
+enum {
+    EV_NONE = 0,                    // Empty line.
+    EV_UNKNOWN,                     // A line the coordinator doesn't know, it's skipped.
+    EV_CONNECT,                     // CONNECT <c_id1> <c_id2>
+    EV_TAKE_BOOK,                   // TAKE_BOOK <c_id> <b_id>
+    EV_TAKE_BOOKS,                  // TAKE_BOOKS <c_id> <b_id> [<b_id> ...]
+    EV_RETURN_BOOK,                 // RETURN_BOOK <c_id> <b_id> [<b_id> ...]
+    EV_DONATE_BOOK,                 // DONATE_BOOK <c_id> <b_id> <n_copies>
+    EV_GET_MOST_POPULAR_BOOK,
+    EV_CHECK_NUM_BOOKS_LOANED,
+    EV_START_LE_LIBR,
+    EV_START_LE_LOANERS,
+    EV_SHUTDOWN,
+    EV_RATE,                        // RATE <events/s>, replay mode (replay.h)
+    EV_OPS_NUM
+};
+
+
+typedef struct {
+
+    char magic[8];
+    uint64_t events_num;
+
+} event_file_header_t;
+
+
+typedef struct {
+
+    uint16_t op;
+    uint16_t nargs;
+    uint32_t reserved;
+    double value;                   // The timestamp column (< 0: none), or the rate of 'RATE'.
+
+} event_record_t;
+
+
+/*
+* A line of the testfile. args points into the event source, it's valid until the next event_next().
+*/
+typedef struct {
+
+    int op;
+    int nargs;
+    const int32_t *args;
+    double value;                   // As in event_record_t.
+
+} event_t;
+
+
+typedef struct {
+
+    FILE *fp;                       // Text testfile.
+    long long line_no;
+    char line[EVENT_LINE_SIZE];
+    int32_t args[EVENT_MAX_ARGS];
+
+    const char *map;                // Compiled testfile.
+    size_t map_size;
+    size_t offset;
+
+} event_source_t;
+
+
+const char *event_name(int op);
+int event_parse_line(char *line, event_t *ev, int32_t *args);
+
+int event_open(event_source_t *src, const char *path);
+int event_next(event_source_t *src, event_t *ev);
+void event_close(event_source_t *src);
+
+#endif
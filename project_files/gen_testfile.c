@@ -0,0 +1,234 @@
+/*
+* Generates a testfile for a given N in the same grammar as the ones in testfiles_hy486:
+*   CONNECT <c_id> <c_id>           a random tree over the N^3/2 clients (c_ids N^2 ... N^2 + N^3/2 - 1)
+*   START_LE_LIBR / START_LE_LOANERS
+*   TAKE_BOOK <c_id> <b_id>         b_id in 0 ... N^3 - 1, Zipf distributed
+*   DONATE_BOOK <c_id> <b_id> <n>
+*   GET_MOST_POPULAR_BOOK / CHECK_NUM_BOOKS_LOANED
+*
+* Usage: ./gen_testfile -n <N> [options] > testfile.txt      (run it with NP = N^2 + N^3/2 + 1, like run.sh)
+*   -s <seed>        random seed (default: time)
+*   -e <events>      TAKE_BOOK + DONATE_BOOK events (default: 10 per client)
+*   -z <s>           Zipf exponent of the book popularity, 0 is uniform (default: 1.0)
+*   -d <fraction>    fraction of the events that are donations (default: 0.1)
+*   -m <copies>      max copies of a donation (default: 5)
+*   -p <count>       GET_MOST_POPULAR_BOOK queries spread over the events, plus one at the end (default: 1)
+*   -c <count>       CHECK_NUM_BOOKS_LOANED checks spread over the events, plus one at the end (default: 1)
+*   -t <shape>       tree shape: random | path | star (default: random)
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/*
+* xorshift64*, so a seed gives the same testfile everywhere.
+*/
+static unsigned long long rng_state;
+
+static unsigned long long rng_next()
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double rng_uniform()         // [0, 1)
+{
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int rng_range(int n)         // [0, n)
+{
+    return (int)(rng_uniform() * n);
+}
+
+
+static void shuffle(int *array, int n)
+{
+    int i, j, tmp;
+
+
+    for(i = n - 1; i > 0; i--)
+    {
+        j = rng_range(i + 1);
+        tmp = array[i];
+        array[i] = array[j];
+        array[j] = tmp;
+    }
+}
+
+
+/*
+* Zipf over the ranks 1 ... n: cdf[k] is the probability of a rank <= k + 1. The ranks are mapped to book ids through
+* a random permutation, so the popular books are spread over the libraries.
+*/
+static double *zipf_cdf(int n, double s)
+{
+    double *cdf = malloc(n * sizeof(double));
+    double sum = 0;
+    int k;
+
+
+    if(cdf == NULL)
+        return NULL;
+
+    for(k = 0; k < n; k++)
+    {
+        sum += 1.0 / pow(k + 1, s);
+        cdf[k] = sum;
+    }
+    for(k = 0; k < n; k++)
+        cdf[k] /= sum;
+
+    return cdf;
+}
+
+static int zipf_sample(const double *cdf, int n)
+{
+    double u = rng_uniform();
+    int low = 0, high = n - 1, mid;
+
+
+    while(low < high)
+    {
+        mid = (low + high) / 2;
+        if(cdf[mid] < u)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Program usage: %s -n <N> [-s seed] [-e events] [-z zipf_s] [-d donate_fraction] [-m max_copies] "
+                    "[-p popular_queries] [-c count_checks] [-t random|path|star]\n", prog);
+    exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int N = 0, events = -1, max_copies = 5, queries = 1, checks = 1;
+    double zipf_s = 1.0, donate_fraction = 0.1;
+    const char *shape = "random";
+    unsigned long long seed = (unsigned long long)time(NULL);
+    int num_libs, num_clients, num_books, first_client;
+    int *clients, *books;
+    double *cdf;
+    int i, opt, next_query, next_check, queries_done = 0, checks_done = 0;
+
+
+    while((opt = getopt(argc, argv, "n:s:e:z:d:m:p:c:t:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': N = atoi(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            case 'e': events = atoi(optarg); break;
+            case 'z': zipf_s = atof(optarg); break;
+            case 'd': donate_fraction = atof(optarg); break;
+            case 'm': max_copies = atoi(optarg); break;
+            case 'p': queries = atoi(optarg); break;
+            case 'c': checks = atoi(optarg); break;
+            case 't': shape = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if(N < 2 || max_copies < 1 || queries < 0 || checks < 0)
+        usage(argv[0]);
+    if(strcmp(shape, "random") != 0 && strcmp(shape, "path") != 0 && strcmp(shape, "star") != 0)
+        usage(argv[0]);
+
+    num_libs = N * N;
+    num_clients = (N * N * N) / 2;
+    num_books = N * N * N;
+    first_client = num_libs;
+    if(events < 0)
+        events = 10 * num_clients;
+
+    rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;   // Never 0.
+    fprintf(stderr, "N=%d NUM_LIBS=%d clients=%d books=%d NP=%d seed=%llu\n", N, num_libs, num_clients, num_books,
+            num_libs + num_clients + 1, seed);
+
+
+    // Topology: a tree over the clients, in a random order so the c_ids don't give the shape away.
+    clients = malloc(num_clients * sizeof(int));
+    books = malloc(num_books * sizeof(int));
+    cdf = zipf_cdf(num_books, zipf_s);
+    if(clients == NULL || books == NULL || cdf == NULL)
+    {
+        fprintf(stderr, "Malloc failed.\n");
+        return 1;
+    }
+
+    for(i = 0; i < num_clients; i++)
+        clients[i] = first_client + i;
+    shuffle(clients, num_clients);
+
+    for(i = 1; i < num_clients; i++)
+    {
+        int parent;
+
+        if(strcmp(shape, "path") == 0)
+            parent = i - 1;
+        else if(strcmp(shape, "star") == 0)
+            parent = 0;
+        else
+            parent = rng_range(i);      // Random recursive tree.
+
+        printf("CONNECT %d %d\n", clients[i], clients[parent]);
+    }
+
+    printf("START_LE_LIBR\n");
+    printf("START_LE_LOANERS\n");
+
+
+    // Book popularity: rank k (Zipf) is book books[k].
+    for(i = 0; i < num_books; i++)
+        books[i] = i;
+    shuffle(books, num_books);
+
+    next_query = queries > 0 ? events / (queries + 1) : -1;
+    next_check = checks > 0 ? events / (checks + 1) : -1;
+    for(i = 0; i < events; i++)
+    {
+        int c_id = first_client + rng_range(num_clients);
+        int b_id = books[zipf_sample(cdf, num_books)];
+
+        if(rng_uniform() < donate_fraction)
+            printf("DONATE_BOOK %d %d %d\n", c_id, b_id, 1 + rng_range(max_copies));
+        else
+            printf("TAKE_BOOK %d %d\n", c_id, b_id);
+
+        // Only 'queries'/'checks' of them, when events divides evenly the next one would fall on the last event.
+        if(i + 1 == next_query && queries_done < queries)
+        {
+            printf("GET_MOST_POPULAR_BOOK\n");
+            next_query += events / (queries + 1);
+            queries_done++;
+        }
+        if(i + 1 == next_check && checks_done < checks)
+        {
+            printf("CHECK_NUM_BOOKS_LOANED\n");
+            next_check += events / (checks + 1);
+            checks_done++;
+        }
+    }
+
+    printf("GET_MOST_POPULAR_BOOK\n");
+    printf("CHECK_NUM_BOOKS_LOANED\n");
+
+    free(clients);
+    free(books);
+    free(cdf);
+    return 0;
+}
@@ -0,0 +1,284 @@
+#include "hop_trace.h"
+
+#include <time.h>
+#include <math.h>
+
+#include "my_funcs.h"
+
+
+/*
+* Latencies of one hop type (the time from the previous hop to this one), kept by the coordinator.
+*/
+typedef struct {
+
+    char hop;
+    const char *name;
+    double *samples;                        // Microseconds.
+    int samples_num;
+    int samples_cap;
+
+} hop_samples_t;
+
+
+static hop_samples_t hop_samples[] = {
+    { 'C', "coordinator -> client (TAKE_BOOK)", NULL, 0, 0 },
+    { 'L', "client -> library (LEND_BOOK)", NULL, 0, 0 },
+    { 'F', "library -> leader (FIND_BOOK)", NULL, 0, 0 },
+    { 'f', "leader -> library (FOUND_BOOK)", NULL, 0, 0 },
+    { 'R', "library -> owner (BOOK_REQUEST)", NULL, 0, 0 },
+    { 'A', "owner -> library (ACK_TB)", NULL, 0, 0 },
+    { 'W', "waiting on a lookup in flight", NULL, 0, 0 },
+    { 'G', "library -> client (reply)", NULL, 0, 0 },
+    { 'D', "client -> coordinator (DONE)", NULL, 0, 0 },
+    { '*', "end to end", NULL, 0, 0 },
+};
+
+#define HOP_TYPES_NUM ((int)(sizeof(hop_samples) / sizeof(hop_samples[0])))
+
+static int enabled = 0;
+static __thread hop_trace_t current;        // The trace of the message we're handling (per worker thread too).
+
+
+static long long now_us()
+{
+    struct timespec ts;
+
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+void hop_trace_enable()
+{
+    enabled = 1;
+}
+
+
+int hop_trace_enabled()
+{
+    return enabled;
+}
+
+
+/*
+* Coordinator: starts a new trace (t0 is now) and makes it the current one.
+*/
+void hop_trace_start(int id)
+{
+    memset(&current, 0, sizeof(current));
+    current.id = id;
+    current.t0 = now_us();
+}
+
+
+hop_trace_t *hop_trace_current()
+{
+    return &current;
+}
+
+
+void hop_trace_add_hop(hop_trace_t *trace, char hop)
+{
+    if(trace->id == 0 || hop == 0 || trace->hops_num == HOP_TRACE_MAX_HOPS)
+        return;
+
+    trace->hops[trace->hops_num] = hop;
+    trace->deltas[trace->hops_num] = (int)(now_us() - trace->t0);
+    trace->hops_num++;
+}
+
+
+/*
+* Takes the trace context out of a received message (it's the last token, if there is one), appends the given hop
+* and makes it the current trace. Without a context the current trace is cleared.
+* @return 1 if the message had a trace context.
+*/
+int hop_trace_recv(char **str_array, char hop)
+{
+    int last;
+    char *token, *end;
+
+
+    memset(&current, 0, sizeof(current));
+
+    last = get_string_array_size(str_array) - 1;
+    if(last < 1 || str_array[last][0] != '@')
+        return 0;
+
+    token = str_array[last];
+    current.id = strtol(token + 1, &end, 10);
+    if(*end == ':')
+        current.t0 = strtoll(end + 1, &end, 10);
+
+    if(*end == ':')
+    {
+        end++;
+        while(*end != '\0' && current.hops_num < HOP_TRACE_MAX_HOPS)
+        {
+            current.hops[current.hops_num] = *end;
+            current.deltas[current.hops_num] = strtol(end + 1, &end, 10);
+            current.hops_num++;
+
+            if(*end == ',')
+                end++;
+            else
+                break;
+        }
+    }
+
+    // Remove the token so the handlers see the message they expect.
+    free(token);
+    str_array[last] = NULL;
+
+    hop_trace_add_hop(&current, hop);
+    return 1;
+}
+
+
+/*
+* Appends ' @<trace_id>:<t0>:<hops>' to an outgoing message, nothing if there's no trace.
+*/
+void hop_trace_attach(char *buffer, const hop_trace_t *trace)
+{
+    int i;
+
+
+    if(trace->id == 0)
+        return;
+
+    sprintf(buffer + strlen(buffer), " @%d:%lld:", trace->id, trace->t0);
+    for(i = 0; i < trace->hops_num; i++)
+    {
+        sprintf(buffer + strlen(buffer), "%s%c%d", i > 0 ? "," : "", trace->hops[i], trace->deltas[i]);
+    }
+}
+
+
+static void add_sample(char hop, double value)
+{
+    hop_samples_t *s;
+    int i;
+
+
+    for(i = 0; i < HOP_TYPES_NUM; i++)
+    {
+        if(hop_samples[i].hop == hop)
+            break;
+    }
+    if(i == HOP_TYPES_NUM)
+        return;
+
+    s = &hop_samples[i];
+    if(s->samples_num == s->samples_cap)
+    {
+        s->samples_cap = s->samples_cap == 0 ? 256 : s->samples_cap * 2;
+        s->samples = (double *) MyRealloc(s->samples, s->samples_cap * sizeof(double));
+    }
+    s->samples[s->samples_num++] = value;
+}
+
+
+/*
+* Coordinator: splits a finished trace into the latency of every hop (since the previous hop).
+*/
+void hop_trace_record(const hop_trace_t *trace)
+{
+    int i, prev;
+
+
+    if(trace->id == 0)
+        return;
+
+    prev = 0;
+    for(i = 0; i < trace->hops_num; i++)
+    {
+        add_sample(trace->hops[i], trace->deltas[i] - prev);
+        prev = trace->deltas[i];
+    }
+    add_sample('*', prev);
+}
+
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+static double percentile(double *sorted, int n, double p)
+{
+    int idx = (int)ceil(p * n) - 1;
+
+
+    if(idx < 0)
+        idx = 0;
+    if(idx >= n)
+        idx = n - 1;
+    return sorted[idx];
+}
+
+
+/*
+* Coordinator: prints the latency breakdown per hop type, p50/p99/p999 and a log2 histogram (in microseconds).
+*/
+void hop_trace_report()
+{
+    char histogram[BUF_SIZE];
+    int i, j, bucket, counts[32];
+    hop_samples_t *s;
+
+
+    if(!enabled)
+        return;
+
+    print_result("TAKE_BOOK hop latencies (us):");
+    print_result("    %-36s %8s %10s %10s %10s %10s %10s", "hop", "count", "mean", "p50", "p99", "p999", "max");
+    for(i = 0; i < HOP_TYPES_NUM; i++)
+    {
+        double sum = 0;
+
+        s = &hop_samples[i];
+        if(s->samples_num == 0)
+            continue;
+
+        qsort(s->samples, s->samples_num, sizeof(double), compare_doubles);
+        for(j = 0; j < s->samples_num; j++)
+            sum += s->samples[j];
+
+        print_result("    %-36s %8d %10.1f %10.1f %10.1f %10.1f %10.1f", s->name, s->samples_num, sum / s->samples_num,
+                     percentile(s->samples, s->samples_num, 0.50), percentile(s->samples, s->samples_num, 0.99),
+                     percentile(s->samples, s->samples_num, 0.999), s->samples[s->samples_num - 1]);
+    }
+
+    print_result("TAKE_BOOK hop latency histograms (bucket '<2^k us': count):");
+    for(i = 0; i < HOP_TYPES_NUM; i++)
+    {
+        s = &hop_samples[i];
+        if(s->samples_num == 0)
+            continue;
+
+        memset(counts, 0, sizeof(counts));
+        for(j = 0; j < s->samples_num; j++)
+        {
+            bucket = 0;
+            while(bucket < 31 && s->samples[j] >= (double)(1LL << bucket))
+                bucket++;
+            counts[bucket]++;
+        }
+
+        memset(histogram, 0, sizeof(histogram));
+        for(j = 0; j < 32; j++)
+        {
+            if(counts[j] > 0 && strlen(histogram) + 24 < sizeof(histogram))
+                sprintf(histogram + strlen(histogram), " <2^%d:%d", j, counts[j]);
+        }
+        print_result("    %-36s%s", s->name, histogram);
+
+        free(s->samples);
+        s->samples = NULL;
+        s->samples_num = s->samples_cap = 0;
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef HOP_TRACE_H
+#define HOP_TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define HOP_TRACE_MAX_HOPS 12         // Keeps the longest context well inside BUF_SIZE.
+
+
+/*
+* Trace context of a 'TAKE_BOOK' request (coordinator option '--hop-trace'). It travels as the last token of every message
+* on the path of the request, '@<trace_id>:<t0_us>:<hop><delta_us>,<hop><delta_us>,...', and every handler on the path
+* appends a hop: a letter for the handler and the microseconds since the coordinator sent 'TAKE_BOOK' (t0).
+*
+* Hops: 'C' client got TAKE_BOOK, 'L' library got LEND_BOOK, 'F' leader got FIND_BOOK, 'f' library got FOUND_BOOK,
+*       'R' owner got BOOK_REQUEST, 'A' library got ACK_TB, 'W' a coalesced waiter got its answer,
+*       'G' client got the reply, 'D' coordinator got DONE_FIND_BOOK.
+* Times come from the real-time clock, so hops between nodes are only as good as their clock sync.
+*/
+typedef struct {
+
+    int id;                                 // 0: no trace.
+    long long t0;                           // Microseconds.
+    int hops_num;
+    char hops[HOP_TRACE_MAX_HOPS];
+    int deltas[HOP_TRACE_MAX_HOPS];         // Microseconds since t0.
+
+} hop_trace_t;
+
+
+void hop_trace_enable();
+int hop_trace_enabled();
+
+void hop_trace_start(int id);
+hop_trace_t *hop_trace_current();
+int hop_trace_recv(char **str_array, char hop);
+void hop_trace_add_hop(hop_trace_t *trace, char hop);
+void hop_trace_attach(char *buffer, const hop_trace_t *trace);
+
+void hop_trace_record(const hop_trace_t *trace);
+void hop_trace_report();
+
+#endif
@@ -0,0 +1,101 @@
+/*
+* Interleaves the per rank log files (see logger.h) by timestamp.
+* Usage: ./log_merge <LOG_DIR>/rank_*.log > merged.log
+*
+* Every file is already sorted (one writer per rank), so it's a k-way merge: keep the next line of every file and
+* always print the one with the smallest '<sec>.<usec>'. Ties keep the order of the files in the command line.
+* The timestamp is stripped, the rank stays in front of every line.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+typedef struct {
+
+    FILE *file;
+    char *line;             // The next line of the file, NULL when we're done with it.
+    size_t line_cap;
+    double ts;
+
+} log_input_t;
+
+
+/*
+* Reads the next line of an input that has a timestamp. Lines that don't start with one (e.g. the '#' summary at the
+* end of a file) are printed right away.
+*/
+static void advance(log_input_t *in)
+{
+    char *end;
+
+
+    while(getline(&in->line, &in->line_cap, in->file) != -1)
+    {
+        in->ts = strtod(in->line, &end);
+        if(end != in->line)
+            return;
+
+        fputs(in->line, stdout);
+    }
+
+    free(in->line);
+    in->line = NULL;
+    fclose(in->file);
+    in->file = NULL;
+}
+
+
+int main(int argc, char *argv[])
+{
+    log_input_t *inputs;
+    int i, n, best;
+    char *rest;
+
+
+    if(argc < 2)
+    {
+        fprintf(stderr, "Program usage: %s <rank log files...>\n", argv[0]);
+        return 1;
+    }
+
+    n = argc - 1;
+    inputs = calloc(n, sizeof(log_input_t));
+    if(inputs == NULL)
+    {
+        fprintf(stderr, "Calloc failed.\n");
+        return 1;
+    }
+
+    for(i = 0; i < n; i++)
+    {
+        inputs[i].file = fopen(argv[i + 1], "r");
+        if(inputs[i].file == NULL)
+        {
+            fprintf(stderr, "Couldn't open file %s\n", argv[i + 1]);
+            continue;
+        }
+        advance(&inputs[i]);
+    }
+
+    for(;;)
+    {
+        best = -1;
+        for(i = 0; i < n; i++)
+        {
+            if(inputs[i].line != NULL && (best == -1 || inputs[i].ts < inputs[best].ts))
+                best = i;
+        }
+
+        if(best == -1)
+            break;
+
+        // Skip the timestamp, keep '<rank> [LEVEL] [date] message'
+        rest = strchr(inputs[best].line, ' ');
+        fputs(rest != NULL ? rest + 1 : inputs[best].line, stdout);
+        advance(&inputs[best]);
+    }
+
+    free(inputs);
+    return 0;
+}
@@ -0,0 +1,329 @@
+#include "logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "ansi-color-codes.h"
+#include "transport.h"
+
+
+/*
+* A line in the ring. 'seq' tells whose turn it is: the slot is free for the producer that reserved position p when
+* seq == p, and it holds a line for the consumer when seq == p + 1 (bounded MPMC queue, used here with a single consumer).
+*/
+typedef struct {
+
+    atomic_size_t seq;
+    log_level_t level;
+    struct timespec ts;                 // Coarse clock, taken by the producer.
+    char line[LOG_LINE_SIZE];
+
+} log_slot_t;
+
+
+typedef struct {
+
+    log_slot_t *slots;
+    atomic_size_t tail;                 // Next position to reserve (producers).
+    size_t head;                        // Next position to flush (flush thread only).
+    atomic_size_t stalls;               // How many times a producer found the ring full and had to wait.
+
+    int rank;
+    FILE *file;
+    pthread_t flush_thread;
+    atomic_int stop;
+
+} log_ring_t;
+
+
+static const char *level_tags[] = { MAG"[DEBUG]"reset, "[INFO]", HYEL"[WARN]"reset, RED"[ERROR]"reset, "[INFO]" };
+
+static atomic_int log_level = (int)LOG_LEVEL_DEBUG;    // A log_level_t, stored as int like the comparisons.
+static RANK_LOCAL log_ring_t *ring = NULL;     // NULL: print to stdout/stderr right away.
+static atomic_flag atexit_registered = ATOMIC_FLAG_INIT;
+
+
+/*
+* Formats the time as "[day-month-year hour:minutes:seconds]". localtime()/strftime() are only called when the
+* second changes, every thread keeps its own copy.
+*/
+static const char *cached_time_string(time_t t)
+{
+    static __thread time_t cached_t = (time_t)-1;
+    static __thread char cached_str[30];
+    struct tm tm_info;
+
+
+    if(t != cached_t)
+    {
+        localtime_r(&t, &tm_info);
+        strftime(cached_str, sizeof(cached_str), "[%d-%b-%y %H:%M:%S]", &tm_info);
+        cached_t = t;
+    }
+
+    return cached_str;
+}
+
+
+/*
+* Pops one line from the ring and writes it to the log file. Returns 0 if the ring was empty.
+*/
+static int flush_one(log_ring_t *r)
+{
+    log_slot_t *slot = &r->slots[r->head & (LOG_RING_SLOTS - 1)];
+
+
+    if(atomic_load_explicit(&slot->seq, memory_order_acquire) != r->head + 1)
+        return 0;
+
+    // '<sec>.<usec> <rank>' first so that log_merge can interleave the files of all the ranks.
+    fprintf(r->file, "%ld.%06ld %d %s %s %s\n", (long)slot->ts.tv_sec, slot->ts.tv_nsec / 1000, r->rank,
+            level_tags[slot->level], cached_time_string(slot->ts.tv_sec), slot->line);
+
+    atomic_store_explicit(&slot->seq, r->head + LOG_RING_SLOTS, memory_order_release);
+    r->head++;
+    return 1;
+}
+
+
+/*
+* The background thread, drains the ring into the file until log_shutdown().
+*/
+static void *flush_thread_main(void *arg)
+{
+    log_ring_t *r = (log_ring_t *)arg;
+    struct timespec idle = { 0, LOG_FLUSH_IDLE_US * 1000L };
+
+
+    for(;;)
+    {
+        if(flush_one(r))
+            continue;
+
+        // Empty ring, the producers are done only if they've stopped and nothing was reserved after the last check.
+        if(atomic_load(&r->stop) && r->head == atomic_load(&r->tail))
+            break;
+
+        fflush(r->file);
+        nanosleep(&idle, NULL);
+    }
+
+    fflush(r->file);
+    return NULL;
+}
+
+
+/*
+* Parses the LOG_LEVEL environment variable.
+*/
+static log_level_t parse_level(const char *str)
+{
+    if(str == NULL)                         return LOG_LEVEL_DEBUG;
+    if(strcasecmp(str, "debug") == 0)       return LOG_LEVEL_DEBUG;
+    if(strcasecmp(str, "info") == 0)        return LOG_LEVEL_INFO;
+    if(strcasecmp(str, "warn") == 0)        return LOG_LEVEL_WARN;
+    if(strcasecmp(str, "error") == 0)       return LOG_LEVEL_ERROR;
+    if(strcasecmp(str, "off") == 0)         return LOG_LEVEL_OFF;
+
+    fprintf(stderr, RED"[ERROR]"reset" Unknown LOG_LEVEL '%s', using 'debug'\n", str);
+    return LOG_LEVEL_DEBUG;
+}
+
+
+/*
+* Reads the configuration and, if LOG_DIR is set, opens <LOG_DIR>/rank_<rank>.log and starts the flush thread.
+* log_shutdown() is also registered with atexit(), so the lines before an exit(-1) still make it to the file.
+*/
+void log_init(int rank)
+{
+    const char *dir = getenv("LOG_DIR");
+    char path[512];
+    size_t i;
+    log_ring_t *r;
+
+
+    atomic_store(&log_level, (int)parse_level(getenv("LOG_LEVEL")));
+
+    if(dir == NULL || dir[0] == '\0')
+        return;
+
+    mkdir(dir, 0755);       // Every rank tries, it's fine if it already exists.
+    snprintf(path, sizeof(path), "%s/rank_%d.log", dir, rank);
+
+    r = calloc(1, sizeof(log_ring_t));
+    if(r == NULL)
+    {
+        fprintf(stderr, RED"[ERROR]"reset" Rank %d: couldn't allocate the log ring, logging to stdout\n", rank);
+        return;
+    }
+
+    r->slots = calloc(LOG_RING_SLOTS, sizeof(log_slot_t));
+    r->file = fopen(path, "w");
+    if(r->slots == NULL || r->file == NULL)
+    {
+        fprintf(stderr, RED"[ERROR]"reset" Rank %d: couldn't open %s, logging to stdout\n", rank, path);
+        if(r->file != NULL)
+            fclose(r->file);
+        free(r->slots);
+        free(r);
+        return;
+    }
+    setvbuf(r->file, NULL, _IOFBF, 1 << 16);
+    r->rank = rank;
+
+    for(i = 0; i < LOG_RING_SLOTS; i++)
+        atomic_init(&r->slots[i].seq, i);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->stalls, 0);
+    atomic_init(&r->stop, 0);
+
+    if(pthread_create(&r->flush_thread, NULL, flush_thread_main, r) != 0)
+    {
+        fprintf(stderr, RED"[ERROR]"reset" Rank %d: couldn't start the log flush thread, logging to stdout\n", rank);
+        fclose(r->file);
+        free(r->slots);
+        free(r);
+        return;
+    }
+
+    ring = r;
+    if(!atomic_flag_test_and_set(&atexit_registered))
+        atexit(log_shutdown);
+}
+
+
+/*
+* The ring of the calling rank, for the threads that log for it (log_thread_attach()).
+*/
+void *log_thread_context()
+{
+    return ring;
+}
+
+
+/*
+* The lines of the calling thread go to the ring of the rank that gave it the context (the ring takes any number of
+* producers).
+*/
+void log_thread_attach(void *context)
+{
+    ring = (log_ring_t *) context;
+}
+
+
+/*
+* Stops the flush thread after it has written everything and closes the file. Safe to call more than once.
+*/
+void log_shutdown()
+{
+    log_ring_t *r = ring;
+    size_t stalls;
+
+
+    if(r == NULL)
+        return;
+
+    atomic_store(&r->stop, 1);
+    pthread_join(r->flush_thread, NULL);
+    ring = NULL;
+
+    stalls = atomic_load(&r->stalls);
+    if(stalls > 0)
+        fprintf(r->file, "# rank %d: the log ring was full %zu times\n", r->rank, stalls);
+
+    fclose(r->file);
+    free(r->slots);
+    free(r);
+}
+
+
+int log_enabled(log_level_t level)
+{
+    return (int)level >= atomic_load_explicit(&log_level, memory_order_relaxed);
+}
+
+
+void log_set_level(log_level_t level)
+{
+    atomic_store(&log_level, (int)level);
+}
+
+
+/*
+* Formats a line straight into a slot of the ring, or prints it right away if there's no ring.
+* The prefix (can be NULL) goes in front of the formatted arguments, e.g. the file and line of an error.
+* Errors are always printed to stderr as well, they're usually followed by exit().
+*/
+void log_vwrite(log_level_t level, const char *prefix, const char *format, va_list args)
+{
+    log_ring_t *r = ring;
+    log_slot_t *slot;
+    struct timespec ts;
+    size_t pos, seq;
+    int len = 0;
+    va_list args_copy;
+
+
+    if(!log_enabled(level))
+        return;
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+
+    if(r == NULL || level == LOG_LEVEL_ERROR)
+    {
+        char message_buf[1024];   // buffer for formatted args
+
+        va_copy(args_copy, args);
+        vsnprintf(message_buf, sizeof(message_buf), format, args_copy);
+        va_end(args_copy);
+
+        // Print everything in one call
+        fprintf(level == LOG_LEVEL_ERROR ? stderr : stdout, "%s %s %s%s\n", level_tags[level], cached_time_string(ts.tv_sec),
+                prefix != NULL ? prefix : "", message_buf);
+
+        if(r == NULL)
+            return;
+    }
+
+    // Reserve a slot, wait for the flush thread if the ring is full instead of dropping the line.
+    pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    for(;;)
+    {
+        slot = &r->slots[pos & (LOG_RING_SLOTS - 1)];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+        if(seq == pos)
+        {
+            if(atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if((intptr_t)(seq - pos) < 0)
+        {
+            atomic_fetch_add_explicit(&r->stalls, 1, memory_order_relaxed);
+            sched_yield();
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        }
+        else
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    }
+
+    slot->level = level;
+    slot->ts = ts;
+    if(prefix != NULL)
+    {
+        strncpy(slot->line, prefix, LOG_LINE_SIZE - 1);
+        slot->line[LOG_LINE_SIZE - 1] = '\0';
+        len = strlen(slot->line);
+    }
+    vsnprintf(slot->line + len, LOG_LINE_SIZE - len, format, args);
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
@@ -0,0 +1,45 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdio.h>
+#include <stdarg.h>
+
+
+/*
+* Log levels, in increasing order. Everything below the level that was set at runtime is dropped before any formatting.
+*/
+typedef enum {
+
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_RESULT,                   // Results of the checks, printed as '[INFO]'.
+    LOG_LEVEL_OFF
+
+} log_level_t;
+
+
+#define LOG_RING_SLOTS 1024         // Lines that fit in the ring buffer of a rank, must be a power of 2.
+#define LOG_LINE_SIZE 512           // Longer lines are truncated.
+#define LOG_FLUSH_IDLE_US 2000      // How long the flush thread sleeps when the ring is empty.
+
+/*
+* Runtime configuration (environment variables, pass them through mpirun with '-x'):
+* - LOG_LEVEL : debug | info | warn | error | off (default: debug)
+* - LOG_DIR   : if set, every rank writes to <LOG_DIR>/rank_<rank>.log through a ring buffer that a background
+*               thread flushes. Otherwise everything is printed to stdout right away like before.
+* The ring belongs to the thread of the rank (RANK_LOCAL, transport.h), other threads that log for the rank attach to
+* it with log_thread_attach(log_thread_context()).
+*/
+void log_init(int rank);
+void log_shutdown();
+void *log_thread_context();
+void log_thread_attach(void *context);
+
+int log_enabled(log_level_t level);
+void log_set_level(log_level_t level);
+
+void log_vwrite(log_level_t level, const char *prefix, const char *format, va_list args);
+
+#endif
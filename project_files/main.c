@@ -3,51 +3,223 @@
 #include <string.h>
 
 #include "my_funcs.h"
+#include "comm.h"
+#include "hop_trace.h"
+#include "replay.h"
+#include "events.h"
 #include "client.h"
 #include "server.h"
+#include "transport.h"
 
 
 
+/*
+* Coordinator phases: every line of the testfile belongs to one and is timed with transport_wtime() (virtual time with
+* '--transport sim'). Lines of a phase don't have to be next to each other (generated testfiles mix lending, donations
+* and queries), so a phase keeps the time spent in its lines and the span from its first line to the end of its last one.
+*/
+typedef struct {
+
+    const char *name;
+    long long count;
+    double total;
+    double max;
+    double first_start;
+    double last_end;
+
+} phase_t;
+
+static phase_t phases[] = {
+    { "connect", 0, 0, 0, 0, 0 },
+    { "le_libr", 0, 0, 0, 0, 0 },
+    { "le_loaners", 0, 0, 0, 0, 0 },
+    { "lending", 0, 0, 0, 0, 0 },
+    { "donation", 0, 0, 0, 0, 0 },
+    { "popular", 0, 0, 0, 0, 0 },
+    { "check", 0, 0, 0, 0, 0 },
+};
+
+#define PHASES_NUM ((int)(sizeof(phases) / sizeof(phases[0])))
+
+
+/*
+* @return The phase of an event, -1 for the events that aren't timed (SHUTDOWN, empty lines).
+*/
+static int phase_of(int op)
+{
+    switch(op)
+    {
+        case EV_CONNECT:                return 0;
+        case EV_START_LE_LIBR:          return 1;
+        case EV_START_LE_LOANERS:       return 2;
+        case EV_TAKE_BOOK:
+        case EV_TAKE_BOOKS:
+        case EV_RETURN_BOOK:            return 3;
+        case EV_DONATE_BOOK:            return 4;
+        case EV_GET_MOST_POPULAR_BOOK:  return 5;
+        case EV_CHECK_NUM_BOOKS_LOANED: return 6;
+        default:                        return -1;
+    }
+}
+
+
+static void phase_add(int phase, double start, double end)
+{
+    phase_t *p = &phases[phase];
+
+
+    if(p->count == 0)
+        p->first_start = start;
+    p->count++;
+    p->total += end - start;
+    if(end - start > p->max)
+        p->max = end - start;
+    p->last_end = end;
+}
+
+
+/*
+* Prints the phase timings and, if report_path isn't NULL, writes them there as CSV (one row per phase and a 'total' row
+* with the time from the first line of the testfile to the last one). bench.sh collects these files.
+*/
+static void phase_report(int num_libs, int num_of_processes, double run_time, const char *report_path)
+{
+    FILE *fp = NULL;
+    int i;
+
+
+    print_result("Phase timings (s):");
+    print_result("    %-12s %8s %12s %12s %12s %12s", "phase", "count", "total", "mean", "max", "span");
+    for(i = 0; i < PHASES_NUM; i++)
+    {
+        phase_t *p = &phases[i];
+
+        if(p->count == 0)
+            continue;
+        print_result("    %-12s %8lld %12.6f %12.6f %12.6f %12.6f", p->name, p->count, p->total, p->total / p->count,
+                     p->max, p->last_end - p->first_start);
+    }
+    print_result("    %-12s %8s %12.6f", "total", "", run_time);
+
+    if(report_path == NULL)
+        return;
+
+    fp = fopen(report_path, "w");
+    if(fp == NULL)
+    {
+        print_error("Couldn't open file %s", report_path);
+        return;
+    }
+
+    fprintf(fp, "num_libs,processes,phase,count,total_s,mean_s,max_s,span_s\n");
+    for(i = 0; i < PHASES_NUM; i++)
+    {
+        phase_t *p = &phases[i];
+
+        fprintf(fp, "%d,%d,%s,%lld,%.9f,%.9f,%.9f,%.9f\n", num_libs, num_of_processes, p->name, p->count, p->total,
+                p->count > 0 ? p->total / p->count : 0, p->max, p->count > 0 ? p->last_end - p->first_start : 0);
+    }
+    fprintf(fp, "%d,%d,total,1,%.9f,%.9f,%.9f,%.9f\n", num_libs, num_of_processes, run_time, run_time, run_time, run_time);
+    fclose(fp);
+}
+
+
+static int *connect_sets = NULL;        // Union-find of the CONNECT lines, per rank (0: not seen yet).
+static int connect_sets_size = 0;
+static int connect_cycle = 0;           // A CONNECT line joined two borrowers that were connected already.
+static int *connect_edges = NULL;       // The CONNECT lines so far, id1 id2 pairs.
+static int connect_edges_num = 0;
+
+
+static int connect_find(int id)
+{
+    int old_size = connect_sets_size;
+
+
+    if(id >= connect_sets_size)
+    {
+        connect_sets_size = 2 * id + 1;
+        connect_sets = (int *) MyRealloc(connect_sets, connect_sets_size * sizeof(int));
+        memset(connect_sets + old_size, 0, (connect_sets_size - old_size) * sizeof(int));
+    }
+    if(connect_sets[id] == 0)
+        connect_sets[id] = id;
+
+    while(connect_sets[id] != id)
+    {
+        connect_sets[id] = connect_sets[connect_sets[id]];
+        id = connect_sets[id];
+    }
+    return id;
+}
+
+
+/*
+* Remembers the 'CONNECT' line, a line that closes a cycle is a cycle only if it isn't a line we've had already (the
+* client doesn't connect the same borrowers twice).
+*/
+static void connect_add(int id1, int id2)
+{
+    int i;
+
+
+    if(connect_find(id1) != connect_find(id2))
+    {
+        connect_sets[connect_find(id1)] = connect_find(id2);
+    }
+    else if(!connect_cycle)
+    {
+        for(i = 0; i < connect_edges_num; i++)
+        {
+            if((connect_edges[2 * i] == id1 && connect_edges[2 * i + 1] == id2) ||
+               (connect_edges[2 * i] == id2 && connect_edges[2 * i + 1] == id1))
+                return;
+        }
+        connect_cycle = 1;
+    }
+
+    connect_edges = (int *) MyRealloc(connect_edges, 2 * (connect_edges_num + 1) * sizeof(int));
+    connect_edges[2 * connect_edges_num] = id1;
+    connect_edges[2 * connect_edges_num + 1] = id2;
+    connect_edges_num++;
+}
+
+
 /*
 * Function for the coordinator that executes the "CONNECT" event.
 * Sends a "CONNECT" message to the c_id1 and waits for "ACK".
-* @param str_array The string array
+* @param c_id1, c_id2 The ids of the 'CONNECT' line.
 * @param num_libs The number of libraries.
 */
-void event_connect(char **str_array, int num_libs)
+void event_connect(int c_id1, int c_id2, int num_libs)
 {
     char buffer[BUF_SIZE];
     MPI_Status status;
     int id1, id2;
 
 
-    // Get the ids and increment by 1 to skip the coordinator rank 0. That way the ranks are aligned with the logical c_ids of the pdf.
-    id1 = atoi(str_array[1]);
-    id1++;
-    //id1 += num_libs;
-    id2 = atoi(str_array[2]);
-    id2++;
-    //id2 += num_libs;
-    
+    // Increment the ids by 1 to skip the coordinator rank 0. That way the ranks are aligned with the logical c_ids of the pdf.
+    id1 = c_id1 + 1;
+    id2 = c_id2 + 1;
 
-    // Convert the new id2 to a string
-    free(str_array[2]);     // release old malloc
-    str_array[2] = int_to_string(id2);  // Get new malloc with the converted integer.
+    // The 'ELECT' election needs a tree, remember if the lines close a cycle.
+    connect_add(id1, id2);
 
 
     // Create the message using a buffer.
     memset(buffer, 0, sizeof(buffer));  // clear the buffer
-    strcat(strcat(strcat(buffer, str_array[0]), " "), str_array[2]);    // create the "CONNECT id2" message
+    strcpy(buffer, "CONNECT ");
+    strcat_int(buffer, id2);            // create the "CONNECT id2" message
     //print_debug("buffer is: %s", buffer);
 
 
     // Send "CONNECT id2" to id1
-    MPI_Send(buffer, strlen(buffer), MPI_CHAR, id1, TAG_CONNECT, MPI_COMM_WORLD);
+    comm_send(buffer, strlen(buffer), MPI_CHAR, id1, TAG_CONNECT, MPI_COMM_WORLD);
     
     
     // Wait for "ACK"
     memset(buffer, 0, sizeof(buffer));  // clear the buffer
-    MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, id1, TAG_ACK, MPI_COMM_WORLD, &status);
+    comm_recv(buffer, sizeof(buffer), MPI_CHAR, id1, TAG_ACK, MPI_COMM_WORLD, &status);
     if(strcmp(buffer, "ACK") != 0)
     {
         print_error("Didn't get 'ACK' but instead got: %s", buffer);
@@ -61,34 +233,38 @@ void event_connect(char **str_array, int num_libs)
 /*
 * Function for the coordinator that executes the "START_LE_LOANERS" event.
 * Sends "START_LE_LOANERS" to every loaner/borrower process and waits for "LE_LOANERS_DONE" from the leader process.
+* If the CONNECT lines closed a cycle it's "START_LE_LOANERS echo", the borrowers run the echo election instead.
 *
 * @return The rank of the loaners leader process.
 */
 int event_start_le_loaners(int num_lib)
 {
     int i, N;
-    int num_of_processes;
+    int num_of_processes = comm_size();
 
     char buffer[BUF_SIZE];
     MPI_Status status;
 
 
-    MPI_Comm_size(MPI_COMM_WORLD, &num_of_processes);
-
 
     memset(buffer, 0, sizeof(buffer));  // clear the buffer
     strcpy(buffer, "START_LE_LOANERS"); // Create the message
+    if(connect_cycle)
+    {
+        strcat(buffer, " echo");
+        print_info(HCYN"Coordinator: the borrowers graph has a cycle, they'll use the echo election."reset);
+    }
     for(i = num_lib + 1; i < num_of_processes; i++)
     {
         // Send "START_LE_LOANERS" to every loaner/borrower/client
-        MPI_Send(buffer, strlen(buffer), MPI_CHAR, i, TAG_START_LE_LOANERS, MPI_COMM_WORLD);
+        comm_send(buffer, strlen(buffer), MPI_CHAR, i, TAG_START_LE_LOANERS, MPI_COMM_WORLD);
         print_info(HCYN"Coordinator: sent '%s' to client rank <%d>"reset, buffer, i);
     }
 
 
     // Wait for the elected process to send "LE_LOANERS_DONE"
     memset(buffer, 0, sizeof(buffer));  // clear the buffer
-    MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, MPI_ANY_SOURCE, TAG_LE_LOANERS_DONE, MPI_COMM_WORLD, &status);
+    comm_recv(buffer, sizeof(buffer), MPI_CHAR, MPI_ANY_SOURCE, TAG_LE_LOANERS_DONE, MPI_COMM_WORLD, &status);
 
     
     if(strcmp(buffer, "LE_LOANERS_DONE") != 0)
@@ -110,7 +286,7 @@ int event_start_le_loaners(int num_lib)
 */
 int event_start_le_libraries(int num_libs)
 {
-    int i, N;
+    int i, N, distance_sum, distance_max;
     char buffer[BUF_SIZE];
     MPI_Status status;
 
@@ -121,14 +297,14 @@ int event_start_le_libraries(int num_libs)
     for(i = 1; i <= num_libs; i++)      // Side note: try starting for the biggest id going to the smallest to see a different leader to the LE?
     {
         // Send "START_LEADER_ELECTION" to every library/server
-        MPI_Send(buffer, strlen(buffer), MPI_CHAR, i, TAG_START_LE_LIBR, MPI_COMM_WORLD);
+        comm_send(buffer, strlen(buffer), MPI_CHAR, i, TAG_START_LE_LIBR, MPI_COMM_WORLD);
         print_info(HCYN"Coordinator: sent '%s' to server rank <%d>"reset, buffer, i);
     }
 
 
     // Wait for the elected process to send "LE_LIBR_DONE"
     memset(buffer, 0, sizeof(buffer));  // clear the buffer
-    MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, MPI_ANY_SOURCE, TAG_LE_LIBRARIES_DONE, MPI_COMM_WORLD, &status);
+    comm_recv(buffer, sizeof(buffer), MPI_CHAR, MPI_ANY_SOURCE, TAG_LE_LIBRARIES_DONE, MPI_COMM_WORLD, &status);
 
     
     if(strcmp(buffer, "LE_LIBR_DONE") != 0)
@@ -138,19 +314,61 @@ int event_start_le_libraries(int num_libs)
     }
 
 
+    // How far the libraries are from the leader on the grid.
+    N = sqrt(num_libs);
+    distance_sum = distance_max = 0;
+    for(i = 0; i < num_libs; i++)
+    {
+        int distance = abs(i % N - (status.MPI_SOURCE - 1) % N) + abs(i / N - (status.MPI_SOURCE - 1) / N);
+
+        distance_sum += distance;
+        if(distance > distance_max)
+            distance_max = distance;
+    }
+    print_info(HCYN"Coordinator: the libraries are %.2f grid hops from the leader on average, %d at most"reset,
+               (double)distance_sum / num_libs, distance_max);
+
     // Return the rank of the libraries leader
     return status.MPI_SOURCE;
 }
 
 
 /*
-* Handles the 'TAKE_BOOK' event.
+* Checks a reply of a client to one of the lending/donation events, e.g. 'DONE_FIND_BOOK' for 'TAKE_BOOK'.
+* 'DONE_TAKE_BOOKS <n_taken>' has an argument, so only the name (the first len(expected) characters) is compared.
+* The closed loop handlers below call it right after they get the reply, the replay mode (replay.c) when the reply comes.
 */
-void event_takeBook(int c_id, int b_id)
+void event_done(char *buffer, const char *expected, int client_rank)
+{
+    char **str_array;
+
+
+    if(strncmp(buffer, expected, strlen(expected)) != 0)
+    {
+        print_error("Didn't get '%s' but instead got: %s", expected, buffer);
+        exit(-1);
+    }
+
+    if(strcmp(expected, "DONE_FIND_BOOK") == 0)
+    {
+        str_array = split_string(buffer, strlen(buffer), ' ');
+        if(hop_trace_recv(str_array, 'D'))
+            hop_trace_record(hop_trace_current());
+        free_string_array(str_array);
+    }
+    print_info(HCYN"Coordinator: got '%s' by client rank %d."reset, buffer, client_rank);
+}
+
+
+/*
+* Sends 'TAKE_BOOK <b_id>' to the client (with a trace context if '--hop-trace' is on), the reply is 'DONE_FIND_BOOK'.
+* @return The rank of the client.
+*/
+int issue_takeBook(int c_id, int b_id)
 {
+    static int trace_id = 0;
     char buffer[BUF_SIZE];
     int client_rank;
-    MPI_Status status;
 
 
     client_rank = c_id + 1;             // c_id doesn't take the coordinator rank into account
@@ -159,54 +377,239 @@ void event_takeBook(int c_id, int b_id)
     memset(buffer, 0, sizeof(buffer));  // clear the buffer
     strcpy(buffer, "TAKE_BOOK ");
     strcat_int(buffer, b_id);
+    if(hop_trace_enabled())
+    {
+        hop_trace_start(++trace_id);
+        hop_trace_attach(buffer, hop_trace_current());
+    }
     print_info(HCYN"Coordinator: sent '%s' to client rank <%d>"reset, buffer, client_rank);
-    MPI_Send(buffer, strlen(buffer), MPI_CHAR, client_rank, TAG_TAKE_BOOK, MPI_COMM_WORLD);
+    comm_send(buffer, strlen(buffer), MPI_CHAR, client_rank, TAG_TAKE_BOOK, MPI_COMM_WORLD);
 
-    // Wait for 'DONE_FIND_BOOK'
-    memset(buffer, 0, sizeof(buffer));  // clear the buffer
-    MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, client_rank, TAG_DONE_FIND_BOOK, MPI_COMM_WORLD, &status);
+    return client_rank;
+}
+
+
+/*
+* Builds '<name> <b_id> [<b_id> ...]' in buffer (BUF_SIZE bytes).
+* @return 0, or -1 if the ids don't fit in one message (buffer has only the ids that fit then).
+*/
+static int ids_message(char *buffer, const char *name, const int32_t *b_ids, int b_ids_num)
+{
+    char id[16];
+    int i;
 
-    if(strcmp(buffer, "DONE_FIND_BOOK") != 0)
+
+    memset(buffer, 0, BUF_SIZE);
+    strcpy(buffer, name);
+    for(i = 0; i < b_ids_num; i++)
     {
-        print_error("Didn't get 'DONE_FIND_BOOK' but instead got: %s", buffer);
-        exit(-1);
+        memset(id, 0, sizeof(id));
+        strcpy(id, " ");
+        strcat_int(id, b_ids[i]);
+        if(strlen(buffer) + strlen(id) >= BUF_SIZE)
+            return -1;
+        strcat(buffer, id);
     }
-    print_info(HCYN"Coordinator: got 'DONE_FIND_BOOK' by client rank %d."reset, client_rank);
+
+    return 0;
 }
 
 
 /*
-* Handles the 'DONATE_BOOKS' event. Sends 'DONATE_BOOKS <b_id> <n_copies>' to the client rank with the given arguments.
+* Checks the c_ids of an event against the clients of this run (ranks num_libs + 1 to num_of_processes - 1), a testfile
+* with more clients than that (e.g. a too small '--clients') would send to a process that doesn't exist.
+* @return -1 if they're all clients, else the first c_id that isn't.
 */
-void event_donateBook(int c_id, int b_id, int n_copies)
+static int bad_client_id(const event_t *ev, int num_libs, int num_of_processes)
+{
+    int i, n_ids;
+
+
+    switch(ev->op)
+    {
+        case EV_CONNECT:
+            n_ids = 2;
+            break;
+        case EV_TAKE_BOOK:
+        case EV_TAKE_BOOKS:
+        case EV_RETURN_BOOK:
+        case EV_DONATE_BOOK:
+            n_ids = 1;
+            break;
+        default:
+            return -1;
+    }
+
+    for(i = 0; i < n_ids; i++)
+    {
+        if(ev->args[i] + 1 <= num_libs || ev->args[i] + 1 >= num_of_processes)
+            return ev->args[i];
+    }
+    return -1;
+}
+
+
+/*
+* Sends 'TAKE_BOOKS <b_id> [<b_id> ...]' to the client of 'TAKE_BOOKS <c_id> <b_id> [<b_id> ...]', the reply is
+* 'DONE_TAKE_BOOKS <n_taken>'.
+* @return The rank of the client.
+*/
+int issue_takeBooks(int c_id, const int32_t *b_ids, int b_ids_num)
+{
+    char buffer[BUF_SIZE];
+    int client_rank;
+
+
+    client_rank = c_id + 1;             // convert to MPI rank.
+
+    ids_message(buffer, "TAKE_BOOKS", b_ids, b_ids_num);
+    print_info(HCYN"Coordinator: sent '%s' to client rank <%d>"reset, buffer, client_rank);
+    comm_send(buffer, strlen(buffer), MPI_CHAR, client_rank, TAG_TAKE_BOOK, MPI_COMM_WORLD);
+
+    return client_rank;
+}
+
+
+/*
+* Sends 'RETURN_BOOK <b_id> [<b_id> ...]' to the client of 'RETURN_BOOK <c_id> <b_id> [<b_id> ...]', the reply is
+* 'DONE_RETURN_BOOK'.
+* @return The rank of the client.
+*/
+int issue_returnBook(int c_id, const int32_t *b_ids, int b_ids_num)
+{
+    char buffer[BUF_SIZE];
+    int client_rank;
+
+
+    client_rank = c_id + 1;             // convert to MPI rank.
+
+    ids_message(buffer, "RETURN_BOOK", b_ids, b_ids_num);
+    print_info(HCYN"Coordinator: sent '%s' to client rank <%d>"reset, buffer, client_rank);
+    comm_send(buffer, strlen(buffer), MPI_CHAR, client_rank, TAG_RETURN_BOOK, MPI_COMM_WORLD);
+
+    return client_rank;
+}
+
+
+/*
+* Sends 'DONATE_BOOKS <b_id> <n_copies>' to the client, the reply is 'DONATE_BOOKS_DONE'.
+* @return The rank of the client.
+*/
+int issue_donateBook(int c_id, int b_id, int n_copies)
 {
     char buffer[BUF_SIZE];
     int client_rank;
-    MPI_Status status;
 
 
     client_rank = c_id + 1;             // convert to MPI rank.
 
-    // Send 'DONATE_BOOKS <b_id> <n_copies>' to client rank
     memset(buffer, 0, sizeof(buffer));
     strcpy(buffer, "DONATE_BOOKS ");
     strcat_int(buffer, b_id);
     strcat(buffer, " ");
     strcat_int(buffer, n_copies);
     print_info(HCYN"Coordinator: sent '%s' to client rank <%d>"reset, buffer, client_rank);
-    MPI_Send(buffer, strlen(buffer), MPI_CHAR, client_rank, TAG_DONATE_BOOKS, MPI_COMM_WORLD);
+    comm_send(buffer, strlen(buffer), MPI_CHAR, client_rank, TAG_DONATE_BOOKS, MPI_COMM_WORLD);
+
+    return client_rank;
+}
+
+
+/*
+* Waits for the reply of a client to an issue_*() and checks it.
+*/
+static void wait_done(int client_rank, int tag, const char *expected)
+{
+    char buffer[BUF_SIZE];
+    MPI_Status status;
 
 
-    // Wait for 'DONATE_BOOKS_DONE'
     memset(buffer, 0, sizeof(buffer));  // clear the buffer
-    MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, client_rank, TAG_DONATE_BOOKS_DONE, MPI_COMM_WORLD, &status);
+    comm_recv(buffer, sizeof(buffer), MPI_CHAR, client_rank, tag, MPI_COMM_WORLD, &status);
+    event_done(buffer, expected, client_rank);
+}
+
+
+/*
+* Handles the 'TAKE_BOOK' event.
+*/
+void event_takeBook(int c_id, int b_id)
+{
+    wait_done(issue_takeBook(c_id, b_id), TAG_DONE_FIND_BOOK, "DONE_FIND_BOOK");
+}
 
-    if(strcmp(buffer, "DONATE_BOOKS_DONE") != 0)
+
+/*
+* Handles the 'TAKE_BOOKS <c_id> <b_id> [<b_id> ...]' event. Sends 'TAKE_BOOKS <b_id> [<b_id> ...]' to the client rank
+* and waits for the combined 'DONE_TAKE_BOOKS <n_taken>'.
+*/
+void event_takeBooks(int c_id, const int32_t *b_ids, int b_ids_num)
+{
+    wait_done(issue_takeBooks(c_id, b_ids, b_ids_num), TAG_DONE_FIND_BOOK, "DONE_TAKE_BOOKS");
+}
+
+
+/*
+* Handles the 'RETURN_BOOK <c_id> <b_id> [<b_id> ...]' event. Sends 'RETURN_BOOK <b_id> [<b_id> ...]' to the client rank
+* and waits for 'DONE_RETURN_BOOK'.
+*/
+void event_returnBook(int c_id, const int32_t *b_ids, int b_ids_num)
+{
+    wait_done(issue_returnBook(c_id, b_ids, b_ids_num), TAG_DONE_RETURN_BOOK, "DONE_RETURN_BOOK");
+}
+
+
+/*
+* Handles the 'DONATE_BOOKS' event. Sends 'DONATE_BOOKS <b_id> <n_copies>' to the client rank with the given arguments.
+*/
+void event_donateBook(int c_id, int b_id, int n_copies)
+{
+    wait_done(issue_donateBook(c_id, b_id, n_copies), TAG_DONATE_BOOKS_DONE, "DONATE_BOOKS_DONE");
+}
+
+
+/*
+* @return 1 if the event is sent open loop in the replay mode (see replay.h).
+*/
+static int is_replayed(int op)
+{
+    return op == EV_TAKE_BOOK || op == EV_TAKE_BOOKS || op == EV_RETURN_BOOK || op == EV_DONATE_BOOK;
+}
+
+
+/*
+* Replay mode: waits until the event is due (collecting the replies that come meanwhile) and sends it without waiting
+* for its reply.
+*/
+void event_replay(const event_t *ev)
+{
+    double due, sent;
+    int client_rank;
+
+
+    due = replay_schedule(ev->value);
+    replay_wait_until(due);
+
+    sent = transport_wtime();
+    switch(ev->op)
     {
-        print_error("Didn't get 'DONATE_BOOKS_DONE' but instead got: %s", buffer);
-        exit(-1);
+        case EV_TAKE_BOOK:
+            client_rank = issue_takeBook(ev->args[0], ev->args[1]);
+            replay_issued(client_rank, TAG_DONE_FIND_BOOK, "DONE_FIND_BOOK", event_name(ev->op), due, sent);
+            break;
+        case EV_TAKE_BOOKS:
+            client_rank = issue_takeBooks(ev->args[0], ev->args + 1, ev->nargs - 1);
+            replay_issued(client_rank, TAG_DONE_FIND_BOOK, "DONE_TAKE_BOOKS", event_name(ev->op), due, sent);
+            break;
+        case EV_RETURN_BOOK:
+            client_rank = issue_returnBook(ev->args[0], ev->args + 1, ev->nargs - 1);
+            replay_issued(client_rank, TAG_DONE_RETURN_BOOK, "DONE_RETURN_BOOK", event_name(ev->op), due, sent);
+            break;
+        case EV_DONATE_BOOK:
+            client_rank = issue_donateBook(ev->args[0], ev->args[1], ev->args[2]);
+            replay_issued(client_rank, TAG_DONATE_BOOKS_DONE, "DONATE_BOOKS_DONE", event_name(ev->op), due, sent);
+            break;
     }
-    print_info(HCYN"Coordinator: got '%s' by client rank %d."reset, buffer, client_rank);
 }
 
 
@@ -221,12 +624,12 @@ void event_get_most_popular_book(int borrower_leader_rank)
 
     memset(buffer, 0, sizeof(buffer));
     strcpy(buffer, "GET_MOST_POPULAR_BOOK");
-    MPI_Send(buffer, strlen(buffer), MPI_CHAR, borrower_leader_rank, TAG_GET_MOST_POPULAR_BOOK, MPI_COMM_WORLD);
+    comm_send(buffer, strlen(buffer), MPI_CHAR, borrower_leader_rank, TAG_GET_MOST_POPULAR_BOOK, MPI_COMM_WORLD);
 
 
     // Wait for 'GET_MOST_POPULAR_BOOK_DONE'
     memset(buffer, 0, sizeof(buffer));  // clear the buffer
-    MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, borrower_leader_rank, TAG_GET_MOST_POPULAR_BOOK, MPI_COMM_WORLD, &status);
+    comm_recv(buffer, sizeof(buffer), MPI_CHAR, borrower_leader_rank, TAG_GET_MOST_POPULAR_BOOK, MPI_COMM_WORLD, &status);
     if(strcmp(buffer, "GET_MOST_POPULAR_BOOK_DONE") != 0)
     {
         print_error("Coordinator expected 'GET_MOST_POPULAR_BOOK_DONE' from client leader rank %d but instead got: %s", borrower_leader_rank, buffer);
@@ -236,64 +639,74 @@ void event_get_most_popular_book(int borrower_leader_rank)
 
 
 /*
-*
+* Sends 'CHECK_NUM_BOOKS_LOAN <epoch>' to a leader and waits for 'CHECK_NUM_BOOKS_LOAN_DONE <loans> <returns>'.
 */
-void event_check_num_books_loaned(int borrower_leader_rank, int library_leader_rank)
+void query_num_books_loaned(int leader_rank, int epoch, int *loans, int *returns, const char *who)
 {
     char buffer[BUF_SIZE];
     char **str_array;
-    int total_loaned_lib, total_loaned_bor;
     MPI_Status status;
 
 
     memset(buffer, 0, sizeof(buffer));
-    strcpy(buffer, "CHECK_NUM_BOOKS_LOAN");
-    MPI_Send(buffer, strlen(buffer), MPI_CHAR, library_leader_rank, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
-    MPI_Send(buffer, strlen(buffer), MPI_CHAR, borrower_leader_rank, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
-
-
+    strcpy(buffer, "CHECK_NUM_BOOKS_LOAN ");
+    strcat_int(buffer, epoch);
+    comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, leader_rank, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
 
     memset(buffer, 0, sizeof(buffer));  // clear the buffer
-    MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, library_leader_rank, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD, &status);
-    print_debug(HCYN"Coordinator got from library leader: %s"reset, buffer);
+    comm_recv(buffer, sizeof(buffer), MPI_CHAR, leader_rank, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD, &status);
+    print_debug(HCYN"Coordinator got from %s leader: %s"reset, who, buffer);
 
     str_array = split_string(buffer, strlen(buffer), ' ');
     if(strcmp(str_array[0], "CHECK_NUM_BOOKS_LOAN_DONE") != 0)
     {
-        print_error("Expected 'CHECK_NUM_BOOKS_LOAN_DONE' from library leader but got: %s", buffer);
+        print_error("Expected 'CHECK_NUM_BOOKS_LOAN_DONE <loans> <returns>' from %s leader but got: %s", who, buffer);
+        *loans = *returns = -1;
+    }
+    else
+    {
+        *loans = atoi(str_array[1]);
+        *returns = atoi(str_array[2]);
     }
 
-    total_loaned_lib = atoi(str_array[1]);
-    // Release memory before proceeding with the borrowers.
     free_string_array(str_array);
     str_array = NULL;
-    
+}
 
 
-    memset(buffer, 0, sizeof(buffer));  // clear the buffer
-    MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, borrower_leader_rank, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD, &status);
-    print_debug(HCYN"Coordinator got from client leader: %s"reset, buffer);
-    
-    str_array = split_string(buffer, strlen(buffer), ' ');
-    if(strcmp(str_array[0], "CHECK_NUM_BOOKS_LOAN_DONE") != 0)
-    {
-        print_error("Expected 'CHECK_NUM_BOOKS_LOAN_DONE' from client leader but got: %s", buffer);
-    }
+/*
+* Checks that the books the libraries lent (and got back) match the books the clients got (and returned).
+* Every check gets a new epoch. The leaders broadcast it and every process only counts the loans/returns stamped
+* with an older epoch, so both sides count the same set of operations no matter when the broadcast reaches them.
+* A loan or return that's stamped but still in flight (the library counted it, the client didn't yet, or the other
+* way around for returns) can only make the clients lag behind, so in that case we ask again for the same epoch.
+*/
+void event_check_num_books_loaned(int borrower_leader_rank, int library_leader_rank)
+{
+    static int epoch = 0;
+    int lib_loans, lib_returns, bor_loans, bor_returns;
+    int tries;
 
-    total_loaned_bor = atoi(str_array[1]);
-    // Release memory before proceeding with the borrowers.
-    free_string_array(str_array);
-    str_array = NULL;
 
-    // Compare
-    if(total_loaned_lib == total_loaned_bor)
-    {
-        print_info("CheckNumBooksLoanded   "HGRN"SUCCESS"reset);
-    }
-    else
+    epoch++;
+    for(tries = 0; tries < CHECK_NUM_BOOKS_RETRIES; tries++)
     {
-        print_info("CheckNumBooksLoanded   "HRED"FAILED"reset);
+        query_num_books_loaned(library_leader_rank, epoch, &lib_loans, &lib_returns, "library");
+        query_num_books_loaned(borrower_leader_rank, epoch, &bor_loans, &bor_returns, "client");
+        print_debug(HCYN"Coordinator epoch %d: libraries %d loans %d returns, clients %d loans %d returns"reset, epoch, lib_loans, lib_returns, bor_loans, bor_returns);
+
+        if(lib_loans == bor_loans && lib_returns == bor_returns)
+        {
+            print_result("CheckNumBooksLoanded   "HGRN"SUCCESS"reset);
+            return;
+        }
+
+        // Only messages in flight can explain the difference, anything else is a real mismatch.
+        if(lib_loans < 0 || bor_loans < 0 || bor_loans > lib_loans || lib_returns > bor_returns)
+            break;
     }
+
+    print_result("CheckNumBooksLoanded   "HRED"FAILED"reset" (epoch %d: libraries %d/%d, clients %d/%d loans/returns)", epoch, lib_loans, lib_returns, bor_loans, bor_returns);
 }
 
 
@@ -312,140 +725,277 @@ void event_shutdown(int num_of_processes)
 
     for(i = 1; i < num_of_processes; i++)
     {
-        MPI_Send(buffer, strlen(buffer), MPI_CHAR, i, TAG_SHUTDOWN, MPI_COMM_WORLD);
+        comm_send(buffer, strlen(buffer), MPI_CHAR, i, TAG_SHUTDOWN, MPI_COMM_WORLD);
     }
 }
 
 
 
-int main(int argc, char* argv[]) 
+/*
+* The command line options, every rank (thread with '--transport threads') runs run_rank() with them.
+*/
+typedef struct {
+
+    int num_libs;
+    const char *testfile;
+    const char *stats_csv_path;             // '--stats-csv <file>': write the counters of every rank there.
+    const char *phase_report_path;          // '--phase-report <file>': write the phase timings there (CSV).
+    const char *replay_report_path;         // '--replay-report <file>': write the replay latencies there (CSV).
+    double replay_rate;                     // '--replay <rate>': open loop replay (replay.h), -1 is off.
+    unsigned long long replay_seed;
+    int aggregate;                          // '--aggregate [<batch_bytes>]': batch small messages (comm.c).
+    int lib_tile;                           // '--lib-tile <T>': a T x T tile of the library grid in every library rank (comm.c).
+    int num_clients;                        // '--clients <C>': C virtual clients over the client ranks (comm.c).
+    int server_threads;                     // '--server-threads <T>': T worker threads in every library (server.c).
+    int shared_catalog;                     // '--shared-catalog': the libraries of a node share their catalogs (catalog_shm.h).
+    int thread_level;
+
+} options_t;
+
+
+static int run_rank(int process_rank, int num_of_processes, void *arg)
 {
-    int num_of_processes, process_rank;
+    options_t *opt = (options_t *) arg;
+    int num_libs = opt->num_libs;
+    int server_threads = opt->server_threads;
 
     char processor_name[MPI_MAX_PROCESSOR_NAME];
     int processor_name_len;
 
-    FILE *test_file_ptr = NULL;
-    char buffer[BUF_SIZE];
-    int num_libs = -1;
+    event_source_t events;
+    event_t ev;
+    int shutdown_sent = 0;
 
 
-    if(argc != 3)
-    {
-        fprintf(stderr, "Program usage: ./a.out <NUM_LIBS> <test_file>\n");
-        exit(0);
-    }
-    num_libs = atoi(argv[1]);
+    // Get the name of the processor
+    MPI_Get_processor_name(processor_name, &processor_name_len);
 
+    // Per rank log files if LOG_DIR is set (see logger.h)
+    log_init(process_rank);
 
-    // Initialize the MPI environment
-    MPI_Init(NULL, NULL);
+    // The tiles free ranks, the clients that are left over aren't the clients of the testfile.
+    if(opt->lib_tile > 1 && opt->num_clients <= 0)
+    {
+        if(process_rank == 0)
+            print_error("Coordinator: '--lib-tile' needs '--clients <C>', the number of clients of the testfile");
+        return -1;
+    }
 
-    // Get the number of processes
-    MPI_Comm_size(MPI_COMM_WORLD, &num_of_processes);
+    // The processes are logical ids from here on, with virtual clients there are more of them than ranks.
+    if(comm_init(num_libs, opt->lib_tile, opt->num_clients, opt->aggregate) != 0)
+    {
+        if(process_rank == 0)
+            print_error("Coordinator: %d ranks don't fit %d libraries in %dx%d tiles and %d clients", num_of_processes, num_libs,
+                        opt->lib_tile, opt->lib_tile, opt->num_clients);
+        return -1;
+    }
+    num_of_processes = comm_size();
 
-    // Get the rank of the process
-    MPI_Comm_rank(MPI_COMM_WORLD, &process_rank);
+    if(server_threads > 1 && transport_in_process())
+    {
+        if(process_rank == 0)
+            print_warn("Coordinator: '--server-threads' doesn't work with '--transport %s', the libraries run single threaded.", transport_name());
+        server_threads = 1;
+    }
+    else if(server_threads > 1 && opt->thread_level < MPI_THREAD_MULTIPLE)
+    {
+        if(process_rank == 0)
+            print_warn("Coordinator: MPI doesn't support MPI_THREAD_MULTIPLE, the libraries run single threaded.");
+        server_threads = 1;
+    }
+    else if(server_threads > 1 && opt->lib_tile > 1)
+    {
+        if(process_rank == 0)
+            print_warn("Coordinator: '--server-threads' doesn't work with '--lib-tile', the libraries run single threaded.");
+        server_threads = 1;
+    }
+    server_set_threads(server_threads);
 
-    // Get the name of the processor
-    MPI_Get_processor_name(processor_name, &processor_name_len);
+    if(opt->shared_catalog && opt->lib_tile > 1)
+    {
+        if(process_rank == 0)
+            print_warn("Coordinator: '--shared-catalog' doesn't work with '--lib-tile', the libraries of a tile share the rank already.");
+    }
+    else if(opt->shared_catalog && transport_in_process())
+    {
+        if(process_rank == 0)
+            print_warn("Coordinator: '--shared-catalog' doesn't work with '--transport %s', it's built on MPI windows.", transport_name());
+    }
+    else if(opt->shared_catalog)
+    {
+        catalog_shm_init(process_rank >= 1 && process_rank <= num_libs);
+    }
 
     // Print off a hello world message
     //printf("Hello world from processor %s, rank %d out of %d processors\n", processor_name, process_rank, num_of_processes);
 
 
     // Wait for all processes to reach this point, in case a process didn't start.
-    MPI_Barrier(MPI_COMM_WORLD);
+    transport_barrier();
 
     if(process_rank == 0)     // MPI rank 0 == Leader/Coordinator
     {
         int loaner_leader_rank, libraries_leader_rank;
+        double run_start, line_start;
+        int phase, barrier, ret, c_id;
+        char buffer[BUF_SIZE];
         //print_all_colors();
         
-        print_info(HCYN"Coordinator: NUM_LIBS: %d, testfile: %s"reset, num_libs, argv[2]);
+        print_info(HCYN"Coordinator: NUM_LIBS: %d, testfile: %s"reset, num_libs, opt->testfile);
         print_info("Coordinator: total processes = %d", num_of_processes);
 
         // Open the testfile given as a cla
-        test_file_ptr = fopen(argv[2], "r");
-        if(test_file_ptr == NULL)
+        if(event_open(&events, opt->testfile) != 0)
         {
-            print_error("Couldn't open file %s", argv[2]);
+            print_error("Couldn't open file %s", opt->testfile);
             exit(-1);
         }
 
 
-        // Read the testfile
-        while(fgets(buffer, sizeof(buffer), test_file_ptr))
-        {
-            char** str_array = split_string(buffer, strlen(buffer), ' ');
-            //print_string_array(str_array);
+        if(opt->replay_rate >= 0)
+            replay_enable(opt->replay_rate, opt->replay_seed, num_of_processes, event_done);
 
-            if(strcmp(str_array[0], "CONNECT") == 0)
-            {
-                event_connect(str_array, num_libs);
-            }
-            else if(strcmp(str_array[0], "TAKE_BOOK") == 0)
+        // Read the testfile, text or compiled (events.h)
+        run_start = transport_wtime();
+        while((ret = event_next(&events, &ev)) != 0)
+        {
+            if(ret < 0)
             {
-                int c_id = atoi(str_array[1]);
-                int b_id = atoi(str_array[2]);
-                event_takeBook(c_id, b_id);
-                print_barrier();
+                print_error("Malformed event %lld of testfile %s", events.line_no, opt->testfile);
+                exit(-1);
             }
-            else if(strcmp(str_array[0], "DONATE_BOOK") == 0)
+            if(ev.op == EV_UNKNOWN)
             {
-                int c_id = atoi(str_array[1]);
-                int b_id = atoi(str_array[2]);
-                int n_copies = atoi(str_array[3]);
-                event_donateBook(c_id, b_id, n_copies);
-                print_barrier2();
+                print_warn("Skipping unknown event %lld of testfile %s", events.line_no, opt->testfile);
+                continue;
             }
-            else if(strcmp(str_array[0], "GET_MOST_POPULAR_BOOK") == 0)
+
+            if((ev.op == EV_TAKE_BOOKS || ev.op == EV_RETURN_BOOK) &&
+               ids_message(buffer, event_name(ev.op), ev.args + 1, ev.nargs - 1) != 0)
             {
-                print_barrier3();
-                event_get_most_popular_book(loaner_leader_rank);
-                print_barrier3();
+                print_error("Event %lld of testfile %s has too many b_ids for one '%s' message (%d bytes), skipping it",
+                            events.line_no, opt->testfile, event_name(ev.op), BUF_SIZE);
+                continue;
             }
-            else if(strcmp(str_array[0], "CHECK_NUM_BOOKS_LOANED") == 0)
+            if((c_id = bad_client_id(&ev, num_libs, num_of_processes)) >= 0)
             {
-                print_barrier4();
-                event_check_num_books_loaned(loaner_leader_rank, libraries_leader_rank);
-                print_barrier4();
+                // The lines after it would wait for a client that isn't in the graph, stop here.
+                print_error("Event %lld of testfile %s has c_id %d, but the clients are %d to %d, stopping the testfile",
+                            events.line_no, opt->testfile, c_id, num_libs, num_of_processes - 2);
+                break;
             }
-            else if(strcmp(str_array[0], "START_LE_LIBR") == 0)
-            {
-                print_barrier();
-                print_info(HCYN"Coordinator: Starting LE for libraries."reset);
 
-                libraries_leader_rank = event_start_le_libraries(num_libs);
-                
-                print_info("Coordinator: LE for libraries is done, elected rank is %d", libraries_leader_rank);
-                print_barrier();
-            }
-            else if(strcmp(str_array[0], "START_LE_LOANERS") == 0)
-            {
-                print_barrier();
-                print_info(HCYN"Coordinator: Starting LE for loaners."reset);
+            stats_event_begin(event_name(ev.op));
+            phase = phase_of(ev.op);
 
-                loaner_leader_rank = event_start_le_loaners(num_libs);
-                
-                print_info(HCYN"Coordinator: LE for loaners is done, elected rank is %d"reset, loaner_leader_rank);
-                print_barrier();
+            // In the replay mode the events that aren't replayed wait for the requests in flight, except the check: it's
+            // due like the replayed events and its epoch counters count the loans and returns in flight.
+            barrier = replay_enabled() && ev.op != EV_NONE && ev.op != EV_RATE && ev.op != EV_CHECK_NUM_BOOKS_LOANED &&
+                      !is_replayed(ev.op);
+            if(barrier)
+                replay_barrier_begin();
+            line_start = transport_wtime();
+
+            if(replay_enabled() && is_replayed(ev.op))
+            {
+                event_replay(&ev);
+                phase = -1;                 // Its times are in the replay report.
             }
-            else if(strcmp(str_array[0], "SHUTDOWN") == 0)
+            else switch(ev.op)
             {
-                event_shutdown(num_of_processes);
+                case EV_RATE:
+                    if(replay_enabled())
+                        replay_set_rate(ev.value);
+                    break;
+
+                case EV_CONNECT:
+                    event_connect(ev.args[0], ev.args[1], num_libs);
+                    break;
+
+                case EV_TAKE_BOOK:
+                    event_takeBook(ev.args[0], ev.args[1]);
+                    print_barrier();
+                    break;
+
+                case EV_TAKE_BOOKS:
+                    event_takeBooks(ev.args[0], ev.args + 1, ev.nargs - 1);
+                    print_barrier();
+                    break;
+
+                case EV_RETURN_BOOK:
+                    event_returnBook(ev.args[0], ev.args + 1, ev.nargs - 1);
+                    print_barrier();
+                    break;
+
+                case EV_DONATE_BOOK:
+                    event_donateBook(ev.args[0], ev.args[1], ev.args[2]);
+                    print_barrier2();
+                    break;
+
+                case EV_GET_MOST_POPULAR_BOOK:
+                    print_barrier3();
+                    event_get_most_popular_book(loaner_leader_rank);
+                    print_barrier3();
+                    break;
+
+                case EV_CHECK_NUM_BOOKS_LOANED:
+                    if(replay_enabled())
+                    {
+                        // The donors wait for the borrowers leader, the check would block it.
+                        replay_wait_until(replay_schedule(ev.value));
+                        replay_drain_tag(TAG_DONATE_BOOKS_DONE);
+                    }
+                    print_barrier4();
+                    event_check_num_books_loaned(loaner_leader_rank, libraries_leader_rank);
+                    print_barrier4();
+                    break;
+
+                case EV_START_LE_LIBR:
+                    print_barrier();
+                    print_info(HCYN"Coordinator: Starting LE for libraries."reset);
+
+                    libraries_leader_rank = event_start_le_libraries(num_libs);
+
+                    print_info("Coordinator: LE for libraries is done, elected rank is %d", libraries_leader_rank);
+                    print_barrier();
+                    break;
+
+                case EV_START_LE_LOANERS:
+                    print_barrier();
+                    print_info(HCYN"Coordinator: Starting LE for loaners."reset);
+
+                    loaner_leader_rank = event_start_le_loaners(num_libs);
+
+                    print_info(HCYN"Coordinator: LE for loaners is done, elected rank is %d"reset, loaner_leader_rank);
+                    print_barrier();
+                    break;
+
+                case EV_SHUTDOWN:
+                    event_shutdown(num_of_processes);
+                    shutdown_sent = 1;
+                    break;
             }
-
-
-            //print_debug("Releasing memory...");
-            free_string_array(str_array);
-            str_array = NULL;
+            stats_event_end();
+            if(phase >= 0)
+                phase_add(phase, line_start, transport_wtime());
+            if(barrier)
+                replay_barrier_end();
         }
 
+        if(replay_enabled())
+            replay_drain();
+
         print_info(HCYN"Coordinator: End of test file."reset);
-        // Send 'SHUTDOWN' to all other processes?
+        replay_report(opt->replay_report_path);
+        phase_report(num_libs, num_of_processes, transport_wtime() - run_start, opt->phase_report_path);
+        hop_trace_report();
+        event_close(&events);
+
+        // The other processes wait for 'SHUTDOWN' to send their counters, even if the testfile doesn't have it.
+        if(!shutdown_sent)
+            event_shutdown(num_of_processes);
     }
-    else
+    else if(!comm_run_virtual(start_server, start_client))     // Else every library/client of this rank ran in it.
     {
         if(process_rank <= num_libs)     // Processes with rank in range of 1 to num_libs (N*N) are library processes (servers)
         {
@@ -460,6 +1010,169 @@ int main(int argc, char* argv[])
     }
 
 
+    // Every rank sends its message/time counters to the coordinator.
+    stats_report(process_rank, num_libs, opt->stats_csv_path);
+
+    log_shutdown();
+    return 0;
+}
+
+
+static const char usage[] =
+    "Program usage: ./a.out <NUM_LIBS> <test_file>\n"
+    "    [--stats-csv <file>]\n"
+    "    [--hop-trace]\n"
+    "    [--phase-report <file>]\n"
+    "    [--aggregate [<bytes>]]\n"
+    "    [--clients <C>]\n"
+    "    [--lib-tile <T>]\n"
+    "    [--server-threads <T>]\n"
+    "    [--lib-election dfs|flood|center] [--client-election maxrank|center|echo] [--shared-catalog]\n"
+    "    [--transport mpi|threads|sim [--ranks <P>] [--sim-latency <us>] [--sim-local-latency <us>] [--sim-bandwidth <MB/s>]\n"
+    "                                 [--sim-cpu <us>] [--ranks-per-host <K>]]\n"
+    "    [--replay <rate> [--replay-seed <n>] [--replay-report <file>]]\n";
+
+
+int main(int argc, char* argv[]) 
+{
+    options_t opt;
+    sim_config_t sim;                       // '--sim-latency <us>' ...: the network model of '--transport sim'.
+    int i, ret;
+    int ranks = 0;                          // '--ranks <P>': ranks of the in-process transports.
+
+
+    if(argc < 3)
+    {
+        fprintf(stderr, "%s", usage);
+        exit(0);
+    }
+
+    memset(&opt, 0, sizeof(opt));
+    opt.num_libs = atoi(argv[1]);
+    opt.testfile = argv[2];
+    opt.replay_rate = -1;
+    opt.replay_seed = 1;
+    opt.lib_tile = 1;
+    opt.server_threads = 1;
+
+    sim.latency = SIM_LATENCY;
+    sim.local_latency = SIM_LOCAL_LATENCY;
+    sim.bandwidth = SIM_BANDWIDTH;
+    sim.cpu = SIM_CPU;
+    sim.ranks_per_host = 0;
+
+    // Options after the testfile
+    for(i = 3; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--stats-csv") == 0 && i + 1 < argc)
+        {
+            opt.stats_csv_path = argv[++i];
+        }
+        else if(strcmp(argv[i], "--phase-report") == 0 && i + 1 < argc)
+        {
+            opt.phase_report_path = argv[++i];
+        }
+        else if(strcmp(argv[i], "--hop-trace") == 0)
+        {
+            hop_trace_enable();
+        }
+        else if(strcmp(argv[i], "--aggregate") == 0)
+        {
+            opt.aggregate = AGG_BATCH_SIZE;
+            if(i + 1 < argc && atoi(argv[i + 1]) > 0)
+                opt.aggregate = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--lib-tile") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            opt.lib_tile = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--clients") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            opt.num_clients = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--server-threads") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            opt.server_threads = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--lib-election") == 0 && i + 1 < argc && server_set_election(argv[i + 1]) == 0)
+        {
+            i++;
+        }
+        else if(strcmp(argv[i], "--client-election") == 0 && i + 1 < argc && client_set_election(argv[i + 1]) == 0)
+        {
+            i++;
+        }
+        else if(strcmp(argv[i], "--shared-catalog") == 0)
+        {
+            opt.shared_catalog = 1;
+        }
+        else if(strcmp(argv[i], "--transport") == 0 && i + 1 < argc && transport_select(argv[i + 1]) == 0)
+        {
+            i++;
+        }
+        else if(strcmp(argv[i], "--ranks") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            ranks = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--sim-latency") == 0 && i + 1 < argc)
+        {
+            sim.latency = atof(argv[++i]) * 1e-6;
+        }
+        else if(strcmp(argv[i], "--sim-local-latency") == 0 && i + 1 < argc)
+        {
+            sim.local_latency = atof(argv[++i]) * 1e-6;
+        }
+        else if(strcmp(argv[i], "--sim-bandwidth") == 0 && i + 1 < argc)
+        {
+            sim.bandwidth = atof(argv[++i]) * 1e6;
+        }
+        else if(strcmp(argv[i], "--sim-cpu") == 0 && i + 1 < argc)
+        {
+            sim.cpu = atof(argv[++i]) * 1e-6;
+        }
+        else if(strcmp(argv[i], "--ranks-per-host") == 0 && i + 1 < argc)
+        {
+            sim.ranks_per_host = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+        {
+            opt.replay_rate = atof(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--replay-seed") == 0 && i + 1 < argc)
+        {
+            opt.replay_seed = strtoull(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--replay-report") == 0 && i + 1 < argc)
+        {
+            opt.replay_report_path = argv[++i];
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\n%s", argv[i], usage);
+            exit(0);
+        }
+    }
+
+    // The in-process transports run every rank in this process, by default the coordinator, the libraries and the
+    // N^3 / 2 clients of the testfiles.
+    if(transport_in_process() && ranks == 0)
+        ranks = 1 + opt.num_libs + (int)(opt.num_libs * sqrt(opt.num_libs)) / 2;
+    transport_sim_configure(&sim);
+
+
+    // Initialize the MPI environment
+    // The workers of a threaded library queue their sends for the receiving thread (comm_outbox_flush()), but they
+    // still read MPI_Wtime() and MPI_Type_size(), so they need MPI_THREAD_MULTIPLE. So do the ranks of the in-process
+    // transports.
+    if(opt.server_threads > 1 || transport_in_process())
+        MPI_Init_thread(NULL, NULL, MPI_THREAD_MULTIPLE, &opt.thread_level);
+    else
+        MPI_Init(NULL, NULL);
+
+    ret = transport_run(ranks, run_rank, &opt);
+
     // Finalize - clean up the MPI environment. No more MPI calls can be made after this one.
     MPI_Finalize();
+    if(ret != 0)
+        exit(-1);
 }
\ No newline at end of file
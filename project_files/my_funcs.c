@@ -63,14 +63,11 @@ void print_all_colors()
 
 /*
 *   Works like printf but instead it first prints an information message and then the given arguments
-*   with the corresponding format.
+*   with the corresponding format. Goes through the logger (see logger.h), so it's dropped before any formatting
+*   if the runtime level is higher.
 */
-void print_info(const char *format, ...)
+void _print_info_internal(const char *format, ...)
 {
-    time_t t;
-    struct tm *tm_info;
-    char time_buffer[30];
-    char message_buf[1024];   // buffer for formatted args
     va_list args;
     
     
@@ -80,35 +77,18 @@ void print_info(const char *format, ...)
         return;
     }
 
-    // Get the current time
-    time(&t);
-    tm_info = localtime(&t);
-
-    // Format the time as "[day-month-year hour:minutes:seconds]"
-    strftime(time_buffer, sizeof(time_buffer), "[%d-%b-%y %H:%M:%S]", tm_info);
-    
-
-    // Format the variable args into message_buf
     va_start(args, format);
-    vsnprintf(message_buf, sizeof(message_buf), format, args);
+    log_vwrite(LOG_LEVEL_INFO, NULL, format, args);
     va_end(args);       // Clean up
-
-    // Print everything in one call
-    printf("[INFO] %s %s\n", time_buffer, message_buf);
 }
 
 
 /*
 *   Works like printf but instead it first prints an information message and then the given arguments
-*   with the corresponding format. Can be disabled by not defining the 'DEBUG_ENABLEd' constant.
+*   with the corresponding format. Compiled out by the print_debug() macro if 'DEBUG_ENABLED' isn't defined.
 */
-void print_debug(const char *format, ...)
+void _print_debug_internal(const char *format, ...)
 {
-#ifdef DEBUG_ENABLED
-    time_t t;
-    struct tm *tm_info;
-    char time_buffer[30];
-    char message_buf[1024];   // buffer for formatted args
     va_list args;
     
     
@@ -118,22 +98,29 @@ void print_debug(const char *format, ...)
         return;
     }
 
-    // Get the current time
-    time(&t);
-    tm_info = localtime(&t);
+    va_start(args, format);
+    log_vwrite(LOG_LEVEL_DEBUG, NULL, format, args);
+    va_end(args);       // Clean up
+}
 
-    // Format the time as "[day-month-year hour:minutes:seconds]"
-    strftime(time_buffer, sizeof(time_buffer), "[%d-%b-%y %H:%M:%S]", tm_info);
+
+/*
+*   Prints the result of a check (e.g. 'CheckNumBooksLoanded') like print_info() but it's kept in every build.
+*/
+void _print_result_internal(const char *format, ...)
+{
+    va_list args;
+    
     
+    if(format == NULL)
+    {
+        fprintf(stderr, RED"[Error]"reset" in %s, line %d: format is NULL\n", __FILE__, __LINE__);
+        return;
+    }
 
-    // Format the variable args into message_buf
     va_start(args, format);
-    vsnprintf(message_buf, sizeof(message_buf), format, args);
+    log_vwrite(LOG_LEVEL_RESULT, NULL, format, args);
     va_end(args);       // Clean up
-
-    // Print everything in one call
-    printf(MAG"[DEBUG]"reset" %s %s\n", time_buffer, message_buf);
-#endif   
 }
 
 
@@ -141,12 +128,8 @@ void print_debug(const char *format, ...)
 *   Works like printf but instead it first prints an warn message and then the given arguments
 *   with the corresponding format.
 */
-void print_warn(const char *format, ...)
+void _print_warn_internal(const char *format, ...)
 {
-    time_t t;
-    struct tm *tm_info;
-    char time_buffer[30];
-    char message_buf[1024];   // buffer for formatted args
     va_list args;
     
     
@@ -156,34 +139,19 @@ void print_warn(const char *format, ...)
         return;
     }
 
-    // Get the current time
-    time(&t);
-    tm_info = localtime(&t);
-
-    // Format the time as "[day-month-year hour:minutes:seconds]"
-    strftime(time_buffer, sizeof(time_buffer), "[%d-%b-%y %H:%M:%S]", tm_info);
-    
-
-    // Format the variable args into message_buf
     va_start(args, format);
-    vsnprintf(message_buf, sizeof(message_buf), format, args);
+    log_vwrite(LOG_LEVEL_WARN, NULL, format, args);
     va_end(args);       // Clean up
-
-    // Print everything in one call
-    printf(HYEL"[WARN]"reset" %s %s\n", time_buffer, message_buf);
 }
 
 
 /*
 *   Works like printf but instead it first prints an information message and then the given arguments
-*   with the corresponding format.
+*   with the corresponding format. Errors always reach stderr right away (and the log file if there is one).
 */
 void _print_error_internal(const char *file, int line, const char *format, ...)
 {
-    time_t t;
-    struct tm *tm_info;
-    char time_buffer[30];
-    char message_buf[1024];   // buffer for formatted args
+    char prefix[300];
     va_list args;
     
     
@@ -193,21 +161,11 @@ void _print_error_internal(const char *file, int line, const char *format, ...)
         return;
     }
 
-    // Get the current time
-    time(&t);
-    tm_info = localtime(&t);
+    snprintf(prefix, sizeof(prefix), "File: %s, line: %d, ", file, line);
 
-    // Format the time as "[day-month-year hour:minutes:seconds]"
-    strftime(time_buffer, sizeof(time_buffer), "[%d-%b-%y %H:%M:%S]", tm_info);
-    
-
-    // Format the variable args into message_buf
     va_start(args, format);
-    vsnprintf(message_buf, sizeof(message_buf), format, args);
+    log_vwrite(LOG_LEVEL_ERROR, prefix, format, args);
     va_end(args);       // Clean up
-
-    // Print everything in one call
-    fprintf(stderr, RED"[ERROR]"reset" %s File: %s, line: %d, %s\n", time_buffer, file, line, message_buf);
 }
 
 
@@ -215,9 +173,9 @@ void _print_error_internal(const char *file, int line, const char *format, ...)
 * Maybe the most useless function i've ever made. This way i have a constant number of '=' in the seperating line!
 * It justs prints a line of '#' to help me seperate prints.
 */
-void print_barrier()
+void _print_barrier_internal()
 {
-    printf("==============================================================================================\n");
+    _print_info_internal("==============================================================================================");
 }
 
 
@@ -225,9 +183,9 @@ void print_barrier()
 * Maybe the most useless function i've ever made VOL2. This way i have a constant number of '#' in the seperating line!
 * It justs prints a line of '#' to help me seperate prints.
 */
-void print_barrier2()
+void _print_barrier2_internal()
 {
-    printf("##############################################################################################\n");
+    _print_info_internal("##############################################################################################");
 }
 
 
@@ -235,9 +193,9 @@ void print_barrier2()
 * Maybe the most useless function i've ever made VOL3. This way i have a constant number of '@' in the seperating line!
 * It justs prints a line of '@' to help me seperate prints.
 */
-void print_barrier3()
+void _print_barrier3_internal()
 {
-    printf("@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
+    _print_info_internal("@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
 }
 
 
@@ -245,9 +203,9 @@ void print_barrier3()
 * Maybe the most useless function i've ever made VOL3. This way i have a constant number of '()' in the seperating line!
 * It justs prints a line of '()' to help me seperate prints.
 */
-void print_barrier4()
-{           
-    printf("((((((((((((((((((((((((((((((((((((((((((((((()))))))))))))))))))))))))))))))))))))))))))))))\n");
+void _print_barrier4_internal()
+{
+    _print_info_internal("((((((((((((((((((((((((((((((((((((((((((((((()))))))))))))))))))))))))))))))))))))))))))))))");
 }
 
 
@@ -506,4 +464,52 @@ void strcat_int(char *buffer, int x)
     strcat(buffer, tmp_str);
     free(tmp_str);
     tmp_str = NULL;
+}
+
+
+/*
+* Adds n events stamped with the given epoch to the counter, growing the array if needed.
+*/
+void epoch_counter_add(epoch_counter_t *counter, int epoch, int n)
+{
+    int i;
+
+
+    if(epoch >= counter->size)
+    {
+        counter->counts = (int *) MyRealloc(counter->counts, (epoch + 1) * sizeof(int));
+        for(i = counter->size; i <= epoch; i++)
+            counter->counts[i] = 0;
+        counter->size = epoch + 1;
+    }
+
+    counter->counts[epoch] += n;
+}
+
+
+/*
+* @return How many events were stamped with an epoch smaller than the given one.
+*/
+int epoch_counter_sum_before(epoch_counter_t *counter, int epoch)
+{
+    int i, sum = 0;
+
+
+    for(i = 0; i < epoch && i < counter->size; i++)
+        sum += counter->counts[i];
+
+    return sum;
+}
+
+
+/*
+* Releases the memory of the counter and sets it to empty.
+*/
+void epoch_counter_free(epoch_counter_t *counter)
+{
+    if(counter->counts != NULL)
+        free(counter->counts);
+
+    counter->counts = NULL;
+    counter->size = 0;
 }
\ No newline at end of file
@@ -7,11 +7,14 @@
 #include <stdarg.h>                         // For variable number of arguments.
 #include <time.h>
 #include "ansi-color-codes.h"
+#include "logger.h"
 
 
 #define DEBUG_ENABLED           // Comment this out to stop getting the debug messages
 #define COORDINATOR_RANK 0
 #define BUF_SIZE 256            // A buffer size to hold the MPI messages
+#define MAX_BOOKS_PER_MSG 12    // How many books fit in one 'LEND_BOOKS' message (and its 'ACK_LB' answer) or 'RETURN_BOOK' message.
+#define CHECK_NUM_BOOKS_RETRIES 5    // How many times the coordinator asks again for the same epoch when loans are still in flight.
 
 #define TAG_ACK 0
 
@@ -44,9 +47,51 @@
 
 #define TAG_SHUTDOWN 23
 
+#define TAG_RETURN_BOOK 24
+#define TAG_DONE_RETURN_BOOK 25
+#define TAG_BOOK_AVAILABLE 26       // A waitlisted book is pushed to the client.
+#define TAG_BATCH 27                // Aggregated small messages (comm.c, '--aggregate').
 
+
+/*
+* Counts events (loans, returns) by the epoch they were stamped with. Epochs are the ids of the 'CHECK_NUM_BOOKS_LOANED'
+* events, so a count "before epoch e" is the same on both ends of a message no matter when the message arrives.
+*/
+typedef struct {
+
+    int *counts;                // counts[k] events were stamped with epoch k.
+    int size;
+
+} epoch_counter_t;
+
+
+/*
+* Compile-time minimum log level. print_* calls below it are removed by the compiler together with their arguments,
+* the rest only evaluate their arguments if the runtime level (LOG_LEVEL, see logger.h) lets them through.
+* Use log_on() to guard code that only builds strings for a print. 'make bench' builds with LOG_LEVEL_WARN.
+*/
+#ifndef LOG_COMPILE_LEVEL
+    #ifdef DEBUG_ENABLED
+        #define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+    #else
+        #define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+    #endif
+#endif
+
+#define log_on(level)       ((level) >= LOG_COMPILE_LEVEL && log_enabled(level))
+
+#define print_debug(...)    do { if(log_on(LOG_LEVEL_DEBUG)) _print_debug_internal(__VA_ARGS__); } while(0)
+#define print_info(...)     do { if(log_on(LOG_LEVEL_INFO)) _print_info_internal(__VA_ARGS__); } while(0)
+#define print_warn(...)     do { if(log_on(LOG_LEVEL_WARN)) _print_warn_internal(__VA_ARGS__); } while(0)
+#define print_result(...)   _print_result_internal(__VA_ARGS__)        // Results of the checks, never compiled out.
 #define print_error(format, ...) _print_error_internal(__FILE__, __LINE__, format, ##__VA_ARGS__)
 
+// The separator lines between the events of the testfile are info prints too.
+#define print_barrier()     do { if(log_on(LOG_LEVEL_INFO)) _print_barrier_internal(); } while(0)
+#define print_barrier2()    do { if(log_on(LOG_LEVEL_INFO)) _print_barrier2_internal(); } while(0)
+#define print_barrier3()    do { if(log_on(LOG_LEVEL_INFO)) _print_barrier3_internal(); } while(0)
+#define print_barrier4()    do { if(log_on(LOG_LEVEL_INFO)) _print_barrier4_internal(); } while(0)
+
 // Macro wrappers to capture file & line automatically
 #define MyMalloc(size)          _MyMalloc_internal(size, __FILE__, __LINE__)
 #define MyCalloc(count, size)   _MyCalloc_internal(count, size, __FILE__, __LINE__)
@@ -54,15 +99,16 @@
 
 
 void print_all_colors();
-void print_info(const char *format, ...);
-void print_debug(const char *format, ...);
-void print_warn(const char *format, ...);
+void _print_info_internal(const char *format, ...);
+void _print_debug_internal(const char *format, ...);
+void _print_warn_internal(const char *format, ...);
+void _print_result_internal(const char *format, ...);
 void _print_error_internal(const char *file, int line, const char *format, ...);
 
-void print_barrier();
-void print_barrier2();
-void print_barrier3();
-void print_barrier4();
+void _print_barrier_internal();
+void _print_barrier2_internal();
+void _print_barrier3_internal();
+void _print_barrier4_internal();
 
 int get_random_in_range(int lower, int upper);
 
@@ -80,4 +126,8 @@ char *int_to_string(int x);
 
 void strcat_int(char *buffer, int x);
 
+void epoch_counter_add(epoch_counter_t *counter, int epoch, int n);
+int epoch_counter_sum_before(epoch_counter_t *counter, int epoch);
+void epoch_counter_free(epoch_counter_t *counter);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,167 @@
+/*
+* PMPI interposition tracer. Linked into main with 'make TRACE=1', the application code doesn't change:
+* MPI_Send/MPI_Recv/MPI_Barrier are caught here, recorded in memory and forwarded to PMPI_*. MPI_Init and MPI_Init_thread
+* ('--server-threads' and the in-process transports start with it) set up the rank and the time origin.
+* MPI_Finalize writes the records to <TRACE_DIR>/trace_<rank>.bin (TRACE_DIR defaults to "trace"),
+* trace_merge turns the files of a run into a Chrome/Perfetto trace.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "pmpi_trace.h"
+
+
+static trace_record_t *records = NULL;
+static long long records_num = 0;
+static long long records_cap = 0;
+static double t_zero = 0;
+static int trace_rank = -1;
+static int trace_size = 0;
+static pthread_mutex_t records_lock = PTHREAD_MUTEX_INITIALIZER;   // The library threads of '--server-threads' send too.
+
+
+static void add_record(char kind, int peer, int tag, int bytes, double t_start, double t_end)
+{
+    trace_record_t *rec;
+
+
+    pthread_mutex_lock(&records_lock);
+    if(records_num == records_cap)
+    {
+        long long new_cap = records_cap == 0 ? 4096 : records_cap * 2;
+        trace_record_t *tmp = realloc(records, new_cap * sizeof(trace_record_t));
+
+        if(tmp == NULL)
+        {
+            pthread_mutex_unlock(&records_lock);
+            return;         // Out of memory, stop recording but keep the application running.
+        }
+        records = tmp;
+        records_cap = new_cap;
+    }
+
+    rec = &records[records_num++];
+    rec->kind = kind;
+    rec->peer = peer;
+    rec->tag = tag;
+    rec->bytes = bytes;
+    rec->t_start = t_start - t_zero;
+    rec->t_end = t_end - t_zero;
+    pthread_mutex_unlock(&records_lock);
+}
+
+
+static void trace_init()
+{
+    PMPI_Comm_rank(MPI_COMM_WORLD, &trace_rank);
+    PMPI_Comm_size(MPI_COMM_WORLD, &trace_size);
+
+    // Common time origin for all the ranks.
+    PMPI_Barrier(MPI_COMM_WORLD);
+    t_zero = PMPI_Wtime();
+}
+
+
+int MPI_Init(int *argc, char ***argv)
+{
+    int ret = PMPI_Init(argc, argv);
+
+
+    trace_init();
+    return ret;
+}
+
+
+int MPI_Init_thread(int *argc, char ***argv, int required, int *provided)
+{
+    int ret = PMPI_Init_thread(argc, argv, required, provided);
+
+
+    trace_init();
+    return ret;
+}
+
+
+int MPI_Send(const void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm)
+{
+    double t_start = PMPI_Wtime();
+    int ret, type_size;
+
+
+    ret = PMPI_Send(buf, count, datatype, dest, tag, comm);
+
+    PMPI_Type_size(datatype, &type_size);
+    add_record(TRACE_SEND, dest, tag, count * type_size, t_start, PMPI_Wtime());
+    return ret;
+}
+
+
+int MPI_Recv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm, MPI_Status *status)
+{
+    MPI_Status local_status;
+    double t_start = PMPI_Wtime();
+    int ret, type_size, recv_count;
+
+
+    if(status == MPI_STATUS_IGNORE)
+        status = &local_status;
+
+    ret = PMPI_Recv(buf, count, datatype, source, tag, comm, status);
+
+    PMPI_Type_size(datatype, &type_size);
+    PMPI_Get_count(status, datatype, &recv_count);
+    add_record(TRACE_RECV, status->MPI_SOURCE, status->MPI_TAG, recv_count * type_size, t_start, PMPI_Wtime());
+    return ret;
+}
+
+
+int MPI_Barrier(MPI_Comm comm)
+{
+    double t_start = PMPI_Wtime();
+    int ret = PMPI_Barrier(comm);
+
+
+    add_record(TRACE_BARRIER, -1, -1, 0, t_start, PMPI_Wtime());
+    return ret;
+}
+
+
+int MPI_Finalize()
+{
+    const char *dir = getenv("TRACE_DIR");
+    char path[512];
+    trace_header_t header;
+    FILE *fp;
+
+
+    if(dir == NULL || dir[0] == '\0')
+        dir = "trace";
+
+    mkdir(dir, 0755);       // Every rank tries, it's fine if it already exists.
+    snprintf(path, sizeof(path), "%s/trace_%d.bin", dir, trace_rank);
+
+    fp = fopen(path, "wb");
+    if(fp == NULL)
+    {
+        fprintf(stderr, "[ERROR] Rank %d: couldn't write the trace to %s\n", trace_rank, path);
+    }
+    else
+    {
+        header.rank = trace_rank;
+        header.num_of_processes = trace_size;
+        header.records_num = records_num;
+        fwrite(&header, sizeof(header), 1, fp);
+        fwrite(records, sizeof(trace_record_t), records_num, fp);
+        fclose(fp);
+    }
+
+    free(records);
+    records = NULL;
+    records_num = records_cap = 0;
+
+    return PMPI_Finalize();
+}
@@ -0,0 +1,35 @@
+#ifndef PMPI_TRACE_H
+#define PMPI_TRACE_H
+
+/*
+* Record format of the PMPI tracer (pmpi_trace.c), shared with trace_merge.c.
+* Every rank writes <TRACE_DIR>/trace_<rank>.bin: a trace_header_t followed by trace_record_t's in program order.
+* Times are in seconds since the MPI_Barrier() at the end of MPI_Init(), so the ranks of a node are roughly aligned.
+*/
+
+#define TRACE_SEND 'S'
+#define TRACE_RECV 'R'
+#define TRACE_BARRIER 'B'
+
+
+typedef struct {
+
+    int rank;
+    int num_of_processes;
+    long long records_num;
+
+} trace_header_t;
+
+
+typedef struct {
+
+    char kind;                  // TRACE_SEND, TRACE_RECV or TRACE_BARRIER.
+    int peer;                   // Destination of a send, actual source of a receive, -1 for a barrier.
+    int tag;                    // Actual tag of a receive.
+    int bytes;
+    double t_start;             // When the call started and returned.
+    double t_end;
+
+} trace_record_t;
+
+#endif
@@ -0,0 +1,465 @@
+#include "replay.h"
+
+#include <math.h>
+#include <time.h>
+#include <mpi.h>
+
+#include "my_funcs.h"
+#include "comm.h"
+
+
+#define REPLAY_EVENT_NAME_SIZE 24
+#define REPLAY_MAX_EVENTS 5             // TAKE_BOOK, TAKE_BOOKS, RETURN_BOOK, DONATE_BOOK and "all".
+#define REPLAY_POLL_SLEEP 0.00005       // Seconds the coordinator sleeps when nothing came and nothing is due.
+
+
+/*
+* A request in flight, in the list of its client.
+*/
+typedef struct pending {
+
+    int tag;
+    char expected[REPLAY_EVENT_NAME_SIZE];  // The reply we wait for.
+    int event;                              // Index in events.
+    double due;
+    double sent;
+    struct pending *next;
+
+} pending_t;
+
+
+/*
+* The four times of the requests of an event (seconds).
+*/
+typedef struct {
+
+    char name[REPLAY_EVENT_NAME_SIZE];
+    double *lag;
+    double *queue;
+    double *service;
+    double *response;
+    int samples_num;
+    int samples_cap;
+
+} replay_event_t;
+
+
+static int enabled = 0;
+static replay_done_fn done_fn;
+static double rate;
+static unsigned long long rng_state;
+
+static double origin = -1;              // transport_wtime() of the first line, the schedule is in seconds since then.
+static double paused = 0;               // Time spent in barriers, the schedule doesn't move while they run.
+static double barrier_start;
+static double last_scheduled = 0;
+
+static pending_t **pending;             // Per client rank.
+static double *last_done;               // Per client rank, when its last request finished.
+static int num_ranks;
+static int in_flight = 0;
+static int in_flight_max = 0;
+
+static replay_event_t events[REPLAY_MAX_EVENTS];
+static int events_num = 0;
+static long long issued = 0;
+static double first_scheduled = -1, last_issued_scheduled, first_sent = -1, last_reply;
+
+static const int reply_tags[] = { TAG_DONE_FIND_BOOK, TAG_DONE_RETURN_BOOK, TAG_DONATE_BOOKS_DONE };
+#define REPLY_TAGS_NUM ((int)(sizeof(reply_tags) / sizeof(reply_tags[0])))
+static int tag_in_flight[REPLY_TAGS_NUM];   // Requests in flight per reply tag.
+
+
+static int reply_tag_index(int tag)
+{
+    int i;
+
+
+    for(i = 0; i < REPLY_TAGS_NUM; i++)
+    {
+        if(reply_tags[i] == tag)
+            return i;
+    }
+    print_error("Coordinator: %d isn't a reply tag of the replay", tag);
+    exit(-1);
+}
+
+
+/*
+* xorshift64* for the Poisson gaps, so a seed gives the same schedule.
+*/
+static double rng_uniform()             // [0, 1)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+void replay_enable(double replay_rate, unsigned long long seed, int num_of_processes, replay_done_fn done)
+{
+    enabled = 1;
+    rate = replay_rate;
+    rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;   // Never 0.
+    done_fn = done;
+
+    num_ranks = num_of_processes;
+    pending = (pending_t **) MyCalloc(num_ranks, sizeof(pending_t *));
+    last_done = (double *) MyCalloc(num_ranks, sizeof(double));
+
+    strcpy(events[0].name, "all");
+    events_num = 1;
+}
+
+
+int replay_enabled()
+{
+    return enabled;
+}
+
+
+/*
+* 'RATE <events/s>' line: the gaps of the lines after it.
+*/
+void replay_set_rate(double new_rate)
+{
+    rate = new_rate;
+    print_info(HCYN"Coordinator: replay rate is now %.1f events/s"reset, rate);
+}
+
+
+/*
+* @param timestamp The timestamp column of the line, < 0 if it doesn't have one.
+* @return When the line is due (transport_wtime() time).
+*/
+double replay_schedule(double timestamp)
+{
+    double now = transport_wtime();
+
+
+    if(origin < 0)
+        origin = now;
+
+    if(timestamp >= 0)
+        last_scheduled = timestamp;
+    else if(rate > 0)
+        last_scheduled += -log(1.0 - rng_uniform()) / rate;
+    else
+        last_scheduled = now - origin - paused;     // As fast as possible.
+
+    return origin + paused + last_scheduled;
+}
+
+
+static void add_sample(int event, double lag, double queue, double service, double response)
+{
+    replay_event_t *e = &events[event];
+
+
+    if(e->samples_num == e->samples_cap)
+    {
+        e->samples_cap = e->samples_cap == 0 ? 256 : e->samples_cap * 2;
+        e->lag = (double *) MyRealloc(e->lag, e->samples_cap * sizeof(double));
+        e->queue = (double *) MyRealloc(e->queue, e->samples_cap * sizeof(double));
+        e->service = (double *) MyRealloc(e->service, e->samples_cap * sizeof(double));
+        e->response = (double *) MyRealloc(e->response, e->samples_cap * sizeof(double));
+    }
+    e->lag[e->samples_num] = lag;
+    e->queue[e->samples_num] = queue;
+    e->service[e->samples_num] = service;
+    e->response[e->samples_num] = response;
+    e->samples_num++;
+}
+
+
+/*
+* Receives the reply of a client and closes its oldest request with the same reply tag (a client handles the messages
+* of the coordinator in order, so the replies on a tag come in the order of the requests).
+*/
+static void reply_received(int client_rank, int tag)
+{
+    char buffer[BUF_SIZE];
+    pending_t **pp, *p;
+    MPI_Status status;
+    double now, service_start;
+
+
+    memset(buffer, 0, sizeof(buffer));
+    comm_recv(buffer, sizeof(buffer), MPI_CHAR, client_rank, tag, MPI_COMM_WORLD, &status);
+    now = transport_wtime();
+
+    for(pp = &pending[client_rank]; *pp != NULL && (*pp)->tag != tag; pp = &(*pp)->next)
+        ;
+    if(*pp == NULL)
+    {
+        print_error("Coordinator: got '%s' by client rank %d without a request in flight", buffer, client_rank);
+        exit(-1);
+    }
+    p = *pp;
+    *pp = p->next;
+    in_flight--;
+    tag_in_flight[reply_tag_index(tag)]--;
+
+    done_fn(buffer, p->expected, client_rank);
+
+    service_start = p->sent > last_done[client_rank] ? p->sent : last_done[client_rank];
+    last_done[client_rank] = now;
+    last_reply = now;
+
+    add_sample(p->event, p->sent - p->due, service_start - p->sent, now - service_start, now - p->due);
+    add_sample(0, p->sent - p->due, service_start - p->sent, now - service_start, now - p->due);
+    free(p);
+}
+
+
+/*
+* Takes every reply that has arrived.
+* @return How many there were.
+*/
+static int poll_replies()
+{
+    MPI_Status status;
+    int i, flag, got = 0;
+
+
+    for(i = 0; i < REPLY_TAGS_NUM; i++)
+    {
+        do
+        {
+            comm_iprobe(MPI_ANY_SOURCE, reply_tags[i], MPI_COMM_WORLD, &flag, &status);
+            if(flag)
+            {
+                reply_received(status.MPI_SOURCE, reply_tags[i]);
+                got++;
+            }
+        } while(flag);
+    }
+
+    return got;
+}
+
+
+static void short_sleep(double seconds)
+{
+    if(seconds > REPLAY_POLL_SLEEP)
+        seconds = REPLAY_POLL_SLEEP;
+    transport_sleep(seconds);
+}
+
+
+/*
+* Collects replies until the time is due.
+*/
+void replay_wait_until(double due)
+{
+    double now;
+
+
+    while(1)
+    {
+        int got = poll_replies();
+
+        now = transport_wtime();
+        if(now >= due)
+            break;
+        if(got == 0)
+            short_sleep(due - now);
+    }
+}
+
+
+void replay_issued(int client_rank, int tag, const char *expected, const char *event, double due, double sent)
+{
+    pending_t *p, **pp;
+    int i;
+
+
+    for(i = 1; i < events_num; i++)
+    {
+        if(strcmp(events[i].name, event) == 0)
+            break;
+    }
+    if(i == events_num && events_num < REPLAY_MAX_EVENTS)
+    {
+        strncpy(events[i].name, event, REPLAY_EVENT_NAME_SIZE - 1);
+        events_num++;
+    }
+    else if(i == events_num)
+    {
+        i = 0;                          // Counted only in "all".
+    }
+
+    p = (pending_t *) MyCalloc(1, sizeof(pending_t));
+    p->tag = tag;
+    strncpy(p->expected, expected, REPLAY_EVENT_NAME_SIZE - 1);
+    p->event = i;
+    p->due = due;
+    p->sent = sent;
+
+    // Append, the list is in the order of the requests.
+    for(pp = &pending[client_rank]; *pp != NULL; pp = &(*pp)->next)
+        ;
+    *pp = p;
+
+    in_flight++;
+    tag_in_flight[reply_tag_index(tag)]++;
+    if(in_flight > in_flight_max)
+        in_flight_max = in_flight;
+
+    issued++;
+    if(first_sent < 0)
+    {
+        first_scheduled = last_scheduled;
+        first_sent = sent;
+    }
+    last_issued_scheduled = last_scheduled;
+}
+
+
+/*
+* Waits for every request in flight.
+*/
+void replay_drain()
+{
+    while(in_flight > 0)
+    {
+        if(poll_replies() == 0)
+            short_sleep(REPLAY_POLL_SLEEP);
+    }
+}
+
+
+/*
+* Waits for the requests in flight with the reply tag, the rest stay in flight.
+*/
+void replay_drain_tag(int tag)
+{
+    int i = reply_tag_index(tag);
+
+
+    while(tag_in_flight[i] > 0)
+    {
+        if(poll_replies() == 0)
+            short_sleep(REPLAY_POLL_SLEEP);
+    }
+}
+
+
+/*
+* A line that isn't replayed: drains the requests in flight and pauses the schedule until replay_barrier_end().
+*/
+void replay_barrier_begin()
+{
+    barrier_start = transport_wtime();
+    replay_drain();
+}
+
+
+void replay_barrier_end()
+{
+    if(origin >= 0)
+        paused += transport_wtime() - barrier_start;
+}
+
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+static double mean(double *samples, int n)
+{
+    double sum = 0;
+    int i;
+
+
+    for(i = 0; i < n; i++)
+        sum += samples[i];
+    return n > 0 ? sum / n : 0;
+}
+
+
+static double percentile(double *sorted, int n, double p)
+{
+    int idx = (int)ceil(p * n) - 1;
+
+
+    if(idx < 0)
+        idx = 0;
+    if(idx >= n)
+        idx = n - 1;
+    return sorted[idx];
+}
+
+
+/*
+* Prints the offered load, the throughput and the times of every event (ms: mean, p50, p99, max) and, if csv_path
+* isn't NULL, writes them there. Call it after replay_drain().
+*/
+void replay_report(const char *csv_path)
+{
+    const char *time_names[] = { "lag", "queue", "service", "response" };
+    double offered, throughput, *times[4];
+    FILE *fp = NULL;
+    int i, j, n;
+
+
+    if(!enabled || issued == 0)
+        return;
+
+    offered = last_issued_scheduled > first_scheduled ? (issued - 1) / (last_issued_scheduled - first_scheduled) : 0;
+    throughput = last_reply > first_sent ? issued / (last_reply - first_sent) : 0;
+
+    print_result("Replay: %lld requests, offered %.1f req/s, throughput %.1f req/s, max in flight %d", issued, offered,
+                 throughput, in_flight_max);
+    print_result("    %-12s %-9s %8s %10s %10s %10s %10s", "event", "time (ms)", "count", "mean", "p50", "p99", "max");
+
+    if(csv_path != NULL)
+    {
+        fp = fopen(csv_path, "w");
+        if(fp == NULL)
+            print_error("Couldn't open file %s", csv_path);
+        else
+            fprintf(fp, "event,time,count,offered_rps,throughput_rps,mean_s,p50_s,p99_s,max_s\n");
+    }
+
+    for(i = 0; i < events_num; i++)
+    {
+        replay_event_t *e = &events[i];
+
+        n = e->samples_num;
+        if(n == 0)
+            continue;
+
+        times[0] = e->lag;
+        times[1] = e->queue;
+        times[2] = e->service;
+        times[3] = e->response;
+        for(j = 0; j < 4; j++)
+        {
+            double m = mean(times[j], n);
+
+            qsort(times[j], n, sizeof(double), compare_doubles);
+            print_result("    %-12s %-9s %8d %10.3f %10.3f %10.3f %10.3f", j == 0 ? e->name : "", time_names[j], n,
+                         m * 1e3, percentile(times[j], n, 0.50) * 1e3, percentile(times[j], n, 0.99) * 1e3,
+                         times[j][n - 1] * 1e3);
+            if(fp != NULL)
+                fprintf(fp, "%s,%s,%d,%.3f,%.3f,%.9f,%.9f,%.9f,%.9f\n", e->name, time_names[j], n, offered, throughput,
+                        m, percentile(times[j], n, 0.50), percentile(times[j], n, 0.99), times[j][n - 1]);
+        }
+
+        free(e->lag);
+        free(e->queue);
+        free(e->service);
+        free(e->response);
+        e->lag = e->queue = e->service = e->response = NULL;
+        e->samples_num = e->samples_cap = 0;
+    }
+
+    if(fp != NULL)
+        fclose(fp);
+}
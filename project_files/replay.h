@@ -0,0 +1,48 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+* Open loop replay of the testfile (coordinator option '--replay <rate>'). The lending and donation lines (TAKE_BOOK,
+* TAKE_BOOKS, RETURN_BOOK, DONATE_BOOK) are sent when they're due, without waiting for the previous ones to finish,
+* and their replies are collected while the coordinator waits for the next one. CHECK_NUM_BOOKS_LOANED is due the same
+* way and runs with the loans and returns in flight (its counters are stamped with epochs), it only waits for the
+* donations: a donor waits for the borrowers leader, which would be busy with the check. The
+* rest of the lines (elections, queries, SHUTDOWN) wait for every request in flight first and the schedule is paused while
+* they run.
+*
+* When a line is due:
+*   - a line can start with a timestamp, '<seconds> TAKE_BOOK 40 7', the seconds since the start of the replay.
+*   - otherwise the gaps are exponential (Poisson arrivals) with the rate of '--replay <rate>' or of the last
+*     'RATE <events/s>' line of the testfile. Rate 0 sends the lines as fast as possible.
+*
+* Every request gets four times: the lag of the coordinator (due -> sent), the time it queued behind the previous
+* requests of the same client (a client handles one at a time), its service time and the response time (due -> reply).
+* The queueing delay is worked out on the coordinator's clock: the service of a request starts when it's sent or when
+* the previous request of the client finished, whichever is later.
+*/
+
+
+typedef void (*replay_done_fn)(char *buffer, const char *expected, int client_rank);
+
+
+void replay_enable(double rate, unsigned long long seed, int num_of_processes, replay_done_fn done);
+int replay_enabled();
+void replay_set_rate(double rate);
+
+double replay_schedule(double timestamp);
+void replay_wait_until(double due);
+void replay_issued(int client_rank, int tag, const char *expected, const char *event, double due, double sent);
+
+void replay_barrier_begin();
+void replay_barrier_end();
+void replay_drain();
+void replay_drain_tag(int tag);
+
+void replay_report(const char *csv_path);
+
+#endif
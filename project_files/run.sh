@@ -1,8 +1,8 @@
 #!/bin/bash
 
 # Check if the correct number of arguments is passed
-if [ $# -lt 2 ] || [ $# -gt 2 ]; then
-    echo "Script usage: $0 <N> <testfile>"
+if [ $# -lt 2 ]; then
+    echo "Script usage: $0 <N> <testfile> [options of ./main, e.g. --stats-csv stats.csv]"
     exit 1
 fi
 
@@ -17,5 +17,5 @@ sed -i 's/\r//' host_file
 echo "Running with NP=$NP, NUM_LIBS=$NUM_LIBS"
 
 # Run with the testfile0
-mpirun -np $NP --hostfile host_file ./main $NUM_LIBS $TESTFILE
+mpirun -np $NP --hostfile host_file ./main $NUM_LIBS $TESTFILE "${@:3}"
 
@@ -1,5 +1,7 @@
 #include "server.h"
 
+#include <time.h>
+
 
 /*
 * This function generates books for each library USING the l_id (not MPI rank).
@@ -118,6 +120,21 @@ void init_library(library_t * library, int library_rank, int num_libs, int N)
     library->children = NULL;
     library->children_num = 0;
 
+    library->flood_round = 0;
+    library->flood_rounds = 2 * (N - 1);
+    memset(&library->flood_leader, 0, sizeof(flood_vote_t));
+    memset(library->flood_recv, 0, sizeof(library->flood_recv));
+    library->flood_ends = 0;
+    library->flood_echoes = 0;
+
+    library->pending = NULL;
+    library->epoch = 0;
+    memset(&library->loans, 0, sizeof(epoch_counter_t));
+    memset(&library->returns, 0, sizeof(epoch_counter_t));
+    library->waitlist_served = 0;
+    library->waitlist_wait_time = 0;
+    library->threaded = 0;              // start_server() turns it on with the locks.
+    library->shm_claims = 0;
     init_books(library, N);
 }
 
@@ -141,6 +158,62 @@ void clear_library(library_t * library)
 }
 
 
+/*
+* The root of the spanning tree ends the election and lets the coordinator know.
+*/
+static void le_libraries_won(library_t *library)
+{
+    char buffer_send[BUF_SIZE];
+    int i;
+    MPI_Status status;
+
+
+    print_info(GRN"END OF LE"reset UGRN": Rank %d won the elections and is now the leader."reset, library->rank);
+
+
+    // Send to the other libraries that the election is over. For debug reasons.
+#ifdef DEBUG_ENABLED
+    // Use buffer to create a print with all my children.
+    if(log_on(LOG_LEVEL_DEBUG))
+    {
+        sprintf(buffer_send, "---Leader library (rank %d) children: ", library->rank);
+        for(i = 0; i < library->children_num; i++)
+        {
+            strcat_int(buffer_send, library->children[i]);
+            strcat(buffer_send, "-");
+        }
+        print_debug("%s--", buffer_send);
+    }
+
+    memset(buffer_send, 0, sizeof(buffer_send));
+    strcpy(buffer_send, "LE_LIBR_DONE");
+    for(i = 0; i < library->children_num; i++)
+    {
+        comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, library->children[i], TAG_LE_LIBRARIES_DONE, MPI_COMM_WORLD);
+    }
+    // Don't let the coordinator know LE is done yet. 
+    // Wait for 'ACK' so that the output is clear and we can see the whole tree in the console.
+    for(i = 0; i < library->children_num; i++)
+    {
+        memset(buffer_send, 0, sizeof(buffer_send));
+        comm_recv(buffer_send, sizeof(buffer_send), MPI_CHAR, library->children[i], TAG_ACK, MPI_COMM_WORLD, &status);
+        if(strcmp(buffer_send, "ACK") != 0)
+        {
+            print_error("Leader didn't get 'ACK' from child rank %d but instead got %s", library->children[i], buffer_send);
+        }
+        print_debug("Leader got 'ACK' from child rank %d", library->children[i]);
+    }
+#endif
+
+
+    // Send to coordinator 'LE_LIBR_DONE'
+    print_debug("Leader rank %d sending 'LE_LIBR_DONE' to coordinator", library->rank);
+    memset(buffer_send, 0, sizeof(buffer_send));
+    strcpy(buffer_send, "LE_LIBR_DONE");
+    comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_LE_LIBRARIES_DONE, MPI_COMM_WORLD);
+}
+
+
 /*
 * 
 * @return 1 if there was an unexplored neighbor and you sent a "LEADER" message to it
@@ -150,7 +223,6 @@ int explore(library_t *library)
 {
     char buffer_send[BUF_SIZE];
     int i;
-    MPI_Status status;
 
 
     // Explore()
@@ -163,7 +235,7 @@ int explore(library_t *library)
             memset(buffer_send, 0, sizeof(buffer_send));
             strcpy(buffer_send, "LEADER ");
             strcat_int(buffer_send, library->leader_rank);
-            MPI_Send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, library->unexplored[i], TAG_LIB_LEADER, MPI_COMM_WORLD);
+            comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, library->unexplored[i], TAG_LIB_LEADER, MPI_COMM_WORLD);
             
             // Remove neighbor rank from unexplored
             library->unexplored[i] = 0;
@@ -179,54 +251,256 @@ int explore(library_t *library)
         memset(buffer_send, 0, sizeof(buffer_send));
         strcpy(buffer_send, "PARENT ");
         strcat_int(buffer_send, library->leader_rank);
-        MPI_Send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, library->parent_rank, TAG_LIB_PARENT, MPI_COMM_WORLD);   // +1 so that the '\0' is included in the sent message
+        comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, library->parent_rank, TAG_LIB_PARENT, MPI_COMM_WORLD);   // +1 so that the '\0' is included in the sent message
     }
     else
     {
         // Terminate as the root of the SP.
-        print_info(GRN"END OF LE"reset UGRN": Rank %d won the elections and is now the leader."reset, library->rank);
+        le_libraries_won(library);
+    }
 
+    return 0;
+}
 
-        // Send to the other libraries that the election is over. For debug reasons.
-    #ifdef DEBUG_ENABLED
-        // Use buffer to create a print with all my children.
-        sprintf(buffer_send, "---Leader library (rank %d) children: ", library->rank);
-        for(i = 0; i < library->children_num; i++)
-        {
-            strcat_int(buffer_send, library->children[i]);
-            strcat(buffer_send, "-");
-        }
-        print_debug("%s--", buffer_send);
+
+#define LIB_ELECTION_DFS 0
+#define LIB_ELECTION_FLOOD 1
+#define LIB_ELECTION_CENTER 2
+
+static int lib_election = LIB_ELECTION_DFS;
+
+
+/*
+* '--lib-election dfs|flood': how the libraries elect their leader.
+*   dfs   - every library starts a DFS of the grid and the smaller ids stall (explore()), one 'LEADER' at a time.
+*   flood - every library sends the biggest id it knows to all its neighbors for 2(N-1) rounds (the diameter of the
+*           grid), a round ends when the ids of all the neighbors for it came. Then everyone knows the biggest id and
+*           its parent is the neighbor that brought it first, so the tree is a BFS tree of the leader. 'FLOOD_END' tells
+*           the neighbors if they are our parent and 'FLOOD_ECHO' goes up the tree when a subtree is done, the leader
+*           sends 'LE_LIBR_DONE' when it got it from all its children. O(diameter) time instead of O(N^2) hops.
+*   center - the same flood, but the candidate with the smallest eccentricity on the grid wins (the center, where the
+*           FIND_BOOK/NUM_BOOKS_LOANED traffic and the tree are the shortest), then the one that has lent the fewest
+*           copies, then the biggest id. For an even N the 4 libraries in the middle tie on the eccentricity.
+* @return 0, or -1 if the name isn't known.
+*/
+int server_set_election(const char *name)
+{
+    if(strcmp(name, "dfs") == 0)
+        lib_election = LIB_ELECTION_DFS;
+    else if(strcmp(name, "flood") == 0)
+        lib_election = LIB_ELECTION_FLOOD;
+    else if(strcmp(name, "center") == 0)
+        lib_election = LIB_ELECTION_CENTER;
+    else
+        return -1;
+    return 0;
+}
+
+
+static int grid_neighbor(library_t *library, int i)
+{
+    int neighbors[4] = { library->up, library->down, library->left, library->right };
+
+    return neighbors[i];
+}
+
+
+static int grid_degree(library_t *library)
+{
+    return (library->up != 0) + (library->down != 0) + (library->left != 0) + (library->right != 0);
+}
+
+
+/*
+* @return 1 if candidate a wins over b.
+*/
+static int flood_better(const flood_vote_t *a, const flood_vote_t *b)
+{
+    if(a->ecc != b->ecc)
+        return a->ecc < b->ecc;
+    if(a->load != b->load)
+        return a->load < b->load;
+    return a->rank > b->rank;
+}
+
+
+/*
+* Sends 'FLOOD <round> <leader> <ecc> <load>' to every neighbor, or 'FLOOD_END <leader> <1 if you're my parent>' after the last round.
+*/
+static void flood_send(library_t *library)
+{
+    char buffer_send[BUF_SIZE];
+    int i, neighbor;
+
+
+    for(i = 0; i < 4; i++)
+    {
+        neighbor = grid_neighbor(library, i);
+        if(neighbor == 0)
+            continue;
 
         memset(buffer_send, 0, sizeof(buffer_send));
-        strcpy(buffer_send, "LE_LIBR_DONE");
-        for(i = 0; i < library->children_num; i++)
+        if(library->flood_round <= library->flood_rounds)
         {
-            MPI_Send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, library->children[i], TAG_LE_LIBRARIES_DONE, MPI_COMM_WORLD);
+            strcpy(buffer_send, "FLOOD ");
+            strcat_int(buffer_send, library->flood_round);
+            strcat(buffer_send, " ");
+            strcat_int(buffer_send, library->flood_leader.rank);
+            strcat(buffer_send, " ");
+            strcat_int(buffer_send, library->flood_leader.ecc);
+            strcat(buffer_send, " ");
+            strcat_int(buffer_send, library->flood_leader.load);
+            comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, neighbor, TAG_LIB_LEADER, MPI_COMM_WORLD);
         }
-        // Don't let the coordinator know LE is done yet. 
-        // Wait for 'ACK' so that the output is clear and we can see the whole tree in the console.
-        for(i = 0; i < library->children_num; i++)
+        else
         {
-            memset(buffer_send, 0, sizeof(buffer_send));
-            MPI_Recv(buffer_send, sizeof(buffer_send), MPI_CHAR, library->children[i], TAG_ACK, MPI_COMM_WORLD, &status);
-            if(strcmp(buffer_send, "ACK") != 0)
+            strcpy(buffer_send, "FLOOD_END ");
+            strcat_int(buffer_send, library->leader_rank);
+            strcat(buffer_send, neighbor == library->parent_rank ? " 1" : " 0");
+            comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, neighbor, TAG_LIB_PARENT, MPI_COMM_WORLD);
+        }
+    }
+}
+
+
+/*
+* The subtree is done when every neighbor said if it's our child and every child echoed.
+*/
+static void flood_check_done(library_t *library)
+{
+    char buffer_send[BUF_SIZE];
+
+
+    if(library->flood_round != library->flood_rounds + 1 || library->flood_ends < grid_degree(library)
+       || library->flood_echoes < library->children_num)
+        return;
+
+    library->flood_round++;             // Done, for good.
+    if(library->parent_rank == library->rank)
+    {
+        le_libraries_won(library);
+        return;
+    }
+
+    print_debug("Rank %d: the subtree of the flood is done, sending 'FLOOD_ECHO' to rank %d", library->rank, library->parent_rank);
+    memset(buffer_send, 0, sizeof(buffer_send));
+    strcpy(buffer_send, "FLOOD_ECHO");
+    comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, library->parent_rank, TAG_LIB_PARENT, MPI_COMM_WORLD);
+}
+
+
+/*
+* Ends the rounds that have the ids of all the neighbors.
+*/
+static void flood_advance(library_t *library)
+{
+    int i, parity, got;
+
+
+    while(library->flood_round >= 1 && library->flood_round <= library->flood_rounds)
+    {
+        parity = library->flood_round % 2;
+        for(got = 0, i = 0; i < 4; i++)
+            got += grid_neighbor(library, i) != 0 && library->flood_recv[parity][i].rank != 0;
+        if(got < grid_degree(library))
+            return;
+
+        for(i = 0; i < 4; i++)
+        {
+            if(library->flood_recv[parity][i].rank != 0 && flood_better(&library->flood_recv[parity][i], &library->flood_leader))
             {
-                print_error("Leader didn't get 'ACK' from child rank %d but instead got %s", library->children[i], buffer_send);
+                library->flood_leader = library->flood_recv[parity][i];
+                library->leader_rank = library->flood_leader.rank;
+                library->parent_rank = grid_neighbor(library, i);
             }
-            print_debug("Leader got 'ACK' from child rank %d", library->children[i]);
+            library->flood_recv[parity][i].rank = 0;
         }
-    #endif
+
+        library->flood_round++;
+        flood_send(library);
+    }
+
+    flood_check_done(library);
+}
 
 
-        // Send to coordinator 'LE_LIBR_DONE'
-        print_debug("Leader rank %d sending 'LE_LIBR_DONE' to coordinator", library->rank);
-        memset(buffer_send, 0, sizeof(buffer_send));
-        strcpy(buffer_send, "LE_LIBR_DONE");
-        MPI_Send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, COORDINATOR_RANK, TAG_LE_LIBRARIES_DONE, MPI_COMM_WORLD);
+/*
+* Copies this library has lent so far.
+*/
+static int library_load(library_t *library)
+{
+    book_library_t *book;
+    int load = 0;
+
+
+    for(book = library->book_list; book != NULL; book = book->next)
+        load += book->loaned_num;
+    return load;
+}
+
+
+static void event_flood_start(library_t *library)
+{
+    int N = library->flood_rounds / 2 + 1;
+
+
+    if(library->flood_round != 0)
+        return;
+
+    library->flood_leader.rank = library->rank;
+    if(lib_election == LIB_ELECTION_CENTER)
+    {
+        library->flood_leader.ecc = (library->x > N - 1 - library->x ? library->x : N - 1 - library->x)
+                                    + (library->y > N - 1 - library->y ? library->y : N - 1 - library->y);
+        library->flood_leader.load = library_load(library);
     }
+    library->parent_rank = library->rank;
+    library->flood_round = 1;
+    flood_send(library);
+    flood_advance(library);
+}
 
-    return 0;
+
+/*
+* Handle the event "FLOOD <round> <leader> <ecc> <load>". A neighbor is at most one round ahead of us, it needs our id for the round
+* before to move on. The first one starts the election if 'START_LEADER_ELECTION' didn't come yet.
+*/
+void event_recv_flood(library_t *library, int sender_rank, int round, flood_vote_t *vote)
+{
+    int i;
+
+
+    event_flood_start(library);
+
+    for(i = 0; i < 4; i++)
+    {
+        if(grid_neighbor(library, i) == sender_rank)
+            library->flood_recv[round % 2][i] = *vote;
+    }
+    flood_advance(library);
+}
+
+
+/*
+* Handle the event "FLOOD_END <leader> <is_parent>". It can come before our last round, the neighbor already knows the leader.
+*/
+void event_recv_flood_end(library_t *library, int sender_rank, int is_parent)
+{
+    library->flood_ends++;
+    if(is_parent)
+    {
+        print_debug("Rank %d got 'FLOOD_END' from rank %d, adding as a child", library->rank, sender_rank);
+        library->children = (int *) MyRealloc(library->children, (library->children_num + 1) * sizeof(int));
+        library->children[library->children_num++] = sender_rank;
+    }
+    flood_check_done(library);
+}
+
+
+void event_recv_flood_echo(library_t *library)
+{
+    library->flood_echoes++;
+    flood_check_done(library);
 }
 
 
@@ -235,6 +509,12 @@ int explore(library_t *library)
 */
 void event_lib_start_le(library_t *library)
 {
+    if(lib_election != LIB_ELECTION_DFS)
+    {
+        event_flood_start(library);
+        return;
+    }
+
     // "upon receiving no message:"
     if(library->parent_rank == 0)
     {
@@ -285,7 +565,7 @@ void event_recv_leader(library_t *library, int sender_rank, int new_leader_rank)
         memset(buffer_send, 0, sizeof(buffer_send));
         strcpy(buffer_send, "ALREADY ");
         strcat_int(buffer_send, library->leader_rank);
-        MPI_Send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, sender_rank, TAG_LIB_ALREADY, MPI_COMM_WORLD);
+        comm_send(buffer_send, strlen(buffer_send) + 1, MPI_CHAR, sender_rank, TAG_LIB_ALREADY, MPI_COMM_WORLD);
     }
     // else leader > new-id and the DFS for new-id is stalled
 }
@@ -366,20 +646,23 @@ void event_le_done(library_t *library)
         // Send ACK to parent.
         memset(buffer, 0, sizeof(buffer));
         strcpy(buffer, "ACK");
-        MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, library->parent_rank, TAG_ACK, MPI_COMM_WORLD);
+        comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, library->parent_rank, TAG_ACK, MPI_COMM_WORLD);
         return;
     }
     
     
 #ifdef DEBUG_ENABLED
     // Use buffer to create a print with all my children.
-    sprintf(buffer, "---Library rank %d children: ", library->rank);
-    for(i = 0; i < library->children_num; i++)
+    if(log_on(LOG_LEVEL_DEBUG))
     {
-        strcat_int(buffer, library->children[i]);
-        strcat(buffer, "-");
+        sprintf(buffer, "---Library rank %d children: ", library->rank);
+        for(i = 0; i < library->children_num; i++)
+        {
+            strcat_int(buffer, library->children[i]);
+            strcat(buffer, "-");
+        }
+        print_debug("%s--", buffer);
     }
-    print_debug("%s--", buffer);
 #endif
     
 
@@ -387,14 +670,14 @@ void event_le_done(library_t *library)
     strcpy(buffer, "LE_LIBR_DONE");
     for(i = 0; i < library->children_num; i++)
     {
-        MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, library->children[i], TAG_LE_LIBRARIES_DONE, MPI_COMM_WORLD);
+        comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, library->children[i], TAG_LE_LIBRARIES_DONE, MPI_COMM_WORLD);
     }
     
     // Wait for 'ACK' so that the output is clear and we can see the whole tree in the console.
     for(i = 0; i < library->children_num; i++)
     {
         memset(buffer, 0, sizeof(buffer));
-        MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, library->children[i], TAG_ACK, MPI_COMM_WORLD, &status);
+        comm_recv(buffer, sizeof(buffer), MPI_CHAR, library->children[i], TAG_ACK, MPI_COMM_WORLD, &status);
         if(strcmp(buffer, "ACK") != 0)
         {
             print_error("Rank %d didn't get 'ACK' from child rank %d but instead got %s", library->rank, library->children[i], buffer);
@@ -405,7 +688,98 @@ void event_le_done(library_t *library)
     // Got ACK from children. Send ACK to parent.
     memset(buffer, 0, sizeof(buffer));
     strcpy(buffer, "ACK");
-    MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, library->parent_rank, TAG_ACK, MPI_COMM_WORLD);
+    comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, library->parent_rank, TAG_ACK, MPI_COMM_WORLD);
+}
+
+
+static int server_threads = 1;
+
+
+/*
+* '--server-threads <T>': the library handles LEND_BOOK, BOOK_REQUEST and DONATE_BOOK in T worker threads.
+*/
+void server_set_threads(int threads)
+{
+    server_threads = threads;
+}
+
+
+/*
+* The locks of a threaded library (see library_t), they do nothing otherwise.
+*/
+static void lib_lock(library_t *library, pthread_mutex_t *lock)
+{
+    if(library->threaded)
+        pthread_mutex_lock(lock);
+}
+
+
+static void lib_unlock(library_t *library, pthread_mutex_t *lock)
+{
+    if(library->threaded)
+        pthread_mutex_unlock(lock);
+}
+
+
+static pthread_mutex_t *book_lock(library_t *library, int b_id)
+{
+    return &library->book_locks[(unsigned)b_id % LIB_BOOK_LOCKS];
+}
+
+
+static void catalog_lock(library_t *library, int write)
+{
+    if(!library->threaded)
+        return;
+
+    if(write)
+        pthread_rwlock_wrlock(&library->catalog_lock);
+    else
+        pthread_rwlock_rdlock(&library->catalog_lock);
+}
+
+
+static void catalog_unlock(library_t *library)
+{
+    if(library->threaded)
+        pthread_rwlock_unlock(&library->catalog_lock);
+}
+
+
+/*
+* The copies of a book, in the shared catalog if it's there (see catalog_shm.h).
+*/
+static int book_available(book_library_t *book)
+{
+    if(book->shared != NULL)
+        return atomic_load(&book->shared->available);
+    return book->currently_available;
+}
+
+
+/*
+* @return How many of n_copies were taken.
+*/
+static int book_take(book_library_t *book, int n_copies)
+{
+    int taken;
+
+
+    if(book->shared != NULL)
+        return catalog_shm_take(book->shared, n_copies);
+
+    taken = n_copies < book->currently_available ? n_copies : book->currently_available;
+    book->currently_available -= taken;
+    return taken;
+}
+
+
+static void book_put(book_library_t *book, int n_copies)
+{
+    if(book->shared != NULL)
+        atomic_fetch_add(&book->shared->available, n_copies);
+    else
+        book->currently_available += n_copies;
 }
 
 
@@ -431,191 +805,631 @@ book_library_t *search_book(library_t *library, int b_id)
 
 
 /*
-* Handles the 'LEND_BOOK <b_id>' message from a client. Searches in the book list of the library,
-* - if the book is found send 'GET_BOOK <cost>' to client.
-* - else send 'FIND_BOOK <b_id>' to library leader, get 'FOUND_BOOK <l_id`>' and send 'BOOK_REQUEST <b_id> <c_id> <l_id>'
-*
-* Note: i don't include <l_id> in the message 'BOOK_REQUEST' my rank can be found by "status.MPI_SOURCE"
-* Note: in the 'BOOK_REQUEST' message instead of c_id i'm sending the client MPI rank.
-* Note: i've modified 'ACK_TB' to include the cost of the book.
+* @return The pending lookup for b_id or NULL if there is no lookup in flight for that book.
 */
-void event_lend_book(library_t *library, int b_id, int client_rank, int N)
+pending_request_t *search_pending(library_t *library, int b_id)
 {
-    char buffer[BUF_SIZE];
-    book_library_t *book;
-    MPI_Status status;
+    pending_request_t *tmp;
 
 
-    book = search_book(library, b_id);
-    print_debug("Library rank %d got 'LEND_BOOK %d' from client rank %d", library->rank, b_id, client_rank);
-
-    // If i have an available copy of the book
-    if(book != NULL && book->currently_available != 0)
+    tmp = library->pending;
+    while(tmp != NULL)
     {
-        memset(buffer, 0, sizeof(buffer));
-        strcpy(buffer, "GET_BOOK ");
-        strcat_int(buffer, book->book.cost);
-        print_info("Library rank %d sending book %d to client %d", library->rank, book->book.id, client_rank);
-        MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, client_rank, TAG_TAKE_BOOK, MPI_COMM_WORLD);
-
-        book->currently_available--;
-        book->loaned_num++;
-        print_info("Library rank %d stats for book %d are: currently_available=%d, loaned_num=%d.", library->rank, book->book.id, book->currently_available, book->loaned_num);
+        if(tmp->b_id == b_id)
+            return tmp;
+        tmp = tmp->next;    // step
     }
-    else
-    {
-        // if you're the leader library don't send a message to yourself
-        if(library->rank == library->leader_rank)
-        {
-            int l_id;
 
-            l_id = b_id / N;        // Calculate the l_id that b_id should belong to.
-            
-            print_info(HRED"I'm the library leader"reset);
-            // Simulate a message from yourself and continue with the function
-            memset(buffer, 0, sizeof(buffer));
-            strcpy(buffer, "FOUND_BOOK ");
-            strcat_int(buffer, l_id+1);
-        }
-        else
-        {
-            // Send 'FIND_BOOK' to library leader.
-            memset(buffer, 0, sizeof(buffer));
-            strcpy(buffer, "FIND_BOOK ");
-            strcat_int(buffer, b_id);
-            print_info("Library rank %d doesn't have the book %d, sending 'FIND_BOOK' to library leader.", library->rank, b_id);
-            MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, library->leader_rank, TAG_FIND_BOOK, MPI_COMM_WORLD);
+    return NULL;
+}
 
-            memset(buffer, 0, sizeof(buffer));
-            MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, library->leader_rank, TAG_FIND_BOOK, MPI_COMM_WORLD, &status);
-        }
 
+/*
+* Appends the given client rank at the end of a FIFO of waiters.
+* @param since When the client started waiting (transport_wtime()).
+*/
+void add_waiter(waiter_queue_t *queue, int client_rank, double since)
+{
+    waiter_t *waiter;
 
 
-        char **string_array = split_string(buffer, strlen(buffer), ' ');
-        if(strcmp(string_array[0], "FOUND_BOOK") == 0)    // Leader found the library rank that has the b_id
-        {
-            int lib_rank = atoi(string_array[1]);
+    waiter = (waiter_t *) MyCalloc(1, sizeof(waiter_t));
+    waiter->client_rank = client_rank;
+    waiter->since = since;
+    waiter->next = NULL;
 
+    if(queue->head == NULL)
+        queue->head = waiter;
+    else
+        queue->tail->next = waiter;
 
-            // Sanity check
-            if(library->rank == lib_rank)
-            {
-                print_warn(UYEL"Leader library returned my rank for the event '%s'. (Maybe this this book should be in my list but is not yet added?)"reset, buffer);
-            }
-            
-            
-            // In either case send a fail message to client.
-            if(lib_rank == -1 || library->rank == lib_rank)
-            {
-                // Send to 'ACK_TB -1 0' to client
-                memset(buffer, 0, sizeof(buffer));
-                strcpy(buffer, "ACK_TB -1 0");
-                print_info("Library rank %d didn't find the book %d, sending to client %d: %s", library->rank, b_id, client_rank, buffer);
-                MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, client_rank, TAG_TAKE_BOOK, MPI_COMM_WORLD);
-            }
-            else if(lib_rank != -1)
-            {
-                // Send 'BOOK_REQUEST <b_id> <c_id> <l_id>' the l_id` that the leader gave me
-                // Note: i don't include <l_id> in the message my rank can be found by "status.MPI_SOURCE"
-                // Note: instead of c_id i'm sending the client MPI rank.
-                memset(buffer, 0, sizeof(buffer));
-                strcpy(buffer, "BOOK_REQUEST ");
-                strcat_int(buffer, b_id);
-                strcat(buffer, " ");
-                strcat_int(buffer, client_rank);
-                print_info("Library rank %d sending 'BOOK_REQUEST %d %d' to rank %d (l_id %d) that the leader gave me.", library->rank, b_id, client_rank, lib_rank, lib_rank-1);
-                MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, lib_rank, TAG_BOOK_REQUEST, MPI_COMM_WORLD);
-
-
-                // Wait for 'ACK_TB <b_id> <cost>'
-                memset(buffer, 0, sizeof(buffer));
-                MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, lib_rank, TAG_BOOK_REQUEST, MPI_COMM_WORLD, &status);
-                print_debug("Library rank %d got from rank %d (and will forward to client %d): %s", library->rank, lib_rank, client_rank, buffer);
-
-                // Send 'ACK_TB <b_id> <cost>' to client
-                MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, client_rank, TAG_TAKE_BOOK, MPI_COMM_WORLD);
-            }
-            else
-            {
-                print_error("Something went wrong, got: %s", buffer);
-            }
+    queue->tail = waiter;
+    queue->size++;
+}
+
+
+/*
+* Removes the first waiter of the FIFO.
+* @param since If not NULL it gets the time the removed client started waiting.
+* @return The client rank of the removed waiter or -1 if the FIFO is empty.
+*/
+int pop_waiter(waiter_queue_t *queue, double *since)
+{
+    waiter_t *waiter;
+    int client_rank;
+
+
+    waiter = queue->head;
+    if(waiter == NULL)
+        return -1;
+
+    queue->head = waiter->next;
+    if(queue->head == NULL)
+        queue->tail = NULL;
+    queue->size--;
+
+    client_rank = waiter->client_rank;
+    if(since != NULL)
+        *since = waiter->since;
+    free(waiter);
+
+    return client_rank;
+}
+
+
+/*
+* Unlinks the given lookup from the pending list of the library and releases its memory (and any waiters left).
+*/
+void remove_pending(library_t *library, pending_request_t *request)
+{
+    pending_request_t *tmp, *prev;
+
+
+    prev = NULL;
+    tmp = library->pending;
+    while(tmp != NULL && tmp != request)
+    {
+        prev = tmp;
+        tmp = tmp->next;
+    }
+
+    if(tmp == NULL)
+        return;
+
+    if(prev == NULL)
+        library->pending = tmp->next;
+    else
+        prev->next = tmp->next;
+
+    while(pop_waiter(&tmp->waiters, NULL) != -1);
+    free(tmp);
+}
+
+
+/*
+* Sends a reply to a client that waited on a lookup, with its trace context (see hop_trace.h). The client whose request
+* is the current trace gets that, a client that was coalesced on the lookup gets its own context with a 'W' hop.
+*/
+void send_to_waiter(const char *buffer, int client_rank, hop_trace_t *trace)
+{
+    char reply[BUF_SIZE];
+
+
+    memset(reply, 0, sizeof(reply));
+    strcpy(reply, buffer);
+    if(trace->id != 0 && trace->id == hop_trace_current()->id)
+    {
+        hop_trace_attach(reply, hop_trace_current());
+    }
+    else if(trace->id != 0)
+    {
+        hop_trace_add_hop(trace, 'W');
+        hop_trace_attach(reply, trace);
+    }
+
+    comm_send(reply, strlen(reply) + 1, MPI_CHAR, client_rank, TAG_TAKE_BOOK, MPI_COMM_WORLD);
+}
+
+
+/*
+* Ends a lookup that couldn't find a copy for every client that waits on it and drops the lookup.
+* If the book is in our list (all copies are loaned) the clients go to the waitlist of the book and get 'WAITLISTED <b_id>',
+* they'll get the book pushed to them with 'GET_BOOK' when a copy comes back. Otherwise they get 'ACK_TB -1 0'.
+*/
+void fail_pending(library_t *library, pending_request_t *request)
+{
+    char buffer[BUF_SIZE];
+    book_library_t *book;
+    hop_trace_t trace;
+    int client_rank;
+    double since;
+
+
+    book = search_book(library, request->b_id);
+
+    memset(buffer, 0, sizeof(buffer));
+    if(book != NULL)
+    {
+        strcpy(buffer, "WAITLISTED ");
+        strcat_int(buffer, request->b_id);
+    }
+    else
+    {
+        strcpy(buffer, "ACK_TB -1 0");
+    }
+
+    while(request->waiters.head != NULL)
+    {
+        trace = request->waiters.head->trace;
+        client_rank = pop_waiter(&request->waiters, &since);
+
+        if(book != NULL)
+        {
+            lib_lock(library, book_lock(library, request->b_id));
+            add_waiter(&book->waitlist, client_rank, since);
+            lib_unlock(library, book_lock(library, request->b_id));
+            print_info("Library rank %d has no copies of book %d, client %d is number %d on the waitlist.", library->rank, request->b_id, client_rank, book->waitlist.size);
         }
         else
         {
-            print_error("Library rank %d was expecting 'FOUND_BOOK' from leader but got %s", library->rank, buffer);
+            print_info("Library rank %d didn't find the book %d, sending to client %d: %s", library->rank, request->b_id, client_rank, buffer);
         }
+        send_to_waiter(buffer, client_rank, &trace);
+    }
+
+    remove_pending(library, request);
+}
+
+
+/*
+* Lends the available copies of a book to the clients on its waitlist, oldest first. The book is pushed to the client
+* with 'GET_BOOK <cost> <b_id> <epoch>' (tag TAG_BOOK_AVAILABLE), the client doesn't ask again.
+* A threaded library calls it with the lock of the book.
+*/
+void serve_waitlist(library_t *library, book_library_t *book)
+{
+    char buffer[BUF_SIZE];
+    int client_rank;
+    double since = 0, waited;
+
 
-        // Free memory
-        free_string_array(string_array);
-        string_array = NULL;
+    while(book->waitlist.size > 0 && book_take(book, 1) == 1)
+    {
+        client_rank = pop_waiter(&book->waitlist, &since);
+
+        book->loaned_num++;
+
+        waited = transport_wtime() - since;
+        lib_lock(library, &library->counters_lock);
+        epoch_counter_add(&library->loans, library->epoch, 1);
+        library->waitlist_served++;
+        library->waitlist_wait_time += waited;
+        lib_unlock(library, &library->counters_lock);
+
+        memset(buffer, 0, sizeof(buffer));
+        strcpy(buffer, "GET_BOOK ");
+        strcat_int(buffer, book->book.cost);
+        strcat(buffer, " ");
+        strcat_int(buffer, book->book.id);
+        strcat(buffer, " ");
+        strcat_int(buffer, library->epoch);
+        print_info("Library rank %d sending waitlisted book %d to client %d after %.6f s (%d still waiting).", library->rank, book->book.id, client_rank, waited, book->waitlist.size);
+        comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, client_rank, TAG_BOOK_AVAILABLE, MPI_COMM_WORLD);
     }
 }
 
 
+/*
+* Sends 'BOOK_REQUEST <b_id> <c_id> <n_copies>' to the library the leader gave us, asking for one copy per waiter.
+* Note: instead of c_id i'm sending the MPI rank of the first client in the FIFO.
+*/
+void send_book_request(library_t *library, pending_request_t *request)
+{
+    char buffer[BUF_SIZE];
+
+
+    request->requested = request->waiters.size;
+
+    memset(buffer, 0, sizeof(buffer));
+    strcpy(buffer, "BOOK_REQUEST ");
+    strcat_int(buffer, request->b_id);
+    strcat(buffer, " ");
+    strcat_int(buffer, request->waiters.head->client_rank);
+    strcat(buffer, " ");
+    strcat_int(buffer, request->requested);
+    hop_trace_attach(buffer, hop_trace_current());
+    print_info("Library rank %d sending '%s' to rank %d (l_id %d) that the leader gave me.", library->rank, buffer, request->lib_rank, request->lib_rank-1);
+    comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, request->lib_rank, TAG_BOOK_REQUEST, MPI_COMM_WORLD);
+}
+
+
 /*
 * This handles the 'FIND_BOOK <b_id>' message that is sent to the library leader.
 * It calculates the l_id` of the library that has the b_id and returns the rank of that
-* library (l_id` + 1) to the requesting library with the message 'FOUND_BOOK <rank>'. 
+* library (l_id` + 1) to the requesting library with the message 'FOUND_BOOK <rank> <b_id>'.
 */
 void event_find_book(library_t *library, int b_id, int request_lib_rank, int N)
 {
     char buffer[BUF_SIZE];
     int l_id;
 
-    l_id = b_id / N;
+    l_id = BOOK_OWNER_LID(b_id, N);
     memset(buffer, 0, sizeof(buffer));
     strcpy(buffer, "FOUND_BOOK ");
     strcat_int(buffer, l_id+1);
-    print_info("Leader library calculated that rank %d (l_id %d) has the book %d, sending 'FIND_BOOK' to library rank %d.", l_id + 1, l_id, b_id, request_lib_rank);
-    MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, request_lib_rank, TAG_FIND_BOOK, MPI_COMM_WORLD);
+    strcat(buffer, " ");
+    strcat_int(buffer, b_id);
+    hop_trace_attach(buffer, hop_trace_current());
+    print_info("Leader library calculated that rank %d (l_id %d) has the book %d, sending 'FOUND_BOOK' to library rank %d.", l_id + 1, l_id, b_id, request_lib_rank);
+    comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, request_lib_rank, TAG_FIND_BOOK, MPI_COMM_WORLD);
+}
+
+
+/*
+* Handles the 'FOUND_BOOK <rank> <b_id>' answer of the leader. Sends one 'BOOK_REQUEST' for all the clients
+* that wait on b_id, or fails them if the leader pointed back to us.
+*/
+void event_found_book(library_t *library, int b_id, int lib_rank)
+{
+    pending_request_t *request;
+
+
+    request = search_pending(library, b_id);
+    if(request == NULL)
+    {
+        print_error("Library rank %d got 'FOUND_BOOK %d %d' but has no lookup in flight for that book.", library->rank, lib_rank, b_id);
+        return;
+    }
+
+    // Sanity check
+    if(library->rank == lib_rank)
+    {
+        print_warn(UYEL"Leader library returned my rank for the book %d. (Maybe this this book should be in my list but is not yet added?)"reset, b_id);
+    }
+
+    // In either case send a fail message to the clients.
+    if(lib_rank == -1 || library->rank == lib_rank)
+    {
+        fail_pending(library, request);
+        return;
+    }
+
+    request->lib_rank = lib_rank;
+    send_book_request(library, request);
+}
+
+
+/*
+* '--shared-catalog': takes a copy of b_id straight from the window of another library of this node and answers the
+* client with 'ACK_TB <b_id> <cost> <lender_rank> <epoch>' as if the lender had granted it to a 'BOOK_REQUEST' (the
+* client returns it to the lender). We count the loan, with our epoch.
+* @return 1 if the client got the book, 0 if the lookup has to go through the messages.
+*/
+static int claim_shared_copy(library_t *library, int b_id, int client_rank, int N)
+{
+    char buffer[BUF_SIZE];
+    int lender_l_id, cost;
+
+
+    if(!catalog_shm_claim(b_id, BOOK_OWNER_LID(b_id, N), &lender_l_id, &cost))
+        return 0;
+
+    lib_lock(library, &library->counters_lock);
+    epoch_counter_add(&library->loans, library->epoch, 1);
+    library->shm_claims++;
+    lib_unlock(library, &library->counters_lock);
+
+    memset(buffer, 0, sizeof(buffer));
+    strcpy(buffer, "ACK_TB ");
+    strcat_int(buffer, b_id);
+    strcat(buffer, " ");
+    strcat_int(buffer, cost);
+    strcat(buffer, " ");
+    strcat_int(buffer, lender_l_id + 1);
+    strcat(buffer, " ");
+    strcat_int(buffer, library->epoch);
+    hop_trace_attach(buffer, hop_trace_current());
+    print_info("Library rank %d took book %d from the shared catalog of rank %d, sending to client %d: %s", library->rank, b_id, lender_l_id + 1, client_rank, buffer);
+    comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, client_rank, TAG_TAKE_BOOK, MPI_COMM_WORLD);
+
+    return 1;
+}
+
+
+/*
+* Starts the lookup for a book that this library doesn't have available: send 'FIND_BOOK <b_id>' to library leader,
+* get 'FOUND_BOOK <l_id`> <b_id>' and send 'BOOK_REQUEST <b_id> <c_id> <n_copies>'.
+*
+* The lookup doesn't block the library. Misses for a b_id that already has a lookup in flight don't start a new one,
+* the client is queued on that lookup and is answered when the 'FOUND_BOOK'/'ACK_TB' replies arrive in the main loop.
+* With a shared catalog, a book of a library on the same node is taken from its window without any messages.
+*/
+void start_lookup(library_t *library, int b_id, int client_rank, int N)
+{
+    char buffer[BUF_SIZE];
+    pending_request_t *request;
+
+
+    if(claim_shared_copy(library, b_id, client_rank, N))
+        return;
+
+    // A lookup for this book is already in flight, wait for its answer.
+    lib_lock(library, &library->pending_lock);
+    request = search_pending(library, b_id);
+    if(request != NULL)
+    {
+        add_waiter(&request->waiters, client_rank, transport_wtime());
+        request->waiters.tail->trace = *hop_trace_current();
+        print_info("Library rank %d already looks for book %d, client %d waits on that lookup (%d waiters).", library->rank, b_id, client_rank, request->waiters.size);
+        lib_unlock(library, &library->pending_lock);
+        return;
+    }
+
+    request = (pending_request_t *) MyCalloc(1, sizeof(pending_request_t));
+    request->b_id = b_id;
+    add_waiter(&request->waiters, client_rank, transport_wtime());
+    request->waiters.tail->trace = *hop_trace_current();
+    request->next = library->pending;
+    library->pending = request;
+
+
+    // if you're the leader library don't send a message to yourself
+    if(library->rank == library->leader_rank)
+    {
+        print_info(HRED"I'm the library leader"reset);
+        // Simulate the 'FOUND_BOOK' answer.
+        event_found_book(library, b_id, BOOK_OWNER_LID(b_id, N) + 1);
+    }
+    else
+    {
+        // Send 'FIND_BOOK' to library leader.
+        memset(buffer, 0, sizeof(buffer));
+        strcpy(buffer, "FIND_BOOK ");
+        strcat_int(buffer, b_id);
+        hop_trace_attach(buffer, hop_trace_current());
+        print_info("Library rank %d doesn't have the book %d, sending 'FIND_BOOK' to library leader.", library->rank, b_id);
+        comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, library->leader_rank, TAG_FIND_BOOK, MPI_COMM_WORLD);
+    }
+    lib_unlock(library, &library->pending_lock);
+}
+
+
+/*
+* Handles the 'LEND_BOOK <b_id>' message from a client. Searches in the book list of the library,
+* - if the book is found send 'GET_BOOK <cost> <epoch>' to client.
+* - else start a lookup for it (see start_lookup()).
+*
+* Note: i don't include <l_id> in the message 'BOOK_REQUEST' my rank can be found by "status.MPI_SOURCE"
+* Note: in the 'BOOK_REQUEST' message instead of c_id i'm sending the client MPI rank.
+* Note: i've modified 'ACK_TB' to include the cost of the book.
+*/
+void event_lend_book(library_t *library, int b_id, int client_rank, int N)
+{
+    char buffer[BUF_SIZE];
+    book_library_t *book;
+    int lent = 0, available = 0, loaned = 0;
+
+
+    catalog_lock(library, 0);
+    book = search_book(library, b_id);
+    print_debug("Library rank %d got 'LEND_BOOK %d' from client rank %d", library->rank, b_id, client_rank);
+
+    // Take a copy, if i have one available.
+    lib_lock(library, book_lock(library, b_id));
+    if(book != NULL && book_take(book, 1) == 1)
+    {
+        book->loaned_num++;
+        available = book_available(book);
+        loaned = book->loaned_num;
+        lent = 1;
+
+        lib_lock(library, &library->counters_lock);
+        epoch_counter_add(&library->loans, library->epoch, 1);
+        lib_unlock(library, &library->counters_lock);
+    }
+    lib_unlock(library, book_lock(library, b_id));
+
+    if(lent)
+    {
+        memset(buffer, 0, sizeof(buffer));
+        strcpy(buffer, "GET_BOOK ");
+        strcat_int(buffer, book->book.cost);
+        strcat(buffer, " ");
+        strcat_int(buffer, library->epoch);
+        hop_trace_attach(buffer, hop_trace_current());
+        print_info("Library rank %d sending book %d to client %d", library->rank, book->book.id, client_rank);
+        comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, client_rank, TAG_TAKE_BOOK, MPI_COMM_WORLD);
+        print_info("Library rank %d stats for book %d are: currently_available=%d, loaned_num=%d.", library->rank, book->book.id, available, loaned);
+    }
+    else
+    {
+        start_lookup(library, b_id, client_rank, N);
+    }
+    catalog_unlock(library);
+}
+
+
+/*
+* Handles the 'LEND_BOOKS <b_id> [<b_id> ...]' message from a client. The available books are lent right away and
+* answered with a single 'ACK_LB <n_pending> <epoch> [<b_id> <cost> ...]', the rest start a lookup each and will be answered
+* later with an 'ACK_TB' per book, <n_pending> tells the client how many of those to expect.
+*/
+void event_lend_books(library_t *library, char **str_array, int client_rank, int N)
+{
+    char buffer[BUF_SIZE], books_buf[BUF_SIZE];
+    book_library_t *book;
+    int i, b_id, n_pending;
+    int *missing;
+
+
+    missing = (int *) MyCalloc(get_string_array_size(str_array), sizeof(int));
+    memset(books_buf, 0, sizeof(books_buf));
+    n_pending = 0;
+    for(i = 1; str_array[i] != NULL; i++)
+    {
+        b_id = atoi(str_array[i]);
+        book = search_book(library, b_id);
+
+        if(book != NULL && book_take(book, 1) == 1)
+        {
+            book->loaned_num++;
+            epoch_counter_add(&library->loans, library->epoch, 1);
+            print_info("Library rank %d lends book %d to client %d: currently_available=%d, loaned_num=%d.", library->rank, b_id, client_rank, book_available(book), book->loaned_num);
+
+            strcat(books_buf, " ");
+            strcat_int(books_buf, b_id);
+            strcat(books_buf, " ");
+            strcat_int(books_buf, book->book.cost);
+        }
+        else
+        {
+            missing[n_pending++] = b_id;
+        }
+    }
+
+
+    // Reply with the books that we had, before any 'ACK_TB' of the lookups can reach the client.
+    memset(buffer, 0, sizeof(buffer));
+    strcpy(buffer, "ACK_LB ");
+    strcat_int(buffer, n_pending);
+    strcat(buffer, " ");
+    strcat_int(buffer, library->epoch);
+    strcat(buffer, books_buf);
+    print_info("Library rank %d sending '%s' to client %d", library->rank, buffer, client_rank);
+    comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, client_rank, TAG_TAKE_BOOK, MPI_COMM_WORLD);
+
+
+    for(i = 0; i < n_pending; i++)
+    {
+        start_lookup(library, missing[i], client_rank, N);
+    }
+
+    free(missing);
 }
 
 
 /*
-* This handles the 'BOOK_REQUEST <b_id> <c_id> <l_id>' message that is sent to a 
+* This handles the 'BOOK_REQUEST <b_id> <c_id> <n_copies>' message that is sent to a 
 * library l_id` if the library l_id doesn't have the requested b_id book.
 *
-* Reply to the l_id library with 'ACK_TB <b_id>' where b_id could be -1 if i don't have the book.
+* Reply to the l_id library with 'ACK_TB <b_id> <cost> <granted> <epoch>' where <granted> is how many copies (at most n_copies)
+* were loaned, 0 if i don't have the book, and <epoch> is the epoch the copies were loaned in.
 */
-void event_book_request(library_t *library, int b_id, int client_rank, int lib_rank)
+void event_book_request(library_t *library, int b_id, int client_rank, int n_copies, int lib_rank)
 {
     char buffer[BUF_SIZE];
     book_library_t *book;
-    int book_id, book_cost;
+    int book_cost, granted;
 
 
+    catalog_lock(library, 0);
     book = search_book(library, b_id);
 
-    // Send 'ACK_TB <b_id> <cost>' to l_id (don't forget to convert to MPI rank) if you have available copies of b_id.
-    if(book != NULL && book->currently_available != 0)
+    // Send 'ACK_TB <b_id> <cost> <granted> <epoch>' to l_id (don't forget to convert to MPI rank) if you have available copies of b_id.
+    lib_lock(library, book_lock(library, b_id));
+    granted = book != NULL ? book_take(book, n_copies) : 0;
+    if(granted > 0)
     {
-        book_id = book->book.id;
         book_cost = book->book.cost;
 
-        book->currently_available--;
-        book->loaned_num++;
-        print_debug("Library rank %d has book %d and updated the counters: currently_available to %d and loaned_num to %d", library->rank, book_id, book->currently_available, book->loaned_num);
+        book->loaned_num += granted;
+        lib_lock(library, &library->counters_lock);
+        epoch_counter_add(&library->loans, library->epoch, granted);
+        lib_unlock(library, &library->counters_lock);
+        print_debug("Library rank %d has book %d and updated the counters: currently_available to %d and loaned_num to %d", library->rank, b_id, book_available(book), book->loaned_num);
     }
     else
     {
-        book_id = -1;
         book_cost = 0;
     }
+    lib_unlock(library, book_lock(library, b_id));
+    catalog_unlock(library);
     
     memset(buffer, 0, sizeof(buffer));
     strcpy(buffer, "ACK_TB ");
-    strcat_int(buffer, book_id);
+    strcat_int(buffer, b_id);
     strcat(buffer, " ");
     strcat_int(buffer, book_cost);
-    print_info("Library rank %d sending 'ACK_TB <%d> <%d>' to library %d (that servers client rank %d)", library->rank, book_id, book_cost, lib_rank, client_rank);
-    MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, lib_rank, TAG_BOOK_REQUEST, MPI_COMM_WORLD);
+    strcat(buffer, " ");
+    strcat_int(buffer, granted);
+    strcat(buffer, " ");
+    strcat_int(buffer, library->epoch);
+    hop_trace_attach(buffer, hop_trace_current());
+    print_info("Library rank %d sending '%s' to library %d (that servers client rank %d)", library->rank, buffer, lib_rank, client_rank);
+    comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, lib_rank, TAG_BOOK_REQUEST, MPI_COMM_WORLD);
+}
+
+
+/*
+* Handles the 'ACK_TB <b_id> <cost> <granted> <epoch>' answer to our 'BOOK_REQUEST'. Hands one copy to each of the first
+* <granted> waiters. If the other library had enough copies for everyone we asked for, the clients that got queued
+* while the request was in flight are served with a new request, otherwise they get 'ACK_TB -1 0'.
+*/
+void event_book_reply(library_t *library, int b_id, int cost, int granted, int epoch, int lib_rank)
+{
+    char buffer[BUF_SIZE];
+    pending_request_t *request;
+    hop_trace_t trace;
+    int client_rank, i;
+
+
+    request = search_pending(library, b_id);
+    if(request == NULL)
+    {
+        print_error("Library rank %d got 'ACK_TB %d %d %d' from rank %d but has no lookup in flight for it.", library->rank, b_id, cost, granted, lib_rank);
+        return;
+    }
+
+
+    memset(buffer, 0, sizeof(buffer));
+    strcpy(buffer, "ACK_TB ");
+    strcat_int(buffer, b_id);
+    strcat(buffer, " ");
+    strcat_int(buffer, cost);
+    strcat(buffer, " ");
+    strcat_int(buffer, lib_rank);       // The client returns the copy to the library that actually lent it.
+    strcat(buffer, " ");
+    strcat_int(buffer, epoch);          // The epoch of the lender, not ours.
+    for(i = 0; i < granted && request->waiters.head != NULL; i++)
+    {
+        trace = request->waiters.head->trace;
+        client_rank = pop_waiter(&request->waiters, NULL);
+        print_debug("Library rank %d got from rank %d (and will forward to client %d): %s", library->rank, lib_rank, client_rank, buffer);
+
+        // Send 'ACK_TB <b_id> <cost> <lender_rank> <epoch>' to client
+        send_to_waiter(buffer, client_rank, &trace);
+    }
+
+
+    if(request->waiters.size > 0 && granted > 0 && granted == request->requested)
+    {
+        print_info("Library rank %d has %d more clients waiting for book %d, asking rank %d again.", library->rank, request->waiters.size, request->b_id, request->lib_rank);
+        send_book_request(library, request);
+    }
+    else
+    {
+        fail_pending(library, request);     // Also drops the request when there are no waiters left (or waitlists the rest).
+    }
 }
 
 
 /*
 * Helper function to hide the logic of adding a book to the book list of a library.
 */
+/*
+* '--shared-catalog': moves the copies of a book to our window (catalog_shm.h), if there's room.
+*/
+static void share_book(book_library_t *book)
+{
+    if(!catalog_shm_enabled() || book->shared != NULL)
+        return;
+
+    book->shared = catalog_shm_insert(book->book.id, book->book.cost, book->currently_available);
+    if(book->shared != NULL)
+        book->currently_available = 0;
+}
+
+
 void add_book(library_t *library, int b_id, int cost)
 {
     book_library_t *book;
@@ -643,6 +1457,8 @@ void add_book(library_t *library, int b_id, int cost)
         
         tmp->next = book;   // Add new entry at the end of the list.
     }
+
+    share_book(book);       // No-op before share_catalog(), it shares the books of init_library().
 }
 
 
@@ -657,7 +1473,15 @@ void event_donate_book(library_t *library, int b_id, int cost, int client_rank)
     book_library_t *book;
 
 
+    catalog_lock(library, 0);
     book = search_book(library, b_id);
+    if(book == NULL)
+    {
+        // A new entry changes the list, look again with the write lock (another worker may have added it).
+        catalog_unlock(library);
+        catalog_lock(library, 1);
+        book = search_book(library, b_id);
+    }
 
     // New book entry
     if(book == NULL)
@@ -667,17 +1491,74 @@ void event_donate_book(library_t *library, int b_id, int cost, int client_rank)
     }
     else
     {
+        lib_lock(library, book_lock(library, b_id));
         book->donated_num++;
-        book->currently_available++;
-        print_info("Library rank %d updated book entry id %d: donated_num=%d, currently_available=%d.", library->rank, book->book.id, book->donated_num, book->currently_available);
+        book_put(book, 1);
+        print_info("Library rank %d updated book entry id %d: donated_num=%d, currently_available=%d.", library->rank, book->book.id, book->donated_num, book_available(book));
+
+        serve_waitlist(library, book);
+        lib_unlock(library, book_lock(library, b_id));
     }
+    catalog_unlock(library);
 
 
     // Send 'ACK_DB' to the client
     memset(buffer, 0, sizeof(buffer));
     strcpy(buffer, "ACK_DB");
     print_info("Library rank %d sending '%s' to client rank %d", library->rank, buffer, client_rank);
-    MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, client_rank, TAG_DONATE_BOOKS_DONE, MPI_COMM_WORLD);
+    comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, client_rank, TAG_DONATE_BOOKS_DONE, MPI_COMM_WORLD);
+}
+
+
+/*
+* Handles the 'RETURN_BOOK <epoch> <b_id> <cost> [<b_id> <cost> ...]' message from a client. Every pair is one returned copy,
+* the copies become available again and the client gets a single 'ACK_RB <n_copies>' for the whole batch.
+* The returns are counted with the epoch of the client (when it sent them), not ours.
+* If the book has no entry in this library (e.g. the lender was a different library) a new entry is created.
+*/
+void event_return_book(library_t *library, char **str_array, int client_rank)
+{
+    char buffer[BUF_SIZE];
+    book_library_t *book;
+    int i, b_id, cost, n_copies, epoch;
+
+
+    epoch = atoi(str_array[1]);
+    n_copies = 0;
+    for(i = 2; str_array[i] != NULL && str_array[i+1] != NULL; i += 2)
+    {
+        b_id = atoi(str_array[i]);
+        cost = atoi(str_array[i+1]);
+
+        book = search_book(library, b_id);
+        if(book == NULL)
+        {
+            add_book(library, b_id, cost);
+            book = search_book(library, b_id);
+            // add_book() counts the copy as a donation, this one is a return.
+            book->donated_num = 0;
+        }
+        else
+        {
+            book_put(book, 1);
+        }
+        book->returned_num++;
+        n_copies++;
+
+        print_info("Library rank %d got book %d back from client rank %d: currently_available=%d, loaned_num=%d, returned_num=%d.", library->rank, b_id, client_rank, book_available(book), book->loaned_num, book->returned_num);
+
+        serve_waitlist(library, book);
+    }
+
+
+    epoch_counter_add(&library->returns, epoch, n_copies);
+
+    // Send 'ACK_RB <n_copies>' to the client
+    memset(buffer, 0, sizeof(buffer));
+    strcpy(buffer, "ACK_RB ");
+    strcat_int(buffer, n_copies);
+    print_debug("Library rank %d sending '%s' to client rank %d", library->rank, buffer, client_rank);
+    comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, client_rank, TAG_RETURN_BOOK, MPI_COMM_WORLD);
 }
 
 
@@ -709,95 +1590,75 @@ int get_next_snake_lib_rank(library_t *library)
 
 
 /*
-* Goes through the book list and adds all the loan counters and returns the final value.
-*/
-int get_total_loaned_books(library_t *library)
-{
-    int total_loaned = 0;
-    book_library_t *tmp_book;
-
-
-    // Integrity check
-    if(library == NULL)
-        return 0;
-
-    tmp_book = library->book_list;
-    while(tmp_book != NULL)
-    {
-        total_loaned += tmp_book->loaned_num;
-        tmp_book = tmp_book->next;  // Step
-    }
-
-    return total_loaned;
-}
-
-
-/*
-* Handle the 'CHECK_NUM_BOOKS_LOAN' event. Send 'CHECK_NUM_BOOKS_LOAN' to every library starting from l_id 0 (MPI rank 1).
+* Handle the 'CHECK_NUM_BOOKS_LOAN <epoch>' event. Send 'CHECK_NUM_BOOKS_LOAN <epoch>' to every library starting from l_id 0 (MPI rank 1).
+*
+* Every library moves to the given epoch and reports the copies it lent and got back with a stamp before that epoch.
+* Loans made after a library moved on aren't counted on either side, so the totals can be compared with the clients'
+* while books are still being lent. The coordinator may ask again for the same epoch if messages were still in flight.
 */
-void event_check_num_books_loan(library_t *library, int N)
+void event_check_num_books_loan(library_t *library, int N, int epoch)
 {
     char buffer[BUF_SIZE];
-    int next_rank, total_loaned;
+    int next_rank, total_loaned, total_returned;
     MPI_Status status;
 
 
+    if(epoch > library->epoch)
+        library->epoch = epoch;
+
     if(library->rank == library->leader_rank)
     {
         memset(buffer, 0, sizeof(buffer));
-        strcpy(buffer, "CHECK_NUM_BOOKS_LOAN");
+        strcpy(buffer, "CHECK_NUM_BOOKS_LOAN ");
+        strcat_int(buffer, epoch);
 
         // If the first node is also the leader, skip to the next
         // If you were the first node you won't receive any message either.
         if(library->rank == 1)
         {
-            print_info("Library leader rank %d is the first in the grid, sending message to the next.");
-            next_rank = library->right;
+            print_info("Library leader rank %d is the first in the grid, sending message to the next.", library->rank);
+            next_rank = get_next_snake_lib_rank(library);
 
             print_info("Library leader rank %d sending '%s' to library rank %d", library->rank, buffer, next_rank);
-            MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, next_rank, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
+            comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, next_rank, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
         }
         else
         {
             next_rank = 1;
 
             print_info("Library leader rank %d sending '%s' to library rank %d", library->rank, buffer, next_rank);
-            MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, next_rank, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
+            comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, next_rank, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
 
 
             // Wait to receive a 'CHECK_NUM_BOOKS_LOAN' message and pass it over. 
             memset(buffer, 0, sizeof(buffer));
-            MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, MPI_ANY_SOURCE, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD, &status);
-            if(strcmp(buffer, "CHECK_NUM_BOOKS_LOAN") != 0)
+            comm_recv(buffer, sizeof(buffer), MPI_CHAR, MPI_ANY_SOURCE, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD, &status);
+            if(strncmp(buffer, "CHECK_NUM_BOOKS_LOAN", 20) != 0)
             {
                 print_error("Library leader %d expected 'TAG_CHECK_NUM_BOOKS_LOANED' but instead got from library rank %d: %s", library->rank, status.MPI_SOURCE, buffer);
             }
 
-             // if you are also the last node in the grid (rank N*N)
-            if(library->rank == N*N)
+            next_rank = get_next_snake_lib_rank(library);
+
+            // if you are also the last node of the snake
+            if(next_rank == 0)
             {
                 print_info("Library leader %d: i'm the last node in the grid, stopping broadcasting.", library->rank);
             }
             else // pass it over...
             {
-                next_rank = get_next_snake_lib_rank(library);
-
-                // Sanity check
-                if(next_rank == 0)
-                    print_error("Library leader rank %d couldn't find next rank, impossible!");
-
                 print_info("Library leader rank %d sending '%s' to library rank %d", library->rank, buffer, next_rank);
-                MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, next_rank, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
+                comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, next_rank, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
             }
         }
 
         /////////////////////////////////////////////////////////////////////////////////////////////////
         // Count section: Wait for messages from the other libraries and add all the counts
         char **str_array;
-        int num_books_loan;
         
-        total_loaned = get_total_loaned_books(library);
-        print_info("Library leader rank %d has %d loaned books", library->rank, total_loaned);
+        total_loaned = epoch_counter_sum_before(&library->loans, epoch);
+        total_returned = epoch_counter_sum_before(&library->returns, epoch);
+        print_info("Library leader rank %d has %d loaned and %d returned books before epoch %d", library->rank, total_loaned, total_returned, epoch);
 
         for(int i = 1; i <= N*N; i++)
         {
@@ -809,7 +1670,7 @@ void event_check_num_books_loan(library_t *library, int N)
 
 
             memset(buffer, 0, sizeof(buffer));
-            MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, i, TAG_NUM_BOOKS_LOANED, MPI_COMM_WORLD, &status);
+            comm_recv(buffer, sizeof(buffer), MPI_CHAR, i, TAG_NUM_BOOKS_LOANED, MPI_COMM_WORLD, &status);
             print_debug("Library leader rank %d got from rank %d: %s", library->rank, i, buffer);
 
             str_array = split_string(buffer, strlen(buffer), ' ');
@@ -818,8 +1679,8 @@ void event_check_num_books_loan(library_t *library, int N)
                 print_error("Library leader rank %d expected 'NUM_BOOKS_LOANED' from rank %d but instead got: %s", library->rank, i, buffer);
             }
 
-            num_books_loan = atoi(str_array[1]);
-            total_loaned += num_books_loan;
+            total_loaned += atoi(str_array[1]);
+            total_returned += atoi(str_array[2]);
 
             free_string_array(str_array);
             str_array = NULL;
@@ -828,17 +1689,19 @@ void event_check_num_books_loan(library_t *library, int N)
             memset(buffer, 0, sizeof(buffer));
             strcpy(buffer, "ACK_NBL");
             print_debug("Library leader rank %d sending '%s' to rank %d.", library->rank, buffer, i);
-            MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, i, TAG_ACK, MPI_COMM_WORLD);
+            comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, i, TAG_ACK, MPI_COMM_WORLD);
         }
 
         // Print message as per the assignment.
-        print_info("Library books: <%d>", total_loaned);
+        print_info("Library books: <%d>", total_loaned - total_returned);
         
         memset(buffer, 0, sizeof(buffer));
         strcpy(buffer, "CHECK_NUM_BOOKS_LOAN_DONE ");
         strcat_int(buffer, total_loaned);
+        strcat(buffer, " ");
+        strcat_int(buffer, total_returned);
         print_debug("Library leader rank %d sending '%s' to coordinator.", library->rank, buffer);
-        MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, 0, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
+        comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, 0, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
         // End of leader.
     }
     else
@@ -853,24 +1716,28 @@ void event_check_num_books_loan(library_t *library, int N)
         else
         {
             memset(buffer, 0, sizeof(buffer));
-            strcpy(buffer, "CHECK_NUM_BOOKS_LOAN");
+            strcpy(buffer, "CHECK_NUM_BOOKS_LOAN ");
+            strcat_int(buffer, epoch);
             print_info("Library rank %d sending '%s' to library rank %d", library->rank, buffer, next_rank);
-            MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, next_rank, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
+            comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, next_rank, TAG_CHECK_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
         }
 
         // Calculate the total loaned books
-        total_loaned = get_total_loaned_books(library);
+        total_loaned = epoch_counter_sum_before(&library->loans, epoch);
+        total_returned = epoch_counter_sum_before(&library->returns, epoch);
 
         memset(buffer, 0, sizeof(buffer));
         strcpy(buffer, "NUM_BOOKS_LOANED ");
         strcat_int(buffer, total_loaned);
+        strcat(buffer, " ");
+        strcat_int(buffer, total_returned);
         print_info("Library rank %d sending '%s' to library rank %d", library->rank, buffer, library->leader_rank);
-        MPI_Send(buffer, strlen(buffer) + 1, MPI_CHAR, library->leader_rank, TAG_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
+        comm_send(buffer, strlen(buffer) + 1, MPI_CHAR, library->leader_rank, TAG_NUM_BOOKS_LOANED, MPI_COMM_WORLD);
         
 
         // Wait for 'ACK_NBL' from the leader.
         memset(buffer, 0, sizeof(buffer));
-        MPI_Recv(buffer, sizeof(buffer), MPI_CHAR, library->leader_rank, TAG_ACK, MPI_COMM_WORLD, &status);
+        comm_recv(buffer, sizeof(buffer), MPI_CHAR, library->leader_rank, TAG_ACK, MPI_COMM_WORLD, &status);
         print_debug("Library rank %d got from leader: %s", library->rank, buffer);
 
         if(strcmp(buffer, "ACK_NBL") != 0)
@@ -882,6 +1749,168 @@ void event_check_num_books_loan(library_t *library, int N)
 
 
 
+/*
+* The hop (see hop_trace.h) of the messages a library gets on the path of a 'TAKE_BOOK', 0 for the rest.
+*/
+char library_hop(const char *msg)
+{
+    if(strcmp(msg, "LEND_BOOK") == 0)           return 'L';
+    if(strcmp(msg, "FIND_BOOK") == 0)           return 'F';
+    if(strcmp(msg, "FOUND_BOOK") == 0)          return 'f';
+    if(strcmp(msg, "BOOK_REQUEST") == 0)        return 'R';
+    if(strcmp(msg, "ACK_TB") == 0)              return 'A';
+    return 0;
+}
+
+
+/*
+* A message that a worker thread handles.
+*/
+typedef struct {
+
+    library_t *library;
+    char **strings_array;
+    int source;
+    int N;
+    hop_trace_t trace;
+
+} library_task_t;
+
+
+/*
+* What a worker takes from the thread of its library: the message counters and the log ring of the rank.
+*/
+typedef struct {
+
+    void *comm;
+    void *log;
+
+} worker_context_t;
+
+
+static void worker_init(void *arg)
+{
+    worker_context_t *context = (worker_context_t *) arg;
+
+
+    comm_outbox_attach(context->comm);
+    log_thread_attach(context->log);
+}
+
+
+/*
+* @return 1 for the messages that go to the pool of a threaded library.
+*/
+static int is_pooled(const char *msg)
+{
+    return strcmp(msg, "LEND_BOOK") == 0 || strcmp(msg, "BOOK_REQUEST") == 0 || strcmp(msg, "DONATE_BOOK") == 0;
+}
+
+
+static void run_task(void *arg)
+{
+    library_task_t *task = (library_task_t *)arg;
+    char **strings_array = task->strings_array;
+
+
+    *hop_trace_current() = task->trace;
+    stats_event_begin(strings_array[0]);
+
+    if(strcmp(strings_array[0], "LEND_BOOK") == 0)
+    {
+        event_lend_book(task->library, atoi(strings_array[1]), task->source, task->N);
+    }
+    else if(strcmp(strings_array[0], "BOOK_REQUEST") == 0)
+    {
+        event_book_request(task->library, atoi(strings_array[1]), atoi(strings_array[2]), atoi(strings_array[3]), task->source);
+    }
+    else if(strcmp(strings_array[0], "DONATE_BOOK") == 0)
+    {
+        event_donate_book(task->library, atoi(strings_array[1]), atoi(strings_array[2]), task->source);
+    }
+
+    stats_event_end();
+    free_string_array(strings_array);
+    free(task);
+}
+
+
+/*
+* The receive of a threaded library: while the workers are busy it polls, so that their replies (comm_outbox_flush())
+* go out as soon as they're queued. Once they're done it blocks like the single threaded library.
+*/
+static void threaded_recv(workpool_t *pool, char *buffer, int size, MPI_Status *status)
+{
+    struct timespec ts = { 0, (long)(SERVER_POLL_SLEEP * 1e9) };
+    int flag;
+
+
+    while(1)
+    {
+        // Idle first: a task queues its replies before it finishes, so the flush after it gets all of them.
+        if(workpool_idle(pool))
+        {
+            comm_outbox_flush();
+            break;
+        }
+
+        comm_outbox_flush();
+        comm_iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, MPI_STATUS_IGNORE);
+        if(flag)
+            break;
+        nanosleep(&ts, NULL);
+    }
+
+    comm_recv(buffer, size, MPI_CHAR, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, status);
+}
+
+
+static void init_locks(library_t *library)
+{
+    int i;
+
+
+    library->threaded = 1;
+    pthread_rwlock_init(&library->catalog_lock, NULL);
+    pthread_mutex_init(&library->pending_lock, NULL);
+    pthread_mutex_init(&library->counters_lock, NULL);
+    for(i = 0; i < LIB_BOOK_LOCKS; i++)
+        pthread_mutex_init(&library->book_locks[i], NULL);
+}
+
+
+static void destroy_locks(library_t *library)
+{
+    int i;
+
+
+    pthread_rwlock_destroy(&library->catalog_lock);
+    pthread_mutex_destroy(&library->pending_lock);
+    pthread_mutex_destroy(&library->counters_lock);
+    for(i = 0; i < LIB_BOOK_LOCKS; i++)
+        pthread_mutex_destroy(&library->book_locks[i]);
+    library->threaded = 0;
+}
+
+
+/*
+* '--shared-catalog': puts our books in our window and waits for the rest of the libraries of the node to do the same.
+*/
+static void share_catalog(library_t *library, int num_libs)
+{
+    book_library_t *book;
+
+
+    if(catalog_shm_attach(library->l_id, num_libs) != 0)
+        return;
+
+    for(book = library->book_list; book != NULL; book = book->next)
+        share_book(book);
+
+    catalog_shm_ready();
+}
+
+
 /*
 * Function that starts a library (server) process. (The process is started from MPI and then calls this function)
 */
@@ -892,10 +1921,31 @@ void start_server(int library_rank, int num_libs)
     MPI_Status status;
     char **strings_array = NULL;
     int N;
+    workpool_t pool;
+    worker_context_t worker_context;
+    int threaded = 0;
+    long long tasks_done, tasks_stolen;
 
 
     N = sqrt(num_libs);
     init_library(&library, library_rank, num_libs, N);
+    share_catalog(&library, num_libs);
+
+    if(server_threads > 1)
+    {
+        init_locks(&library);
+        worker_context.comm = comm_thread_context();
+        worker_context.log = log_thread_context();
+        if(workpool_start(&pool, server_threads, worker_init, &worker_context) == 0)
+        {
+            threaded = 1;
+        }
+        else
+        {
+            print_warn("Library rank %d couldn't start %d worker threads, it handles its messages by itself.", library_rank, server_threads);
+            destroy_locks(&library);
+        }
+    }
 
 
     print_info("Server rank %d is at (%d,%d) in the grid.", library_rank, library.x, library.y);
@@ -910,10 +1960,38 @@ void start_server(int library_rank, int num_libs)
     while(1)
     {
         //Block on receive and examine the message when it arrives (or use MPi_Probe for that)
-        MPI_Recv(buffer_recv, sizeof(buffer_recv), MPI_CHAR, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+        if(threaded)
+            threaded_recv(&pool, buffer_recv, sizeof(buffer_recv), &status);
+        else
+            comm_recv(buffer_recv, sizeof(buffer_recv), MPI_CHAR, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
         
 
         strings_array = split_string(buffer_recv, strlen(buffer_recv), ' ');
+        hop_trace_recv(strings_array, library_hop(strings_array[0]));
+
+        if(threaded && is_pooled(strings_array[0]))
+        {
+            library_task_t *task = (library_task_t *) MyCalloc(1, sizeof(library_task_t));
+
+            task->library = &library;
+            task->strings_array = strings_array;    // The worker frees it.
+            task->source = status.MPI_SOURCE;
+            task->N = N;
+            task->trace = *hop_trace_current();
+            workpool_submit(&pool, run_task, task);
+
+            memset(buffer_recv, 0, sizeof(buffer_recv));
+            strings_array = NULL;
+            continue;
+        }
+        else if(threaded)
+        {
+            // Everything else sees the library as if the pooled messages before it had been handled one by one.
+            workpool_quiesce(&pool);
+            comm_outbox_flush();
+        }
+
+        stats_event_begin(strings_array[0]);
 
         if(strcmp(strings_array[0], "START_LEADER_ELECTION") == 0)
         {
@@ -937,6 +2015,23 @@ void start_server(int library_rank, int num_libs)
 
             event_recv_parent(&library, new_rank, status.MPI_SOURCE);
         }
+        else if(strcmp(strings_array[0], "FLOOD") == 0)
+        {
+            flood_vote_t vote;
+
+            vote.rank = atoi(strings_array[2]);
+            vote.ecc = atoi(strings_array[3]);
+            vote.load = atoi(strings_array[4]);
+            event_recv_flood(&library, status.MPI_SOURCE, atoi(strings_array[1]), &vote);
+        }
+        else if(strcmp(strings_array[0], "FLOOD_END") == 0)
+        {
+            event_recv_flood_end(&library, status.MPI_SOURCE, atoi(strings_array[2]));
+        }
+        else if(strcmp(strings_array[0], "FLOOD_ECHO") == 0)
+        {
+            event_recv_flood_echo(&library);
+        }
         else if(strcmp(strings_array[0], "LE_LIBR_DONE") == 0)
         {
             if(library.parent_rank != status.MPI_SOURCE)
@@ -953,18 +2048,39 @@ void start_server(int library_rank, int num_libs)
 
             event_lend_book(&library, b_id, status.MPI_SOURCE, N);
         }
+        else if(strcmp(strings_array[0], "LEND_BOOKS") == 0)
+        {
+            event_lend_books(&library, strings_array, status.MPI_SOURCE, N);
+        }
         else if(strcmp(strings_array[0], "FIND_BOOK") == 0)
         {
             int b_id = atoi(strings_array[1]);
 
             event_find_book(&library, b_id, status.MPI_SOURCE, N);
         }
+        else if(strcmp(strings_array[0], "FOUND_BOOK") == 0)
+        {
+            int lib_rank = atoi(strings_array[1]);
+            int b_id = atoi(strings_array[2]);
+
+            event_found_book(&library, b_id, lib_rank);
+        }
         else if(strcmp(strings_array[0], "BOOK_REQUEST") == 0)
         {
             int b_id = atoi(strings_array[1]);
             int client_rank = atoi(strings_array[2]);
+            int n_copies = atoi(strings_array[3]);
+
+            event_book_request(&library, b_id, client_rank, n_copies, status.MPI_SOURCE);
+        }
+        else if(strcmp(strings_array[0], "ACK_TB") == 0)
+        {
+            int b_id = atoi(strings_array[1]);
+            int cost = atoi(strings_array[2]);
+            int granted = atoi(strings_array[3]);
+            int epoch = atoi(strings_array[4]);
 
-            event_book_request(&library, b_id, client_rank, status.MPI_SOURCE);
+            event_book_reply(&library, b_id, cost, granted, epoch, status.MPI_SOURCE);
         }
         else if(strcmp(strings_array[0], "DONATE_BOOK") == 0)
         {
@@ -973,10 +2089,16 @@ void start_server(int library_rank, int num_libs)
             
             event_donate_book(&library, b_id, cost, status.MPI_SOURCE);
         }
+        else if(strcmp(strings_array[0], "RETURN_BOOK") == 0)
+        {
+            event_return_book(&library, strings_array, status.MPI_SOURCE);
+        }
 
         else if(strcmp(strings_array[0], "CHECK_NUM_BOOKS_LOAN") == 0)
         {
-            event_check_num_books_loan(&library, N);
+            int epoch = atoi(strings_array[1]);
+
+            event_check_num_books_loan(&library, N, epoch);
         }
         else if(strcmp(strings_array[0], "SHUTDOWN") == 0)
         {
@@ -988,6 +2110,8 @@ void start_server(int library_rank, int num_libs)
         }
 
 
+        stats_event_end();
+
         // Release memory
         memset(buffer_recv, 0, sizeof(buffer_recv));    // Clear the memory just in case.
         free_string_array(strings_array);
@@ -995,6 +2119,25 @@ void start_server(int library_rank, int num_libs)
     }
 
     print_info(UBLU"Library"reset" rank %d got message from coordinator, shutting down...", library.rank);
+    if(threaded)
+    {
+        workpool_stop(&pool, &tasks_done, &tasks_stolen);
+        comm_outbox_flush();
+        destroy_locks(&library);
+        print_info("Library rank %d ran %lld messages in %d threads, %lld of them were stolen.", library.rank, tasks_done, server_threads, tasks_stolen);
+    }
+    if(library.waitlist_served > 0)
+    {
+        print_result("Library rank %d served %d waitlisted requests, average time to fulfil %.6f s.", library.rank, library.waitlist_served, library.waitlist_wait_time / library.waitlist_served);
+    }
+
+    if(library.shm_claims > 0)
+    {
+        print_result("Library rank %d took %d copies from the shared catalogs of its node.", library.rank, library.shm_claims);
+    }
+    catalog_shm_detach();
 
+    epoch_counter_free(&library.loans);
+    epoch_counter_free(&library.returns);
     clear_library(&library);
 }
\ No newline at end of file
@@ -6,9 +6,43 @@
 #include <string.h>
 #include <mpi.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "my_funcs.h"
+#include "comm.h"
 #include "book.h"
+#include "hop_trace.h"
+#include "workpool.h"
+#include "catalog_shm.h"
+
+
+#define LIB_BOOK_LOCKS 64               // Locks of the book counters, a book uses b_id % LIB_BOOK_LOCKS.
+#define SERVER_POLL_SLEEP 0.00002       // Seconds the receiving thread sleeps when nothing came and the workers are busy.
+
+
+/*
+* A client (rank) that waits for a book, either on a lookup that is already in flight or on the waitlist of a book.
+*/
+typedef struct waiter_t {
+
+    int client_rank;                    // The MPI rank of the client that sent 'LEND_BOOK'.
+    double since;                       // MPI_Wtime() when the client started waiting.
+    hop_trace_t trace;                  // Trace context of the 'LEND_BOOK' of the client (see hop_trace.h).
+    struct waiter_t *next;
+
+} waiter_t;
+
+
+/*
+* FIFO of waiters.
+*/
+typedef struct {
+
+    waiter_t *head;
+    waiter_t *tail;
+    int size;
+
+} waiter_queue_t;
 
 
 /*
@@ -20,14 +54,45 @@ typedef struct book_library_t{
     int currently_available;            // How many copies of this book are in the library
     int loaned_num;                     // How many copies of this book were loaned.
     int donated_num;                    // How many copies of this book were donated.
+    int returned_num;                   // How many copies of this book were returned to this library.
+    waiter_queue_t waitlist;            // Clients that asked for the book while there were no copies, served first come first served.
+    shared_book_t *shared;              // '--shared-catalog': the copies are in the window (catalog_shm.h), not in currently_available.
     struct book_library_t *next;        // Pointer to the next (unique/different) book in the list.
 
 } book_library_t;
 
+
+/*
+* A lookup (FIND_BOOK -> BOOK_REQUEST) for a book that this library doesn't have available. Concurrent misses for the
+* same b_id are coalesced into one entry, so only one lookup per b_id travels between the libraries.
+*/
+typedef struct pending_request_t {
+
+    int b_id;
+    int lib_rank;                       // The rank the leader gave us, 0 while 'FIND_BOOK' is still in flight.
+    int requested;                      // How many copies the 'BOOK_REQUEST' in flight asked for.
+    waiter_queue_t waiters;             // The clients that wait for this book.
+    struct pending_request_t *next;
+
+} pending_request_t;
+
+
+/*
+* A candidate of the flooding elections ('--lib-election flood|center'), the better one wins (flood_better() in server.c).
+*/
+typedef struct {
+
+    int rank;                           // 0: no vote.
+    int ecc;                            // Eccentricity of the candidate on the grid, 0 with 'flood'.
+    int load;                           // Copies the candidate has lent so far, 0 with 'flood'.
+
+} flood_vote_t;
+
+
 typedef struct {
 
     int l_id;                           // Logical id based on the assignment pdf.
-    int rank;                           // Rank of the process (real id).
+    int rank;                           // Id of the process for comm_send()/comm_recv() (the MPI rank, unless libraries are virtual).
     char *str_rank;                     // String representation of the rank.
 
     int x,y;                            // Position on the grid.
@@ -39,10 +104,36 @@ typedef struct {
     int *children;
     int children_num;
 
+    int flood_round;                    // '--lib-election flood|center': the round we're in, 0 before the election starts.
+    int flood_rounds;                   // The diameter of the grid, 2(N-1) rounds.
+    flood_vote_t flood_leader;          // The best candidate we know, leader_rank is its rank.
+    flood_vote_t flood_recv[2][4];      // The candidates the neighbors sent in this round and in the next one (by parity).
+    int flood_ends;                     // 'FLOOD_END' and 'FLOOD_ECHO' we got.
+    int flood_echoes;
+
     book_library_t *book_list;               // linked list for the books
+    pending_request_t *pending;              // Lookups in flight for books that we don't have available.
+
+    int epoch;                               // The last 'CHECK_NUM_BOOKS_LOAN' epoch we've seen, loans are stamped with it.
+    epoch_counter_t loans;                   // Copies lent, by the epoch they were lent in.
+    epoch_counter_t returns;                 // Copies returned, by the epoch stamp of the client.
+
+    int waitlist_served;                     // How many waitlisted requests got their book, and how long they waited in total.
+    double waitlist_wait_time;
+    int shm_claims;                          // Copies taken straight from the shared catalog of another library.
+
+    // '--server-threads': LEND_BOOK, BOOK_REQUEST and DONATE_BOOK run in a pool (workpool.h) and take these locks, in
+    // this order. The rest of the messages wait for the pool to finish, so they don't need any.
+    int threaded;
+    pthread_rwlock_t catalog_lock;           // The book list, a new entry needs it for writing.
+    pthread_mutex_t pending_lock;            // The lookups in flight.
+    pthread_mutex_t book_locks[LIB_BOOK_LOCKS];  // The counters and the waitlist of the books.
+    pthread_mutex_t counters_lock;           // loans and the waitlist statistics.
 
 } library_t;
 
+void server_set_threads(int threads);
+int server_set_election(const char *name);
 void start_server(int l_id, int num_libs);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,177 @@
+/*
+* Merges the per rank files of the PMPI tracer (see pmpi_trace.h) into a Chrome trace-event JSON
+* (open it with chrome://tracing or https://ui.perfetto.dev).
+* Usage: ./trace_merge <TRACE_DIR>/trace_*.bin > trace.json
+*
+* Every rank is a process in the trace. Sends, receives (the time blocked in them) and barriers are slices and every
+* message is a flow arrow from its send to its receive. MPI doesn't let messages with the same source, destination and
+* tag overtake each other, so the k-th send from A to B with tag T is matched with the k-th receive of B from A with tag T.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pmpi_trace.h"
+
+
+/*
+* A send or a receive, with the ranks on both ends so they can be sorted per (source, destination, tag).
+*/
+typedef struct {
+
+    int src, dst, tag;
+    double t_start, t_end;
+
+} trace_msg_t;
+
+
+static int compare_msgs(const void *a, const void *b)
+{
+    const trace_msg_t *x = a, *y = b;
+
+
+    if(x->src != y->src) return x->src < y->src ? -1 : 1;
+    if(x->dst != y->dst) return x->dst < y->dst ? -1 : 1;
+    if(x->tag != y->tag) return x->tag < y->tag ? -1 : 1;
+    if(x->t_start != y->t_start) return x->t_start < y->t_start ? -1 : 1;
+    return 0;
+}
+
+
+static int first_event = 1;
+
+static void print_event_prefix()
+{
+    printf(first_event ? "\n  " : ",\n  ");
+    first_event = 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    trace_header_t header;
+    trace_record_t rec;
+    trace_msg_t *sends = NULL, *recvs = NULL;
+    long long sends_num = 0, recvs_num = 0, sends_cap = 0, recvs_cap = 0;
+    long long i, j, k, flow_id = 0;
+    FILE *fp;
+    int f;
+
+
+    if(argc < 2)
+    {
+        fprintf(stderr, "Program usage: %s <trace files...>\n", argv[0]);
+        return 1;
+    }
+
+    printf("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+
+    for(f = 1; f < argc; f++)
+    {
+        fp = fopen(argv[f], "rb");
+        if(fp == NULL || fread(&header, sizeof(header), 1, fp) != 1)
+        {
+            fprintf(stderr, "Couldn't read file %s\n", argv[f]);
+            if(fp != NULL)
+                fclose(fp);
+            continue;
+        }
+
+        print_event_prefix();
+        printf("{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"rank %d\"}}", header.rank, header.rank);
+        print_event_prefix();
+        printf("{\"name\": \"process_sort_index\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"sort_index\": %d}}", header.rank, header.rank);
+
+        for(i = 0; i < header.records_num && fread(&rec, sizeof(rec), 1, fp) == 1; i++)
+        {
+            trace_msg_t msg;
+
+            print_event_prefix();
+            if(rec.kind == TRACE_BARRIER)
+            {
+                printf("{\"name\": \"MPI_Barrier\", \"ph\": \"X\", \"pid\": %d, \"tid\": 0, \"ts\": %.3f, \"dur\": %.3f}",
+                       header.rank, rec.t_start * 1e6, (rec.t_end - rec.t_start) * 1e6);
+                continue;
+            }
+
+            printf("{\"name\": \"%s tag %d\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": 0, \"ts\": %.3f, \"dur\": %.3f, "
+                   "\"args\": {\"%s\": %d, \"tag\": %d, \"bytes\": %d}}",
+                   rec.kind == TRACE_SEND ? "send" : "recv", rec.tag, rec.kind == TRACE_SEND ? "send" : "recv",
+                   header.rank, rec.t_start * 1e6, (rec.t_end - rec.t_start) * 1e6,
+                   rec.kind == TRACE_SEND ? "dst" : "src", rec.peer, rec.tag, rec.bytes);
+
+            msg.tag = rec.tag;
+            msg.t_start = rec.t_start;
+            msg.t_end = rec.t_end;
+            if(rec.kind == TRACE_SEND)
+            {
+                msg.src = header.rank;
+                msg.dst = rec.peer;
+                if(sends_num == sends_cap)
+                {
+                    sends_cap = sends_cap == 0 ? 4096 : sends_cap * 2;
+                    sends = realloc(sends, sends_cap * sizeof(trace_msg_t));
+                }
+                sends[sends_num++] = msg;
+            }
+            else
+            {
+                msg.src = rec.peer;
+                msg.dst = header.rank;
+                if(recvs_num == recvs_cap)
+                {
+                    recvs_cap = recvs_cap == 0 ? 4096 : recvs_cap * 2;
+                    recvs = realloc(recvs, recvs_cap * sizeof(trace_msg_t));
+                }
+                recvs[recvs_num++] = msg;
+            }
+
+            if((sends_num > 0 && sends == NULL) || (recvs_num > 0 && recvs == NULL))
+            {
+                fprintf(stderr, "Realloc failed.\n");
+                return 1;
+            }
+        }
+
+        fclose(fp);
+    }
+
+
+    // Flow arrows: walk both sorted lists and pair the messages of every (source, destination, tag) in order.
+    qsort(sends, sends_num, sizeof(trace_msg_t), compare_msgs);
+    qsort(recvs, recvs_num, sizeof(trace_msg_t), compare_msgs);
+
+    for(i = 0, j = 0; i < sends_num && j < recvs_num; )
+    {
+        trace_msg_t *s = &sends[i], *r = &recvs[j];
+
+        if(s->src != r->src || s->dst != r->dst || s->tag != r->tag)
+        {
+            // One side has a message the other doesn't (e.g. a rank that wasn't traced), skip the smaller one.
+            trace_msg_t key_s = *s, key_r = *r;
+            key_s.t_start = key_r.t_start = 0;
+            if(compare_msgs(&key_s, &key_r) < 0)
+                i++;
+            else
+                j++;
+            continue;
+        }
+
+        k = flow_id++;
+        print_event_prefix();
+        printf("{\"name\": \"msg\", \"cat\": \"msg\", \"ph\": \"s\", \"id\": %lld, \"pid\": %d, \"tid\": 0, \"ts\": %.3f}",
+               k, s->src, s->t_start * 1e6);
+        print_event_prefix();
+        printf("{\"name\": \"msg\", \"cat\": \"msg\", \"ph\": \"f\", \"bp\": \"e\", \"id\": %lld, \"pid\": %d, \"tid\": 0, \"ts\": %.3f}",
+               k, r->dst, r->t_end * 1e6 - 0.001);       // Just inside the receive, so the arrow binds to it.
+        i++;
+        j++;
+    }
+
+    printf("\n]}\n");
+    fprintf(stderr, "%lld sends, %lld receives, %lld matched messages\n", sends_num, recvs_num, flow_id);
+
+    free(sends);
+    free(recvs);
+    return 0;
+}
@@ -0,0 +1,196 @@
+#include "transport.h"
+
+#include <time.h>
+
+
+static const transport_t *backend = &transport_mpi;
+static RANK_LOCAL int my_rank = 0;
+static int ranks_num = 1;
+
+
+static int mpi_send(const void *buf, int count, MPI_Datatype datatype, int dest, int tag)
+{
+    return MPI_Send(buf, count, datatype, dest, tag, MPI_COMM_WORLD);
+}
+
+
+static int mpi_recv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Status *status)
+{
+    return MPI_Recv(buf, count, datatype, source, tag, MPI_COMM_WORLD, status);
+}
+
+
+static int mpi_probe(int source, int tag, MPI_Status *status)
+{
+    return MPI_Probe(source, tag, MPI_COMM_WORLD, status);
+}
+
+
+static int mpi_iprobe(int source, int tag, int *flag, MPI_Status *status)
+{
+    return MPI_Iprobe(source, tag, MPI_COMM_WORLD, flag, status);
+}
+
+
+static void mpi_barrier()
+{
+    MPI_Barrier(MPI_COMM_WORLD);
+}
+
+
+static void mpi_gather(const void *send_buf, int bytes, void *recv_buf, int root)
+{
+    MPI_Gather(send_buf, bytes, MPI_BYTE, recv_buf, bytes, MPI_BYTE, root, MPI_COMM_WORLD);
+}
+
+
+static double mpi_wtime()
+{
+    return MPI_Wtime();
+}
+
+
+/*
+* Also the sleep of the threads transport.
+*/
+void transport_real_sleep(double seconds)
+{
+    struct timespec ts;
+
+
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+
+const transport_t transport_mpi = {
+    "mpi", mpi_send, mpi_recv, mpi_probe, mpi_iprobe, mpi_barrier, mpi_gather, mpi_wtime, transport_real_sleep
+};
+
+
+/*
+* Picks the backend, before transport_run().
+* @return 0, or -1 if there's no backend with that name.
+*/
+int transport_select(const char *name)
+{
+    if(strcmp(name, transport_mpi.name) == 0)
+        backend = &transport_mpi;
+    else if(strcmp(name, transport_threads.name) == 0)
+        backend = &transport_threads;
+    else if(strcmp(name, transport_sim.name) == 0)
+        backend = &transport_sim;
+    else
+        return -1;
+
+    return 0;
+}
+
+
+const char *transport_name()
+{
+    return backend->name;
+}
+
+
+/*
+* @return 1 if the ranks are threads of this process (threads, sim).
+*/
+int transport_in_process()
+{
+    return backend != &transport_mpi;
+}
+
+
+/*
+* Runs rank_main() for the ranks of this process, after MPI_Init(): this MPI rank with the MPI transport, the ranks
+* 0 ... ranks - 1 as threads with the in-process transports.
+* @return What rank_main() returned (the first non zero one of the threads).
+*/
+int transport_run(int ranks, transport_main_fn rank_main, void *arg)
+{
+    if(backend == &transport_threads)
+    {
+        ranks_num = ranks;
+        return transport_threads_run(ranks, rank_main, arg);
+    }
+    if(backend == &transport_sim)
+    {
+        ranks_num = ranks;
+        return transport_sim_run(ranks, rank_main, arg);
+    }
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &ranks_num);
+    return rank_main(my_rank, ranks_num, arg);
+}
+
+
+/*
+* The in-process backends tell every thread its rank.
+*/
+void transport_set_rank(int rank)
+{
+    my_rank = rank;
+}
+
+
+int transport_rank()
+{
+    return my_rank;
+}
+
+
+int transport_size()
+{
+    return ranks_num;
+}
+
+
+int transport_send(const void *buf, int count, MPI_Datatype datatype, int dest, int tag)
+{
+    return backend->send(buf, count, datatype, dest, tag);
+}
+
+
+int transport_recv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Status *status)
+{
+    return backend->recv(buf, count, datatype, source, tag, status);
+}
+
+
+int transport_probe(int source, int tag, MPI_Status *status)
+{
+    return backend->probe(source, tag, status);
+}
+
+
+int transport_iprobe(int source, int tag, int *flag, MPI_Status *status)
+{
+    return backend->iprobe(source, tag, flag, status);
+}
+
+
+void transport_barrier()
+{
+    backend->barrier();
+}
+
+
+void transport_gather(const void *send_buf, int bytes, void *recv_buf, int root)
+{
+    backend->gather(send_buf, bytes, recv_buf, root);
+}
+
+
+double transport_wtime()
+{
+    return backend->wtime();
+}
+
+
+void transport_sleep(double seconds)
+{
+    backend->sleep(seconds);
+}
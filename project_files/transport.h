@@ -0,0 +1,95 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+
+
+/*
+* What moves the bytes under comm.c ('--transport <name>' after the testfile):
+*   - mpi (the default): MPI_Send()/MPI_Recv() on MPI_COMM_WORLD, a rank is an MPI process.
+*   - threads: one process runs every rank as a thread ('--ranks <P>', no mpirun needed) and the messages go through
+*     lock-free single producer/single consumer rings in memory (transport_threads.c).
+*   - sim: the ranks are threads of one process too, but they take turns on a virtual clock and the messages arrive
+*     when a model of the network says so (transport_sim.c), a deterministic discrete event simulation of the protocol.
+*
+* The calls take the arguments of their MPI counterparts without the communicator (it's always the world), and fill
+* an MPI_Status the same way (MPI_SOURCE, MPI_TAG and the count for MPI_Get_count()), so the code above doesn't
+* change with the backend. MPI is still initialized in the in-process transports for the datatypes. The code reads the
+time with transport_wtime(), MPI_Wtime() unless it's the virtual clock of the simulator.
+*
+* The state a rank keeps in globals is RANK_LOCAL (thread local): with the threads transport every rank is a thread of
+* the same process. A thread that works for a rank (a worker of a threaded library) attaches to its state explicitly,
+* see comm_thread_context() and log_thread_context().
+*/
+#define RANK_LOCAL __thread
+
+#define TRANSPORT_RING_SLOTS 64             // Messages in flight from one rank to another, must be a power of 2.
+#define TRANSPORT_SPIN 64                   // Times a receiver polls before it sleeps.
+#define TRANSPORT_SLEEP_US 1000             // Longest sleep of a receiver (it's woken up by the senders anyway).
+
+#define SIM_LATENCY 5e-6                    // Defaults of the network model of the simulator (sim_config_t).
+#define SIM_LOCAL_LATENCY 5e-7
+#define SIM_BANDWIDTH 1e10
+#define SIM_CPU 1e-6
+
+
+typedef struct {
+
+    const char *name;
+    int (*send)(const void *buf, int count, MPI_Datatype datatype, int dest, int tag);
+    int (*recv)(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Status *status);
+    int (*probe)(int source, int tag, MPI_Status *status);
+    int (*iprobe)(int source, int tag, int *flag, MPI_Status *status);
+    void (*barrier)();
+    void (*gather)(const void *send_buf, int bytes, void *recv_buf, int root);     // Bytes per rank, to recv_buf of root.
+    double (*wtime)();
+    void (*sleep)(double seconds);          // A pause while polling, virtual time in the simulator.
+
+} transport_t;
+
+
+/*
+* The network model of the simulator ('--sim-* <value>' options, in microseconds and MB/s on the command line).
+*/
+typedef struct {
+
+    double latency;                         // Seconds from a rank to a rank of another host.
+    double local_latency;                   // Seconds between ranks of the same host.
+    double bandwidth;                       // Bytes/s of the link of a rank, its messages go through it one by one (0: no limit).
+    double cpu;                             // Seconds a rank spends on a message it receives (or on a poll that finds nothing).
+    int ranks_per_host;                     // Ranks 0 ... K-1 on the first host and so on, 0: all on one host.
+
+} sim_config_t;
+
+
+typedef int (*transport_main_fn)(int rank, int size, void *arg);
+
+extern const transport_t transport_mpi;
+extern const transport_t transport_threads;
+extern const transport_t transport_sim;
+
+int transport_select(const char *name);
+const char *transport_name();
+int transport_in_process();
+int transport_run(int ranks, transport_main_fn rank_main, void *arg);
+int transport_threads_run(int ranks, transport_main_fn rank_main, void *arg);
+int transport_sim_run(int ranks, transport_main_fn rank_main, void *arg);
+void transport_sim_configure(const sim_config_t *config);
+void transport_set_rank(int rank);
+void transport_real_sleep(double seconds);
+
+int transport_rank();
+int transport_size();
+int transport_send(const void *buf, int count, MPI_Datatype datatype, int dest, int tag);
+int transport_recv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Status *status);
+int transport_probe(int source, int tag, MPI_Status *status);
+int transport_iprobe(int source, int tag, int *flag, MPI_Status *status);
+void transport_barrier();
+void transport_gather(const void *send_buf, int bytes, void *recv_buf, int root);
+double transport_wtime();
+void transport_sleep(double seconds);
+
+#endif
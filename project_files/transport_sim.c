@@ -0,0 +1,555 @@
+#include "transport.h"
+
+#include <pthread.h>
+
+#include "my_funcs.h"
+
+
+/*
+* The simulator transport ('--transport sim'): every rank is a thread like with the threads transport, but only one
+* runs at a time and time is virtual. Each rank has a clock. A message leaves its sender at the sender's clock (after
+* the messages it sent before have gone through its link), takes size / bandwidth on the link and the latency between
+* the two hosts, and is delivered at that arrival time. Receiving a message costs the receiver 'cpu' seconds, the
+* handlers themselves take no time.
+*
+* The scheduler (the thread that called transport_sim_run()) runs the rank with the earliest clock among the ones that
+* can run, as long as no message in flight arrives before that clock, otherwise it delivers the earliest message first.
+* A rank runs until it blocks in a receive, so a run is deterministic: the same testfile and parameters give the same
+* messages in the same order and the same virtual times. transport_wtime() is the clock of the rank, so the phase
+* timings of the coordinator are predictions for the modeled network.
+*/
+#define SIM_READY 0
+#define SIM_RUNNING 1
+#define SIM_BLOCKED 2                       // In a receive/probe, waiting for wait_source/wait_tag.
+#define SIM_BARRIER 3
+#define SIM_DONE 4
+
+
+typedef struct sim_msg {
+
+    int source;
+    int dest;
+    int tag;
+    int len;
+    double arrival;
+    long long seq;                          // Ties on the arrival time go in the order they were sent.
+    struct sim_msg *next;
+    char data[];
+
+} sim_msg_t;
+
+
+typedef struct {
+
+    int state;
+    int wait_source;
+    int wait_tag;
+    double clock;
+    double link_free;                       // When the link of the rank is done with what it sent so far.
+    sim_msg_t *head, *tail;                 // Delivered, not received yet.
+    pthread_cond_t resume;
+
+} sim_rank_t;
+
+
+typedef struct {
+
+    int rank;
+    transport_main_fn rank_main;
+    void *arg;
+    int ret;
+
+} sim_start_t;
+
+
+static sim_config_t config = { SIM_LATENCY, SIM_LOCAL_LATENCY, SIM_BANDWIDTH, SIM_CPU, 0 };
+static sim_rank_t *ranks = NULL;
+static int ranks_num = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scheduler_wakeup = PTHREAD_COND_INITIALIZER;
+static int running = -1;                    // The rank that has the baton, -1: the scheduler.
+
+static sim_msg_t **heap = NULL;             // Messages in flight, a binary heap on (arrival, seq).
+static int heap_num = 0, heap_cap = 0;
+static long long next_seq = 0;
+static int barrier_waiting = 0;
+static void *gather_buf = NULL;
+
+static long long msgs_local = 0, msgs_remote = 0, bytes_total = 0, handoffs = 0;
+static double end_time = 0;
+
+static RANK_LOCAL sim_rank_t *self = NULL;
+static RANK_LOCAL int self_rank = 0;
+
+
+void transport_sim_configure(const sim_config_t *sim_config)
+{
+    config = *sim_config;
+}
+
+
+static int host_of(int rank)
+{
+    return config.ranks_per_host > 0 ? rank / config.ranks_per_host : 0;
+}
+
+
+static int earlier(sim_msg_t *a, sim_msg_t *b)
+{
+    return a->arrival < b->arrival || (a->arrival == b->arrival && a->seq < b->seq);
+}
+
+
+static void heap_push(sim_msg_t *m)
+{
+    int i, parent;
+
+
+    if(heap_num == heap_cap)
+    {
+        heap_cap = heap_cap == 0 ? 1024 : heap_cap * 2;
+        heap = (sim_msg_t **) MyRealloc(heap, heap_cap * sizeof(sim_msg_t *));
+    }
+
+    for(i = heap_num++; i > 0; i = parent)
+    {
+        parent = (i - 1) / 2;
+        if(!earlier(m, heap[parent]))
+            break;
+        heap[i] = heap[parent];
+    }
+    heap[i] = m;
+}
+
+
+static sim_msg_t *heap_pop()
+{
+    sim_msg_t *top = heap[0], *last = heap[--heap_num];
+    int i = 0, child;
+
+
+    while((child = 2 * i + 1) < heap_num)
+    {
+        if(child + 1 < heap_num && earlier(heap[child + 1], heap[child]))
+            child++;
+        if(!earlier(heap[child], last))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if(heap_num > 0)
+        heap[i] = last;
+
+    return top;
+}
+
+
+static int matches(sim_msg_t *m, int source, int tag)
+{
+    return (source == MPI_ANY_SOURCE || m->source == source) && (tag == MPI_ANY_TAG || m->tag == tag);
+}
+
+
+/*
+* Hands the baton back to the scheduler and waits until it's our turn again. Called with the lock held.
+*/
+static void yield(int state)
+{
+    self->state = state;
+    running = -1;
+    handoffs++;
+    pthread_cond_signal(&scheduler_wakeup);
+    while(running != self_rank)
+        pthread_cond_wait(&self->resume, &lock);
+}
+
+
+static int sim_send(const void *buf, int count, MPI_Datatype datatype, int dest, int tag)
+{
+    sim_msg_t *m;
+    double departure, transfer;
+    int type_size, len, local;
+
+
+    if(dest < 0 || dest >= ranks_num)
+        return MPI_ERR_RANK;
+
+    MPI_Type_size(datatype, &type_size);
+    len = count * type_size;
+    m = (sim_msg_t *) MyMalloc(sizeof(sim_msg_t) + len);
+    m->source = self_rank;
+    m->dest = dest;
+    m->tag = tag;
+    m->len = len;
+    memcpy(m->data, buf, len);
+
+    local = host_of(self_rank) == host_of(dest);
+    departure = self->clock > self->link_free ? self->clock : self->link_free;
+    transfer = config.bandwidth > 0 ? len / config.bandwidth : 0;
+    self->link_free = departure + transfer;
+    m->arrival = departure + transfer + (local ? config.local_latency : config.latency);
+
+    pthread_mutex_lock(&lock);
+    m->seq = next_seq++;
+    heap_push(m);
+    if(local)
+        msgs_local++;
+    else
+        msgs_remote++;
+    bytes_total += len;
+    pthread_mutex_unlock(&lock);
+
+    return MPI_SUCCESS;
+}
+
+
+/*
+* @return The first delivered message from source with tag, NULL if there's none.
+*/
+static sim_msg_t *find(int source, int tag, int unlink)
+{
+    sim_msg_t *m, *prev = NULL;
+
+
+    for(m = self->head; m != NULL; prev = m, m = m->next)
+    {
+        if(matches(m, source, tag))
+            break;
+    }
+
+    if(m != NULL && unlink)
+    {
+        if(prev == NULL)
+            self->head = m->next;
+        else
+            prev->next = m->next;
+        if(self->tail == m)
+            self->tail = prev;
+    }
+
+    return m;
+}
+
+
+static void fill_status(MPI_Status *status, sim_msg_t *m)
+{
+    if(status == MPI_STATUS_IGNORE)
+        return;
+
+    status->MPI_SOURCE = m->source;
+    status->MPI_TAG = m->tag;
+    status->MPI_ERROR = MPI_SUCCESS;
+    MPI_Status_set_elements(status, MPI_BYTE, m->len);
+}
+
+
+/*
+* Blocks until a message from source with tag has been delivered.
+*/
+static sim_msg_t *wait_for(int source, int tag, int unlink)
+{
+    sim_msg_t *m;
+
+
+    pthread_mutex_lock(&lock);
+    while((m = find(source, tag, unlink)) == NULL)
+    {
+        self->wait_source = source;
+        self->wait_tag = tag;
+        yield(SIM_BLOCKED);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return m;
+}
+
+
+static int sim_recv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Status *status)
+{
+    sim_msg_t *m;
+    int type_size, len;
+
+
+    m = wait_for(source, tag, 1);
+    if(m->arrival > self->clock)
+        self->clock = m->arrival;
+    self->clock += config.cpu;
+
+    MPI_Type_size(datatype, &type_size);
+    len = m->len;
+    if(len > count * type_size)
+    {
+        print_error("Rank %d: a message of %d bytes from rank %d (tag %d) doesn't fit in %d bytes", self_rank, m->len,
+                    m->source, m->tag, count * type_size);
+        len = count * type_size;
+    }
+    memcpy(buf, m->data, len);
+    m->len = len;
+
+    fill_status(status, m);
+    free(m);
+    return MPI_SUCCESS;
+}
+
+
+static int sim_probe(int source, int tag, MPI_Status *status)
+{
+    fill_status(status, wait_for(source, tag, 0));
+    return MPI_SUCCESS;
+}
+
+
+/*
+* Nothing arrives while a rank polls, so a miss costs 'cpu' and lets the scheduler deliver what's due by then.
+*/
+static int sim_iprobe(int source, int tag, int *flag, MPI_Status *status)
+{
+    sim_msg_t *m;
+
+
+    pthread_mutex_lock(&lock);
+    m = find(source, tag, 0);
+    if(m == NULL)
+    {
+        self->clock += config.cpu;
+        yield(SIM_READY);
+        m = find(source, tag, 0);
+    }
+    pthread_mutex_unlock(&lock);
+
+    *flag = m != NULL;
+    if(m != NULL)
+        fill_status(status, m);
+    return MPI_SUCCESS;
+}
+
+
+static void sim_barrier()
+{
+    pthread_mutex_lock(&lock);
+    barrier_waiting++;
+    yield(SIM_BARRIER);
+    pthread_mutex_unlock(&lock);
+}
+
+
+static void sim_gather(const void *send_buf, int bytes, void *recv_buf, int root)
+{
+    if(self_rank == root)
+        gather_buf = recv_buf;
+    sim_barrier();
+    memcpy((char *)gather_buf + (size_t)self_rank * bytes, send_buf, bytes);
+    sim_barrier();
+}
+
+
+static double sim_wtime()
+{
+    return self != NULL ? self->clock : 0;
+}
+
+
+/*
+* Moves the clock of the rank, the other ranks run meanwhile.
+*/
+static void sim_sleep(double seconds)
+{
+    pthread_mutex_lock(&lock);
+    self->clock += seconds;
+    yield(SIM_READY);
+    pthread_mutex_unlock(&lock);
+}
+
+
+const transport_t transport_sim = {
+    "sim", sim_send, sim_recv, sim_probe, sim_iprobe, sim_barrier, sim_gather, sim_wtime, sim_sleep
+};
+
+
+static void *rank_thread(void *arg)
+{
+    sim_start_t *start = (sim_start_t *) arg;
+
+
+    self_rank = start->rank;
+    self = &ranks[start->rank];
+    transport_set_rank(start->rank);
+
+    pthread_mutex_lock(&lock);
+    while(running != self_rank)
+        pthread_cond_wait(&self->resume, &lock);
+    pthread_mutex_unlock(&lock);
+
+    start->ret = start->rank_main(start->rank, ranks_num, start->arg);
+
+    pthread_mutex_lock(&lock);
+    self->state = SIM_DONE;
+    if(self->clock > end_time)
+        end_time = self->clock;
+    running = -1;
+    pthread_cond_signal(&scheduler_wakeup);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+
+static void run(int r)
+{
+    ranks[r].state = SIM_RUNNING;
+    running = r;
+    pthread_cond_signal(&ranks[r].resume);
+    while(running != -1)
+        pthread_cond_wait(&scheduler_wakeup, &lock);
+}
+
+
+static void deliver(sim_msg_t *m)
+{
+    sim_rank_t *d = &ranks[m->dest];
+
+
+    m->next = NULL;
+    if(d->tail == NULL)
+        d->head = m;
+    else
+        d->tail->next = m;
+    d->tail = m;
+
+    if(d->state == SIM_BLOCKED && matches(m, d->wait_source, d->wait_tag))
+    {
+        d->state = SIM_READY;
+        if(m->arrival > d->clock)
+            d->clock = m->arrival;
+    }
+}
+
+
+/*
+* The scheduler loop, with the lock held.
+* @return 0 when every rank is done, -1 if they're all blocked and nothing is in flight.
+*/
+static int schedule()
+{
+    double latest;
+    int r, next, alive;
+
+
+    while(1)
+    {
+        next = -1;
+        alive = 0;
+        for(r = 0; r < ranks_num; r++)
+        {
+            if(ranks[r].state != SIM_DONE)
+                alive++;
+            if(ranks[r].state == SIM_READY && (next < 0 || ranks[r].clock < ranks[next].clock))
+                next = r;
+        }
+        if(alive == 0)
+            return 0;
+
+        if(barrier_waiting == alive)
+        {
+            latest = 0;
+            for(r = 0; r < ranks_num; r++)
+            {
+                if(ranks[r].state == SIM_BARRIER && ranks[r].clock > latest)
+                    latest = ranks[r].clock;
+            }
+            for(r = 0; r < ranks_num; r++)
+            {
+                if(ranks[r].state == SIM_BARRIER)
+                {
+                    ranks[r].state = SIM_READY;
+                    ranks[r].clock = latest;
+                }
+            }
+            barrier_waiting = 0;
+            continue;
+        }
+
+        if(next >= 0 && (heap_num == 0 || ranks[next].clock <= heap[0]->arrival))
+            run(next);
+        else if(heap_num > 0)
+            deliver(heap_pop());
+        else
+            return -1;
+    }
+}
+
+
+/*
+* Runs the ranks as threads under the scheduler and prints what the simulated network carried.
+* @return 0, the first non zero rank_main() return value, or -1 if the ranks deadlocked.
+*/
+int transport_sim_run(int ranks_total, transport_main_fn rank_main, void *arg)
+{
+    sim_start_t *starts;
+    pthread_t *threads;
+    sim_msg_t *m;
+    int r, ret = 0;
+
+
+    ranks_num = ranks_total;
+    ranks = (sim_rank_t *) MyCalloc(ranks_num, sizeof(sim_rank_t));
+    for(r = 0; r < ranks_num; r++)
+        pthread_cond_init(&ranks[r].resume, NULL);
+
+    threads = (pthread_t *) MyCalloc(ranks_num, sizeof(pthread_t));
+    starts = (sim_start_t *) MyCalloc(ranks_num, sizeof(sim_start_t));
+    for(r = 0; r < ranks_num; r++)
+    {
+        starts[r].rank = r;
+        starts[r].rank_main = rank_main;
+        starts[r].arg = arg;
+        if(pthread_create(&threads[r], NULL, rank_thread, &starts[r]) != 0)
+        {
+            fprintf(stderr, "Couldn't start the thread of rank %d out of %d\n", r, ranks_num);
+            exit(-1);
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    if(schedule() != 0)
+    {
+        for(r = 0; r < ranks_num; r++)
+        {
+            if(ranks[r].state == SIM_BLOCKED)
+                print_error("Simulation: rank %d is blocked on source %d tag %d at %.6f s", r, ranks[r].wait_source,
+                            ranks[r].wait_tag, ranks[r].clock);
+        }
+        print_error("Simulation: every rank is blocked and nothing is in flight");
+        exit(-1);
+    }
+    pthread_mutex_unlock(&lock);
+
+    for(r = 0; r < ranks_num; r++)
+    {
+        pthread_join(threads[r], NULL);
+        if(ret == 0)
+            ret = starts[r].ret;
+    }
+
+    print_result("Simulation: %d ranks, %d per host, finished at %.6f s of virtual time", ranks_num,
+                 config.ranks_per_host > 0 ? config.ranks_per_host : ranks_num, end_time);
+    print_result("Simulation: %lld messages (%lld between hosts), %lld bytes, %lld handoffs between ranks",
+                 msgs_local + msgs_remote, msgs_remote, bytes_total, handoffs);
+
+    while(heap_num > 0)
+        free(heap_pop());
+    for(r = 0; r < ranks_num; r++)
+    {
+        for(m = ranks[r].head; m != NULL; m = ranks[r].head)
+        {
+            ranks[r].head = m->next;
+            free(m);
+        }
+        pthread_cond_destroy(&ranks[r].resume);
+    }
+    free(heap);
+    free(ranks);
+    free(threads);
+    free(starts);
+
+    return ret;
+}
@@ -0,0 +1,406 @@
+#include "transport.h"
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+
+#include "my_funcs.h"
+
+
+/*
+* The threads transport: every rank is a thread and rank d has a ring for every rank s that ever sent to it, which only
+* s pushes to and only d pops from, so neither side takes a lock. The receiver moves what the rings hold to its own
+* queue (in the order of each ring, so two messages from the same rank keep their order like in MPI) and matches
+* source/tag there. A sender that finds the ring full empties its own rings meanwhile, two ranks that send to each
+* other can't block each other that way. An idle receiver sleeps on a condition that the senders signal.
+*/
+typedef struct thread_msg {
+
+    int source;
+    int tag;
+    int len;
+    struct thread_msg *next;
+    char data[];
+
+} thread_msg_t;
+
+
+typedef struct {
+
+    _Alignas(64) atomic_size_t head;        // Next slot to pop, the receiver's.
+    _Alignas(64) atomic_size_t tail;        // Next slot to push, the sender's.
+    thread_msg_t *slots[TRANSPORT_RING_SLOTS];
+
+} thread_ring_t;
+
+
+typedef struct {
+
+    _Atomic(thread_ring_t *) *rings;        // Per source rank, NULL until it sends something.
+    thread_msg_t *queue_head, *queue_tail;  // Popped but not received yet.
+    atomic_uint posted;                     // Messages pushed to the rings.
+    unsigned popped;
+
+    atomic_int sleeping;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+
+} thread_rank_t;
+
+
+typedef struct {
+
+    int rank;
+    transport_main_fn rank_main;
+    void *arg;
+    int ret;
+
+} thread_start_t;
+
+
+static thread_rank_t *ranks = NULL;
+static int ranks_num = 0;
+static pthread_barrier_t barrier;
+static void *gather_buf = NULL;
+static RANK_LOCAL thread_rank_t *self = NULL;
+static RANK_LOCAL int self_rank = 0;
+
+
+/*
+* Moves what the rings hold to our queue.
+* @return How many messages there were.
+*/
+static int drain()
+{
+    thread_ring_t *ring;
+    thread_msg_t *m;
+    size_t head, tail;
+    int s, got = 0;
+
+
+    if(atomic_load(&self->posted) == self->popped)
+        return 0;
+
+    for(s = 0; s < ranks_num; s++)
+    {
+        ring = atomic_load_explicit(&self->rings[s], memory_order_acquire);
+        if(ring == NULL)
+            continue;
+
+        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        for(; head != tail; head++)
+        {
+            m = ring->slots[head & (TRANSPORT_RING_SLOTS - 1)];
+            m->next = NULL;
+            if(self->queue_tail == NULL)
+                self->queue_head = m;
+            else
+                self->queue_tail->next = m;
+            self->queue_tail = m;
+            got++;
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+    }
+
+    self->popped += got;
+    return got;
+}
+
+
+/*
+* Waits for a sender, a while polling and then on the condition.
+*/
+static void wait_for_messages(int *spins)
+{
+    struct timespec ts;
+
+
+    if(++*spins < TRANSPORT_SPIN)
+    {
+        sched_yield();
+        return;
+    }
+    *spins = 0;
+
+    pthread_mutex_lock(&self->lock);
+    atomic_store(&self->sleeping, 1);
+    if(atomic_load(&self->posted) == self->popped)
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += TRANSPORT_SLEEP_US * 1000L;
+        if(ts.tv_nsec >= 1000000000L)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&self->wakeup, &self->lock, &ts);
+    }
+    atomic_store(&self->sleeping, 0);
+    pthread_mutex_unlock(&self->lock);
+}
+
+
+static int threads_send(const void *buf, int count, MPI_Datatype datatype, int dest, int tag)
+{
+    thread_rank_t *d;
+    thread_ring_t *ring;
+    thread_msg_t *m;
+    size_t tail;
+    int type_size, len, spins = 0;
+
+
+    if(dest < 0 || dest >= ranks_num)
+        return MPI_ERR_RANK;
+    d = &ranks[dest];
+
+    MPI_Type_size(datatype, &type_size);
+    len = count * type_size;
+    m = (thread_msg_t *) MyMalloc(sizeof(thread_msg_t) + len);
+    m->source = self_rank;
+    m->tag = tag;
+    m->len = len;
+    memcpy(m->data, buf, len);
+
+    ring = atomic_load_explicit(&d->rings[self_rank], memory_order_relaxed);
+    if(ring == NULL)
+    {
+        ring = (thread_ring_t *) MyCalloc(1, sizeof(thread_ring_t));
+        atomic_store_explicit(&d->rings[self_rank], ring, memory_order_release);
+    }
+
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while(tail - atomic_load_explicit(&ring->head, memory_order_acquire) == TRANSPORT_RING_SLOTS)
+    {
+        if(drain() == 0 && ++spins > TRANSPORT_SPIN)
+        {
+            sched_yield();
+            spins = 0;
+        }
+    }
+    ring->slots[tail & (TRANSPORT_RING_SLOTS - 1)] = m;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    // The receiver sets 'sleeping' before it looks at 'posted' for the last time, one of us sees the other.
+    atomic_fetch_add(&d->posted, 1);
+    if(atomic_load(&d->sleeping))
+    {
+        pthread_mutex_lock(&d->lock);
+        pthread_cond_signal(&d->wakeup);
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    return MPI_SUCCESS;
+}
+
+
+/*
+* @param unlink 1 to take it out of the queue.
+* @return The first message in our queue from source with tag (MPI_ANY_SOURCE/MPI_ANY_TAG match anything), NULL if
+*         there's none.
+*/
+static thread_msg_t *match(int source, int tag, int unlink)
+{
+    thread_msg_t *m, *prev = NULL;
+
+
+    for(m = self->queue_head; m != NULL; prev = m, m = m->next)
+    {
+        if((source == MPI_ANY_SOURCE || m->source == source) && (tag == MPI_ANY_TAG || m->tag == tag))
+            break;
+    }
+
+    if(m != NULL && unlink)
+    {
+        if(prev == NULL)
+            self->queue_head = m->next;
+        else
+            prev->next = m->next;
+        if(self->queue_tail == m)
+            self->queue_tail = prev;
+    }
+
+    return m;
+}
+
+
+static void fill_status(MPI_Status *status, thread_msg_t *m)
+{
+    if(status == MPI_STATUS_IGNORE)
+        return;
+
+    status->MPI_SOURCE = m->source;
+    status->MPI_TAG = m->tag;
+    status->MPI_ERROR = MPI_SUCCESS;
+    MPI_Status_set_elements(status, MPI_BYTE, m->len);
+}
+
+
+static int threads_probe(int source, int tag, MPI_Status *status)
+{
+    thread_msg_t *m;
+    int spins = 0;
+
+
+    while((m = match(source, tag, 0)) == NULL)
+    {
+        if(drain() == 0)
+            wait_for_messages(&spins);
+    }
+
+    fill_status(status, m);
+    return MPI_SUCCESS;
+}
+
+
+static int threads_recv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Status *status)
+{
+    thread_msg_t *m;
+    int type_size, len, spins = 0;
+
+
+    while((m = match(source, tag, 1)) == NULL)
+    {
+        if(drain() == 0)
+            wait_for_messages(&spins);
+    }
+
+    MPI_Type_size(datatype, &type_size);
+    len = m->len;
+    if(len > count * type_size)
+    {
+        print_error("Rank %d: a message of %d bytes from rank %d (tag %d) doesn't fit in %d bytes", self_rank, m->len,
+                    m->source, m->tag, count * type_size);
+        len = count * type_size;
+    }
+    memcpy(buf, m->data, len);
+    m->len = len;
+
+    fill_status(status, m);
+    free(m);
+    return MPI_SUCCESS;
+}
+
+
+static int threads_iprobe(int source, int tag, int *flag, MPI_Status *status)
+{
+    thread_msg_t *m;
+
+
+    m = match(source, tag, 0);
+    if(m == NULL && drain() > 0)
+        m = match(source, tag, 0);
+
+    *flag = m != NULL;
+    if(m != NULL)
+        fill_status(status, m);
+    return MPI_SUCCESS;
+}
+
+
+static void threads_barrier()
+{
+    pthread_barrier_wait(&barrier);
+}
+
+
+static void threads_gather(const void *send_buf, int bytes, void *recv_buf, int root)
+{
+    if(self_rank == root)
+        gather_buf = recv_buf;
+    pthread_barrier_wait(&barrier);
+    memcpy((char *)gather_buf + (size_t)self_rank * bytes, send_buf, bytes);
+    pthread_barrier_wait(&barrier);
+}
+
+
+static double threads_wtime()
+{
+    return MPI_Wtime();
+}
+
+
+const transport_t transport_threads = {
+    "threads", threads_send, threads_recv, threads_probe, threads_iprobe, threads_barrier, threads_gather, threads_wtime,
+    transport_real_sleep
+};
+
+
+static void *rank_thread(void *arg)
+{
+    thread_start_t *start = (thread_start_t *) arg;
+
+
+    self_rank = start->rank;
+    self = &ranks[start->rank];
+    transport_set_rank(start->rank);
+    start->ret = start->rank_main(start->rank, ranks_num, start->arg);
+    return NULL;
+}
+
+
+/*
+* Starts a thread per rank and waits for all of them.
+* @return 0, the first non zero rank_main() return value, or -1 if the threads couldn't start.
+*/
+int transport_threads_run(int ranks_total, transport_main_fn rank_main, void *arg)
+{
+    thread_start_t *starts;
+    pthread_t *threads;
+    thread_msg_t *m;
+    int r, s, ret = 0;
+
+
+    ranks_num = ranks_total;
+    ranks = (thread_rank_t *) MyCalloc(ranks_num, sizeof(thread_rank_t));
+    for(r = 0; r < ranks_num; r++)
+    {
+        ranks[r].rings = MyCalloc(ranks_num, sizeof(_Atomic(thread_ring_t *)));
+        pthread_mutex_init(&ranks[r].lock, NULL);
+        pthread_cond_init(&ranks[r].wakeup, NULL);
+    }
+    pthread_barrier_init(&barrier, NULL, ranks_num);
+
+    threads = (pthread_t *) MyCalloc(ranks_num, sizeof(pthread_t));
+    starts = (thread_start_t *) MyCalloc(ranks_num, sizeof(thread_start_t));
+    for(r = 0; r < ranks_num; r++)
+    {
+        starts[r].rank = r;
+        starts[r].rank_main = rank_main;
+        starts[r].arg = arg;
+        if(pthread_create(&threads[r], NULL, rank_thread, &starts[r]) != 0)
+        {
+            fprintf(stderr, "Couldn't start the thread of rank %d out of %d\n", r, ranks_num);
+            exit(-1);
+        }
+    }
+
+    for(r = 0; r < ranks_num; r++)
+    {
+        pthread_join(threads[r], NULL);
+        if(ret == 0)
+            ret = starts[r].ret;
+    }
+
+    for(r = 0; r < ranks_num; r++)
+    {
+        for(s = 0; s < ranks_num; s++)
+            free(atomic_load(&ranks[r].rings[s]));
+        for(m = ranks[r].queue_head; m != NULL; m = ranks[r].queue_head)
+        {
+            ranks[r].queue_head = m->next;
+            free(m);
+        }
+        free(ranks[r].rings);
+        pthread_mutex_destroy(&ranks[r].lock);
+        pthread_cond_destroy(&ranks[r].wakeup);
+    }
+    pthread_barrier_destroy(&barrier);
+    free(ranks);
+    free(threads);
+    free(starts);
+
+    return ret;
+}
@@ -0,0 +1,238 @@
+#include "workpool.h"
+
+#include "my_funcs.h"
+
+
+typedef struct {
+
+    workpool_t *pool;
+    int index;
+
+} worker_arg_t;
+
+
+static void queue_push(workpool_queue_t *q, workpool_task_t *task)
+{
+    pthread_mutex_lock(&q->lock);
+    task->next = NULL;
+    task->prev = q->tail;
+    if(q->tail == NULL)
+        q->head = task;
+    else
+        q->tail->next = task;
+    q->tail = task;
+    q->size++;
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+/*
+* @param steal 0: the oldest task (the owner), 1: the newest one (a thief).
+*/
+static workpool_task_t *queue_pop(workpool_queue_t *q, int steal)
+{
+    workpool_task_t *task;
+
+
+    pthread_mutex_lock(&q->lock);
+    task = steal ? q->tail : q->head;
+    if(task != NULL)
+    {
+        if(task->prev != NULL)
+            task->prev->next = task->next;
+        else
+            q->head = task->next;
+        if(task->next != NULL)
+            task->next->prev = task->prev;
+        else
+            q->tail = task->prev;
+        q->size--;
+        if(steal)
+            q->stolen++;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return task;
+}
+
+
+/*
+* Takes the next task of worker i: its own queue first, then the others starting from its neighbor.
+*/
+static workpool_task_t *take_task(workpool_t *pool, int i)
+{
+    workpool_task_t *task;
+    int k;
+
+
+    task = queue_pop(&pool->queues[i], 0);
+    for(k = 1; task == NULL && k < pool->threads_num; k++)
+        task = queue_pop(&pool->queues[(i + k) % pool->threads_num], 1);
+
+    return task;
+}
+
+
+static void *worker_main(void *arg)
+{
+    worker_arg_t *w = (worker_arg_t *)arg;
+    workpool_t *pool = w->pool;
+    workpool_task_t *task;
+    int i = w->index;
+
+
+    free(w);
+    if(pool->thread_init != NULL)
+        pool->thread_init(pool->init_arg);
+
+    while(1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while(pool->queued == 0 && !pool->stop)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if(pool->queued == 0 && pool->stop)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pool->queued--;         // There's a task for us in some queue.
+        pthread_mutex_unlock(&pool->lock);
+
+        while((task = take_task(pool, i)) == NULL)
+            ;                   // Another worker is between its reservation and its pop, it's not going to be long.
+
+        task->fn(task->arg);
+        free(task);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->done++;
+        if(--pool->in_flight == 0)
+            pthread_cond_broadcast(&pool->idle);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+
+/*
+* @return 0, or -1 if the threads couldn't be started.
+*/
+int workpool_start(workpool_t *pool, int threads_num, void (*thread_init)(void *arg), void *init_arg)
+{
+    worker_arg_t *w;
+    int i;
+
+
+    memset(pool, 0, sizeof(workpool_t));
+    pool->threads_num = threads_num;
+    pool->thread_init = thread_init;
+    pool->init_arg = init_arg;
+    pool->threads = (pthread_t *) MyCalloc(threads_num, sizeof(pthread_t));
+    pool->queues = (workpool_queue_t *) MyCalloc(threads_num, sizeof(workpool_queue_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    for(i = 0; i < threads_num; i++)
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+
+    for(i = 0; i < threads_num; i++)
+    {
+        w = (worker_arg_t *) MyCalloc(1, sizeof(worker_arg_t));
+        w->pool = pool;
+        w->index = i;
+        if(pthread_create(&pool->threads[i], NULL, worker_main, w) != 0)
+        {
+            free(w);
+            pool->threads_num = i;
+            workpool_stop(pool, NULL, NULL);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+void workpool_submit(workpool_t *pool, workpool_fn fn, void *arg)
+{
+    workpool_task_t *task;
+
+
+    task = (workpool_task_t *) MyCalloc(1, sizeof(workpool_task_t));
+    task->fn = fn;
+    task->arg = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->in_flight++;
+    queue_push(&pool->queues[pool->next_queue], task);
+    pool->next_queue = (pool->next_queue + 1) % pool->threads_num;
+    pool->queued++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+* @return 1 if every submitted task has finished.
+*/
+int workpool_idle(workpool_t *pool)
+{
+    int idle;
+
+
+    pthread_mutex_lock(&pool->lock);
+    idle = pool->in_flight == 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    return idle;
+}
+
+
+/*
+* Waits until every submitted task has finished.
+*/
+void workpool_quiesce(workpool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while(pool->in_flight > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+* Runs the tasks that are left, joins the workers and frees the pool.
+* @param done, stolen If not NULL they get how many tasks ran and how many of them were stolen.
+*/
+void workpool_stop(workpool_t *pool, long long *done, long long *stolen)
+{
+    int i;
+
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(i = 0; i < pool->threads_num; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    if(done != NULL)
+        *done = pool->done;
+    if(stolen != NULL)
+    {
+        *stolen = 0;
+        for(i = 0; i < pool->threads_num; i++)
+            *stolen += pool->queues[i].stolen;
+    }
+
+    for(i = 0; i < pool->threads_num; i++)
+        pthread_mutex_destroy(&pool->queues[i].lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->queues);
+    free(pool->threads);
+}
@@ -0,0 +1,64 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+
+/*
+* A work stealing thread pool. Every worker has its own queue, workpool_submit() deals the tasks round robin over the
+* queues and a worker with an empty queue steals the newest task of another one before it goes to sleep.
+* One thread submits (the one that receives the messages), any number of workers run the tasks.
+*/
+typedef void (*workpool_fn)(void *arg);
+
+
+typedef struct workpool_task {
+
+    workpool_fn fn;
+    void *arg;
+    struct workpool_task *prev, *next;
+
+} workpool_task_t;
+
+
+typedef struct {
+
+    pthread_mutex_t lock;
+    workpool_task_t *head, *tail;       // The owner takes the head (oldest), thieves take the tail.
+    int size;
+    long long stolen;                   // Tasks other workers took from this queue.
+
+} workpool_queue_t;
+
+
+typedef struct {
+
+    int threads_num;
+    pthread_t *threads;
+    workpool_queue_t *queues;
+    void (*thread_init)(void *arg);     // Runs first in every worker with init_arg (can be NULL).
+    void *init_arg;
+
+    pthread_mutex_t lock;               // Guards the counters and the conditions below.
+    pthread_cond_t work;                // Signaled when a task is submitted or the pool stops.
+    pthread_cond_t idle;                // Signaled when the last task in flight finishes.
+    int queued;                         // Tasks in the queues.
+    int in_flight;                      // Submitted and not finished.
+    int stop;
+    int next_queue;
+
+    long long done;
+
+} workpool_t;
+
+
+int workpool_start(workpool_t *pool, int threads_num, void (*thread_init)(void *arg), void *init_arg);
+void workpool_submit(workpool_t *pool, workpool_fn fn, void *arg);
+int workpool_idle(workpool_t *pool);
+void workpool_quiesce(workpool_t *pool);
+void workpool_stop(workpool_t *pool, long long *done, long long *stolen);
+
+#endif